@@ -2,9 +2,34 @@
 # Converts a raw file to a video file
 
 import cv2
+import struct
 import sys
 import numpy as np
 
+RAW_MAGIC = '\x89RAW\r\n\x1a\n'
+RAW_DTYPES = ['float32', 'float16', 'uint16', 'uint8']
+
+def read_raw(input_file):
+    # Returns the pieces of data in a raw file (version 1 or 2; see src/rawreducer.h), as 8-bit values
+    start = input_file.read(8)
+    if start != RAW_MAGIC:
+        ndata, data_size = struct.unpack('=II', start)
+        return data_size, (np.fromfile(input_file, dtype='float32', count=ndata * data_size) * 255).astype(np.uint8)
+    version, dtype, big_endian, codebook, data_size, ndata, k, bits = struct.unpack('<BBBBIQIB3x', input_file.read(24))
+    assert version == 2
+    dtype = np.dtype(RAW_DTYPES[dtype]).newbyteorder('>' if big_endian else '<')
+    if codebook:
+        means = np.fromfile(input_file, dtype=dtype, count=k * data_size).reshape(k, data_size)
+        packed = np.fromfile(input_file, dtype=np.uint8, count=(ndata * bits + 7) // 8)
+        label_bits = np.unpackbits(packed, bitorder='little')[:ndata * bits].reshape(ndata, bits)
+        labels = (label_bits.astype(np.uint64) << np.arange(bits, dtype=np.uint64)).sum(axis=1)
+        values = means[labels].flatten()
+    else:
+        values = np.fromfile(input_file, dtype=dtype, count=ndata * data_size)
+    if dtype.kind == 'f':
+        values = values * 255
+    return data_size, np.clip(values, 0, 255).astype(np.uint8)
+
 if len(sys.argv) < 6:
     print 'Error: Usage: {} <input file> <output file> <width> <height> <framerate>'.format(sys.argv[0])
     print 'The width in pixels, height in pixels, and framerate should have been outputted when you created the raw file.'
@@ -22,14 +47,14 @@ if not filename_out.endswith('.avi'):
 out = cv2.VideoWriter(filename_out,cv2.cv.CV_FOURCC('M','J','P','G'), framerate, (width,height))
 input_file = open(filename_in, 'rb')
 
-sizes = np.fromfile(input_file, dtype='uint32', count=2)
-assert sizes[1] == 3
-assert sizes[0] % (width * height) == 0
-nframes = sizes[0] // (width * height)
+data_size, values = read_raw(input_file)
+assert data_size == 3
+frame_size = width * height * 3
+assert len(values) % frame_size == 0
+nframes = len(values) // frame_size
 for frameno in xrange(nframes):
     print 'Processing frame {}/{}...'.format(frameno+1,nframes)
-    frame = np.fromfile(input_file, dtype='float32', count=width * height * 3)
-    frame = (frame*255).astype(np.uint8)
+    frame = values[frameno * frame_size:(frameno + 1) * frame_size]
     frame = np.reshape(frame, (height, width, 3))
     out.write(frame)
 
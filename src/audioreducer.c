@@ -15,13 +15,22 @@
     You should have received a copy of the GNU General Public License
     along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
 */
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200112L /* For clock_gettime */
+#define AUDIO_MONOTONIC
+#endif
 #include "audioreducer.h"
 
 #include "kmeans.h"
 #include "utils/filetypes/audio.h"
 #include "utils/misc/error.h"
+#include "utils/math/rand.h"
+#include "utils/misc/threads.h"
+#include "utils/misc/files.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 
 int cr_reduce_audio(u_audio_t* audio, size_t nvals, size_t take, float epsilon, size_t iterations) {
@@ -52,33 +61,417 @@ int cr_reduce_audio(u_audio_t* audio, size_t nvals, size_t take, float epsilon,
     return U_ERROR_SUCCESS;
 }
 
+static int audio_copy(u_audio_reader_t* reader, u_audio_writer_t* writer, u_u16_t* block) {
+    /* Copies the rest of the audio from reader to writer */
+    u_u32_t n;
+    do {
+        int err = u_audio_reader_read(reader, block, U_AUDIO_BLOCK_SIZE, &n);
+        if (!err) err = u_audio_writer_write(writer, block, n);
+        if (err) return err;
+    } while (n);
+    return U_ERROR_SUCCESS;
+}
+
+static int audio_table_make(const float* samples, size_t nsamples, size_t nvals, float epsilon, size_t iterations, u_u16_t* table) {
+    /* Runs k-means on samples, then sets table[v] to the value that v should be changed to, for every 16-bit v */
+    float* means = malloc(nvals * sizeof(*means));
+    if (!means)
+        return u_error_nomem();
+    int err = cr_kmeans_train(samples, nsamples, 1, nvals, 0, epsilon, iterations, means);
+    cr_kmeans_map_t map;
+    if (!err)
+        err = cr_kmeans_map_init(&map, means, nvals, 1);
+    if (err) {
+        free(means);
+        return err;
+    }
+    u_u32_t v;
+    for (v = 0; v < 65536; v++) {
+        float value = v / 65536.0f;
+        table[v] = means[cr_kmeans_map_nearest(&map, &value)] * 65536;
+    }
+    cr_kmeans_map_destroy(&map);
+    free(means);
+    return U_ERROR_SUCCESS;
+}
+
 int cr_reduce_audio_file(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations) {
-    u_audio_t* audio = u_audio_read(filename_in);
-    if (!audio) return u_error_code;
+    u_audio_reader_t* reader;
+    if (u_files_same(filename_in, filename_out))
+        return u_error_set(U_ERROR_ARGUMENT, "The output file is the input file, which would be overwritten before it was read.");
+    reader = u_audio_reader_open(filename_in);
+    if (!reader) return u_error_code;
+    u_u16_t nchannels = u_audio_reader_number_of_channels_get(reader);
+    u_audio_writer_t* writer = u_audio_writer_open(filename_out, nchannels, u_audio_reader_sample_rate_get(reader));
+    u_u16_t* block = malloc((size_t)U_AUDIO_BLOCK_SIZE * nchannels * sizeof(*block));
+    u_u16_t* table = malloc(65536 * sizeof(*table));
+    float* samples = NULL;
+    int err = U_ERROR_SUCCESS;
+    if (!writer) err = u_error_code;
+    else if (!block || !table) err = u_error_nomem();
 
-    if (nvals >= 65536) {
+    if (!err && nvals >= 65536) {
         /* More values than 16-bit numbers */
-        int err = u_audio_write(filename_out, audio);
-        u_audio_free(audio);
-        if (err) return err;
-        return U_ERROR_SUCCESS;
+        err = audio_copy(reader, writer, block);
+    } else if (!err) {
+        /* Pass 1: Pick the values to train on (if the file is mapped into memory, they can be
+           picked at random without reading the whole file) */
+        size_t nvalues = (size_t)u_audio_reader_number_of_samples_get(reader) * nchannels;
+        if (take <= 0 || take >= 1) take = 1;
+        size_t nsamples = nvalues * take;
+        if (nsamples > CR_AUDIO_MAX_SAMPLES) nsamples = CR_AUDIO_MAX_SAMPLES;
+        if (nsamples < nvals) nsamples = nvals;
+        if (nsamples > nvalues) nsamples = nvalues;
+        samples = malloc(nsamples * sizeof(*samples));
+        if (!samples) err = u_error_nomem();
+
+        u_u32_t n = 0, i;
+        if (u_audio_reader_mapped(reader) && !err) {
+            /* Only the values in the sample need to be looked at */
+            for (i = 0; i < nsamples; i++)
+                samples[i] = u_audio_reader_value_get(reader, nsamples == nvalues ? i : u_rand_size(0, nvalues)) / 65536.0f;
+        } else if (!err) {
+            u_rand_reservoir_t reservoir;
+            u_rand_reservoir_init(&reservoir, nsamples);
+            do {
+                err = u_audio_reader_read(reader, block, U_AUDIO_BLOCK_SIZE, &n);
+                if (err) break;
+                for (i = 0; i < n * nchannels; i++) {
+                    size_t slot = u_rand_reservoir_next(&reservoir);
+                    if (slot != (size_t)-1)
+                        samples[slot] = block[i] / 65536.0f;
+                }
+            } while (n);
+        }
+        if (!err) err = audio_table_make(samples, nsamples, nvals, epsilon, iterations, table);
+
+        /* Pass 2: Change each block of audio and write it */
+        if (!err) err = u_audio_reader_rewind(reader);
+        while (!err) {
+            err = u_audio_reader_read(reader, block, U_AUDIO_BLOCK_SIZE, &n);
+            if (err || !n) break;
+            for (i = 0; i < n * nchannels; i++)
+                block[i] = table[block[i]];
+            err = u_audio_writer_write(writer, block, n);
+        }
+    }
+    if (writer) {
+        int close_err = u_audio_writer_close(writer);
+        if (!err) err = close_err;
     }
+    u_audio_reader_close(reader);
+    free(block);
+    free(table);
+    free(samples);
+    return err;
+}
 
-    if (take < 0 || take >= 1) take = 0;
-    size_t ntake = u_audio_number_of_samples_get(audio) * take;
+typedef struct {
+    /* For reducing audio a segment (and channel) at a time */
+    size_t nchannels;
+    size_t nvals; /* The size of each codebook */
+    size_t segment_length; /* The number of samples in a segment (the last one can be longer) */
+    size_t nsegments;
+    size_t nsamples; /* The total number of samples in the audio */
+    size_t crossfade; /* The number of samples codebooks are cross-faded over */
+    float take;
+    float epsilon;
+    size_t iterations;
+    float* codebooks; /* Codebook for segment s, channel c: codebooks[(s*nchannels+c)*nvals ...], sorted */
+    u_u16_t* batch; /* Some of the segments, read from the file */
+    size_t batch_first; /* The first segment in batch */
+} segments_t;
 
-    int err = cr_reduce_audio(audio, nvals, ntake, epsilon, iterations);
-    if (err) {
-        u_audio_free(audio);
-        return err;
+static size_t segment_start(const segments_t* segments, size_t s) {
+    return s >= segments->nsegments ? segments->nsamples : s * segments->segment_length;
+}
+
+static int float_compare(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int segments_train(void* arg, size_t from, size_t to) {
+    /* Trains the codebooks for (segment, channel) pairs from..to of the batch */
+    segments_t* segments = arg;
+    size_t j, nvals = segments->nvals, nchannels = segments->nchannels;
+    int err = U_ERROR_SUCCESS;
+    for (j = from; j < to && !err; j++) {
+        size_t s = segments->batch_first + j / nchannels, c = j % nchannels;
+        size_t start = segment_start(segments, s), n = segment_start(segments, s + 1) - start;
+        const u_u16_t* in = &segments->batch[(start - segment_start(segments, segments->batch_first)) * nchannels + c];
+        float* codebook = &segments->codebooks[(s * nchannels + c) * nvals];
+        float* values = malloc(n * sizeof(*values));
+        if (!values)
+            return u_error_nomem();
+        size_t i;
+        for (i = 0; i < n; i++)
+            values[i] = in[i * nchannels] / 65536.0f;
+        if (n > nvals) {
+            size_t take = segments->take > 0 && segments->take < 1 ? n * segments->take : 0;
+            if (take && take < nvals) take = nvals;
+            err = cr_kmeans_train(values, n, 1, nvals, take, segments->epsilon, segments->iterations, codebook);
+        } else {
+            /* Fewer samples than values: they can all be kept */
+            for (i = 0; i < nvals; i++)
+                codebook[i] = values[i < n ? i : n - 1];
+        }
+        qsort(codebook, nvals, sizeof(*codebook), float_compare);
+        free(values);
     }
+    return err;
+}
 
-    err = u_audio_write(filename_out, audio);
-    if (err) {
-        u_audio_free(audio);
-        return err;
+static size_t audio_nearest(const float* codebook, size_t nvals, float value) {
+    /* Finds the index of the closest value in a sorted codebook */
+    size_t lo = 0, hi = nvals - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (value > (codebook[mid] + codebook[mid+1]) / 2)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    u_audio_free(audio);
+static int segments_remap(void* arg, size_t from, size_t to) {
+    /* Changes the values of segments from..to of the batch to the closest codebook values */
+    segments_t* segments = arg;
+    size_t nvals = segments->nvals, nchannels = segments->nchannels, half_fade = segments->crossfade / 2;
+    float* blended = malloc(nvals * sizeof(*blended));
+    if (!blended)
+        return u_error_nomem();
+    size_t j;
+    for (j = from; j < to; j++) {
+        size_t s = segments->batch_first + j;
+        size_t start = segment_start(segments, s), end = segment_start(segments, s + 1), t, c, i;
+        u_u16_t* samples = &segments->batch[(start - segment_start(segments, segments->batch_first)) * nchannels];
+        for (t = start; t < end; t++, samples += nchannels) {
+            /* Near a boundary between segments, the codebooks are mixed (half and half at the boundary) */
+            size_t other = s;
+            float weight = 1; /* How much of this segment's codebook to use */
+            if (s > 0 && t - start < half_fade) {
+                other = s - 1;
+                weight = 0.5f + 0.5f * (t - start) / half_fade;
+            } else if (s + 1 < segments->nsegments && end - t <= half_fade) {
+                other = s + 1;
+                weight = 0.5f + 0.5f * (end - t) / half_fade;
+            }
+            for (c = 0; c < nchannels; c++) {
+                const float* codebook = &segments->codebooks[(s * nchannels + c) * nvals];
+                if (other != s) {
+                    const float* other_codebook = &segments->codebooks[(other * nchannels + c) * nvals];
+                    for (i = 0; i < nvals; i++)
+                        blended[i] = weight * codebook[i] + (1 - weight) * other_codebook[i];
+                    codebook = blended;
+                }
+                float value = codebook[audio_nearest(codebook, nvals, samples[c] / 65536.0f)] * 65536;
+                samples[c] = value < 0 ? 0 : value > 65535 ? 65535 : value;
+            }
+        }
+    }
+    free(blended);
     return U_ERROR_SUCCESS;
 }
+
+int cr_reduce_audio_file_segmented(const char* filename_in, const char* filename_out, size_t nvals, float segment_seconds, float crossfade_seconds, float take, float epsilon, size_t iterations) {
+    u_audio_reader_t* reader;
+    if (u_files_same(filename_in, filename_out))
+        return u_error_set(U_ERROR_ARGUMENT, "The output file is the input file, which would be overwritten before it was read.");
+    reader = u_audio_reader_open(filename_in);
+    if (!reader) return u_error_code;
+    segments_t segments;
+    u_u32_t sample_rate = u_audio_reader_sample_rate_get(reader);
+    memset(&segments, 0, sizeof(segments));
+    segments.nchannels = u_audio_reader_number_of_channels_get(reader);
+    segments.nsamples = u_audio_reader_number_of_samples_get(reader);
+    segments.nvals = nvals;
+    segments.segment_length = segment_seconds * sample_rate;
+    if (segments.segment_length < 1) segments.segment_length = 1;
+    segments.nsegments = segments.nsamples / segments.segment_length;
+    if (segments.nsegments < 1) segments.nsegments = 1;
+    segments.crossfade = crossfade_seconds > 0 ? crossfade_seconds * sample_rate : 0;
+    if (segments.crossfade > segments.segment_length) segments.crossfade = segments.segment_length;
+    segments.take = take;
+    segments.epsilon = epsilon;
+    segments.iterations = iterations;
+
+    /* A batch is a few segments per thread; it has room for an extra segment, since the last one can be longer */
+    size_t batch_size = 4 * u_threads_count_get(), s, n;
+    segments.codebooks = malloc(segments.nsegments * segments.nchannels * nvals * sizeof(*segments.codebooks));
+    segments.batch = malloc((batch_size + 1) * segments.segment_length * segments.nchannels * sizeof(*segments.batch));
+    u_audio_writer_t* writer = u_audio_writer_open(filename_out, segments.nchannels, sample_rate);
+    int err = U_ERROR_SUCCESS, pass;
+    if (!writer) err = u_error_code;
+    else if (!segments.codebooks || !segments.batch) err = u_error_nomem();
+
+    /* Pass 0 trains the codebooks; pass 1 uses them (all of them have to be known, for cross-fading) */
+    for (pass = 0; pass < 2 && !err; pass++) {
+        if (pass == 1) err = u_audio_reader_rewind(reader);
+        for (s = 0; s < segments.nsegments && !err; s += n) {
+            n = segments.nsegments - s < batch_size ? segments.nsegments - s : batch_size;
+            u_u32_t length = segment_start(&segments, s + n) - segment_start(&segments, s);
+            segments.batch_first = s;
+            err = u_audio_reader_read(reader, segments.batch, length, NULL);
+            if (err) break;
+            if (pass == 0) {
+                err = u_threads_for(n * segments.nchannels, 1, segments_train, &segments);
+            } else {
+                err = u_threads_for(n, 1, segments_remap, &segments);
+                if (!err) err = u_audio_writer_write(writer, segments.batch, length);
+            }
+        }
+    }
+    if (writer) {
+        int close_err = u_audio_writer_close(writer);
+        if (!err) err = close_err;
+    }
+    u_audio_reader_close(reader);
+    free(segments.codebooks);
+    free(segments.batch);
+    return err;
+}
+
+static void stream_codebook_sort(float* codebook, float* counts, size_t nvals) {
+    /* Online updates only move values a little, so the codebook is nearly sorted, and insertion sort is quick */
+    size_t i, j;
+    for (i = 1; i < nvals; i++) {
+        float value = codebook[i], count = counts[i];
+        for (j = i; j > 0 && codebook[j-1] > value; j--) {
+            codebook[j] = codebook[j-1];
+            counts[j] = counts[j-1];
+        }
+        codebook[j] = value;
+        counts[j] = count;
+    }
+}
+
+static void stream_block_reduce(u_u16_t* samples, size_t nvalues, float* codebook, float* counts, float* sums, u_u32_t* nassigned, size_t nvals, float horizon) {
+    /* Changes each value to the closest one in the codebook (so a block only uses nvals values),
+       then moves each codebook value towards the mean of the values it was used for. Its count
+       is capped at horizon, so old audio is gradually forgotten. */
+    size_t i;
+    memset(sums, 0, nvals * sizeof(*sums));
+    memset(nassigned, 0, nvals * sizeof(*nassigned));
+    for (i = 0; i < nvalues; i++) {
+        float value = samples[i] / 65536.0f;
+        size_t j = audio_nearest(codebook, nvals, value);
+        float out = codebook[j] * 65536;
+        samples[i] = out < 0 ? 0 : out > 65535 ? 65535 : out;
+        sums[j] += value;
+        nassigned[j]++;
+    }
+    for (i = 0; i < nvals; i++) {
+        if (!nassigned[i]) continue;
+        counts[i] += nassigned[i];
+        if (counts[i] > horizon) counts[i] = horizon;
+        if (counts[i] < nassigned[i]) counts[i] = nassigned[i];
+        codebook[i] += (sums[i] - nassigned[i] * codebook[i]) / counts[i];
+    }
+    stream_codebook_sort(codebook, counts, nvals);
+}
+
+static double stream_seconds(void) {
+    /* Wall-clock time, since that's what the block has to be reduced within (clock would be CPU time) */
+#ifdef AUDIO_MONOTONIC
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+int cr_reduce_audio_stream(FILE* in, FILE* out, size_t nvals, u_u16_t nchannels, u_u32_t sample_rate, float block_seconds, float train_seconds, float epsilon, size_t iterations, FILE* timing) {
+    u_audio_reader_t* reader = u_audio_reader_stream_open(in, nchannels, sample_rate);
+    if (!reader) return u_error_code;
+    nchannels = u_audio_reader_number_of_channels_get(reader);
+    sample_rate = u_audio_reader_sample_rate_get(reader);
+    u_audio_writer_t* writer = u_audio_writer_stream_open(out, nchannels, sample_rate, u_audio_reader_raw(reader));
+    size_t block_length = block_seconds * sample_rate, train_length = train_seconds * sample_rate;
+    if (block_length < 1) block_length = 1;
+    if (block_length > U_AUDIO_UNKNOWN_LENGTH / 2) block_length = U_AUDIO_UNKNOWN_LENGTH / 2;
+    if (train_length < block_length) train_length = block_length;
+    if (train_length > U_AUDIO_UNKNOWN_LENGTH / 2) train_length = U_AUDIO_UNKNOWN_LENGTH / 2;
+    u_u16_t* samples = malloc((train_length > U_AUDIO_BLOCK_SIZE ? train_length : U_AUDIO_BLOCK_SIZE) * nchannels * sizeof(*samples));
+    float* values = malloc(train_length * nchannels * sizeof(*values));
+    float* codebook = malloc(nvals * sizeof(*codebook));
+    float* counts = calloc(nvals, sizeof(*counts));
+    float* sums = malloc(nvals * sizeof(*sums));
+    u_u32_t* nassigned = malloc(nvals * sizeof(*nassigned));
+    int err = U_ERROR_SUCCESS;
+    if (!writer) err = u_error_code;
+    else if (!samples || !values || !codebook || !counts || !sums || !nassigned) err = u_error_nomem();
+
+    u_u32_t n = 0;
+    size_t i, nvalues = 0;
+    if (!err && nvals >= 65536) {
+        /* More values than 16-bit numbers */
+        err = audio_copy(reader, writer, samples);
+        n = 0;
+    } else if (!err) {
+        /* Train on the first few seconds; the output starts once this is done */
+        err = u_audio_reader_read(reader, samples, train_length, &n);
+        nvalues = (size_t)n * nchannels;
+    }
+    if (!err && nvalues) {
+        for (i = 0; i < nvalues; i++)
+            values[i] = samples[i] / 65536.0f;
+        if (nvalues > nvals) {
+            err = cr_kmeans_train(values, nvalues, 1, nvals, 0, epsilon, iterations, codebook);
+        } else {
+            for (i = 0; i < nvals; i++)
+                codebook[i] = values[i < nvalues ? i : nvalues - 1];
+        }
+        qsort(codebook, nvals, sizeof(*codebook), float_compare);
+        /* Each codebook value starts out as the mean of the training values closest to it */
+        for (i = 0; i < nvalues; i++)
+            counts[audio_nearest(codebook, nvals, values[i])] += 1;
+    }
+    /* A value's count can get as high as the average count after training, so the
+       codebook adapts to changes over about as long as the training window */
+    float horizon = nvalues > nvals ? (float)nvalues / nvals : 1;
+    float budget = block_seconds * 1000, total_ms = 0, max_ms = 0;
+    unsigned long nblocks = 0, nover = 0;
+    size_t done = 0;
+    for (i = 0; i < nvals; i++)
+        if (counts[i] < 1) counts[i] = 1;
+
+    while (!err && n) {
+        /* First, the training window is output (a block at a time); then, blocks are read and output one by one */
+        u_u16_t* block = &samples[done * nchannels];
+        u_u32_t length = n - done < block_length ? n - done : block_length;
+        double start = stream_seconds();
+        stream_block_reduce(block, (size_t)length * nchannels, codebook, counts, sums, nassigned, nvals, horizon);
+        float ms = (float)((stream_seconds() - start) * 1000);
+        err = u_audio_writer_write(writer, block, length);
+        nblocks++;
+        total_ms += ms;
+        if (ms > max_ms) max_ms = ms;
+        if (ms > budget) nover++;
+        if (timing)
+            fprintf(timing, "Block %lu: %.3f ms%s\n", nblocks, ms, ms > budget ? " (over budget)" : "");
+        done += length;
+        if (done == n && !err) {
+            done = 0;
+            err = u_audio_reader_read(reader, samples, block_length, &n);
+        }
+    }
+    if (timing && nblocks)
+        fprintf(timing, "%lu blocks of %lu samples. Processing time per block: %.3f ms on average, %.3f ms at most; %lu over the budget of %.3f ms.\n",
+                nblocks, (unsigned long)block_length, total_ms / nblocks, max_ms, nover, budget);
+
+    if (writer) {
+        int close_err = u_audio_writer_close(writer);
+        if (!err) err = close_err;
+    }
+    u_audio_reader_close(reader);
+    free(samples);
+    free(values);
+    free(codebook);
+    free(counts);
+    free(sums);
+    free(nassigned);
+    return err;
+}
@@ -30,6 +30,7 @@ you can also find out what 4-bit, 2-bit or even 1-bit audio would sound like!
 #define COLORREDUCER_AUDIOREDUCER_H
 
 #include <stddef.h>
+#include <stdio.h>
 
 #include "utils/filetypes/audio.h"
 /**
@@ -42,12 +43,45 @@ Reduces the number of values in a piece of audio to \p nvals.
 */
 int cr_reduce_audio(u_audio_t* audio, size_t nvals, size_t take, float epsilon, size_t iterations);
 
+/** The most audio values \ref cr_reduce_audio_file will train k-means on. */
+#define CR_AUDIO_MAX_SAMPLES ((size_t)1 << 20)
+
 /**
-Applies value reduction to an audio file.
+Applies value reduction to an audio file. The file is read a block at a time
+(twice: once to pick a random sample of at most \ref CR_AUDIO_MAX_SAMPLES values to
+run k-means on, and once to change the values and write them), so this uses
+the same amount of memory however long the audio is.
 \param filename_in The filename of the input audio
 \param filename_out The filename of the output audio
-\param take The percentage of audio samples to actually use for k-means.
+\param take The percentage of audio values to actually use for k-means.
  */
 int cr_reduce_audio_file(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations);
 
+/**
+Like \ref cr_reduce_audio_file, but splits the audio into segments of \p segment_seconds
+and reduces each channel of each segment to its own \p nvals values, so quiet and loud
+passages each get values which suit them. The segments are done in parallel (see
+utils/misc/threads.h).
+\param crossfade_seconds If this is positive, around each boundary between segments,
+    the values of the two segments are mixed together over this many seconds, so that
+    the change isn't sudden.
+\returns An error code.
+ */
+int cr_reduce_audio_file_segmented(const char* filename_in, const char* filename_out, size_t nvals, float segment_seconds, float crossfade_seconds, float take, float epsilon, size_t iterations);
+
+/**
+Reduces audio as it streams from \p in to \p out (e.g. stdin to stdout, in a live processing
+chain), holding back as little of it as possible. See \ref u_audio_reader_stream_open for
+the formats which can be read; the output is in the same format (WAV or raw PCM).
+The values are trained on the first \p train_seconds of audio (so the output starts after that),
+and then the audio is reduced a block of \p block_seconds at a time, with the values moving
+towards the audio they are used for, so that they follow changes in it.
+\param nchannels The number of channels, if the input is raw PCM.
+\param sample_rate The sample rate, if the input is raw PCM.
+\param timing If this is not `NULL`, how long each block took to reduce is written to it,
+    so that it can be compared with \p block_seconds.
+\returns An error code.
+ */
+int cr_reduce_audio_stream(FILE* in, FILE* out, size_t nvals, u_u16_t nchannels, u_u32_t sample_rate, float block_seconds, float train_seconds, float epsilon, size_t iterations, FILE* timing);
+
 #endif /* COLORREDUCER_AUDIOREDUCER_H */
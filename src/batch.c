@@ -0,0 +1,427 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of ColorReducer.
+
+    ColorReducer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ColorReducer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200112L /* For fork, pipe, poll and waitpid */
+#define BATCH_FORK
+#endif
+#include "batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#ifdef BATCH_FORK
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include "utils/misc/error.h"
+#include "utils/misc/files.h"
+#include "utils/misc/threads.h"
+
+#define BATCH_LINE_MAX 4096 /* The longest file name in a list of files */
+
+typedef struct {
+    char** inputs; /* The files to reduce */
+    char** outputs; /* Where each one goes */
+    char* collides; /* Whether another file in the batch goes to the same place */
+    size_t n, capacity;
+    cr_batch_fn_t fn;
+    void* arg;
+    FILE* report;
+    size_t nfailed;
+} batch_t;
+
+static int batch_add(batch_t* batch, const char* dir, const char* name, const char* out_dir) {
+    /* Adds dir/name (or just name, if dir is NULL) to the batch, going to out_dir/(its base name) */
+    const char* base = strrchr(name, '/');
+    char* input = malloc((dir ? strlen(dir) + 1 : 0) + strlen(name) + 1);
+    char* output;
+    base = base ? base + 1 : name;
+    output = malloc(strlen(out_dir) + 1 + strlen(base) + 1);
+    if (!input || !output) {
+        free(input);
+        free(output);
+        return u_error_nomem();
+    }
+    if (dir)
+        sprintf(input, "%s/%s", dir, name);
+    else
+        strcpy(input, name);
+    sprintf(output, "%s/%s", out_dir, base);
+    if (batch->n == batch->capacity) {
+        size_t capacity = batch->capacity ? 2 * batch->capacity : 64;
+        char** inputs = realloc(batch->inputs, capacity * sizeof(*inputs));
+        char** outputs = inputs ? realloc(batch->outputs, capacity * sizeof(*outputs)) : NULL;
+        if (inputs) batch->inputs = inputs;
+        if (outputs) batch->outputs = outputs;
+        if (!inputs || !outputs) {
+            free(input);
+            free(output);
+            return u_error_nomem();
+        }
+        batch->capacity = capacity;
+    }
+    batch->inputs[batch->n] = input;
+    batch->outputs[batch->n] = output;
+    batch->n++;
+    return U_ERROR_SUCCESS;
+}
+
+static int batch_names_compare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int batch_dir_read(batch_t* batch, const char* dir, const char* out_dir) {
+    /* Adds the regular files in dir, in name order */
+    DIR* d = opendir(dir);
+    struct dirent* entry;
+    char** names = NULL;
+    size_t nnames = 0, capacity = 0, i;
+    int err = U_ERROR_SUCCESS;
+    if (!d)
+        return u_error_fopen(dir, "reading");
+    while (!err && (entry = readdir(d))) {
+        struct stat st;
+        char* path = malloc(strlen(dir) + strlen(entry->d_name) + 2);
+        if (!path) {
+            err = u_error_nomem();
+            break;
+        }
+        sprintf(path, "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            if (nnames == capacity) {
+                char** new_names;
+                capacity = capacity ? 2 * capacity : 64;
+                new_names = realloc(names, capacity * sizeof(*names));
+                if (!new_names) err = u_error_nomem();
+                else names = new_names;
+            }
+            if (!err && !(names[nnames] = malloc(strlen(entry->d_name) + 1)))
+                err = u_error_nomem();
+            if (!err)
+                strcpy(names[nnames++], entry->d_name);
+        }
+        free(path);
+    }
+    closedir(d);
+    if (!err && nnames)
+        qsort(names, nnames, sizeof(*names), batch_names_compare);
+    for (i = 0; i < nnames; i++) {
+        if (!err) err = batch_add(batch, dir, names[i], out_dir);
+        free(names[i]);
+    }
+    free(names);
+    return err;
+}
+
+static int batch_list_read(batch_t* batch, const char* list, const char* out_dir) {
+    /* Adds the files listed in list, one per line */
+    FILE* fp = fopen(list, "r");
+    char line[BATCH_LINE_MAX];
+    int err = U_ERROR_SUCCESS;
+    if (!fp)
+        return u_error_fopen(list, "reading");
+    while (!err && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (*line)
+            err = batch_add(batch, NULL, line, out_dir);
+    }
+    if (!err && ferror(fp))
+        err = u_error_set(U_ERROR_ACCESS, "Failed to read list of files.");
+    fclose(fp);
+    return err;
+}
+
+static int batch_outputs_compare(const void* a, const void* b) {
+    return strcmp(**(char** const*)a, **(char** const*)b);
+}
+
+static int batch_collisions_find(batch_t* batch) {
+    /* Sets collides for each file whose output has the same name as another file's */
+    char*** sorted; /* Pointers into batch->outputs, sorted by name */
+    size_t i;
+    batch->collides = calloc(batch->n ? batch->n : 1, 1);
+    sorted = malloc((batch->n ? batch->n : 1) * sizeof(*sorted));
+    if (!batch->collides || !sorted) {
+        free(sorted);
+        return u_error_nomem();
+    }
+    for (i = 0; i < batch->n; i++)
+        sorted[i] = &batch->outputs[i];
+    qsort(sorted, batch->n, sizeof(*sorted), batch_outputs_compare);
+    for (i = 1; i < batch->n; i++) {
+        if (!strcmp(*sorted[i], *sorted[i-1]))
+            batch->collides[sorted[i] - batch->outputs] = batch->collides[sorted[i-1] - batch->outputs] = 1;
+    }
+    free(sorted);
+    return U_ERROR_SUCCESS;
+}
+
+static int batch_file(const batch_t* batch, size_t i) {
+    /* Reduces file i. Returns an error code. */
+    if (batch->collides[i])
+        return u_error_set(U_ERROR_ARGUMENT, "Another file in the batch has the same name, so it would be written to the same place.");
+    if (u_files_same(batch->inputs[i], batch->outputs[i]))
+        return u_error_set(U_ERROR_ARGUMENT, "The output file would overwrite the input.");
+    return batch->fn(batch->inputs[i], batch->outputs[i], batch->arg);
+}
+
+static void batch_report(batch_t* batch, size_t i, int err, const char* message) {
+    if (err) {
+        fprintf(batch->report, "FAILED\t%s: %s (code %d)\n", batch->inputs[i], message, err);
+        batch->nfailed++;
+    } else {
+        fprintf(batch->report, "OK\t%s -> %s\n", batch->inputs[i], batch->outputs[i]);
+    }
+    fflush(batch->report);
+}
+
+#ifdef BATCH_FORK
+#define BATCH_NONE ((size_t)-1)
+
+typedef struct {
+    size_t index; /* Which file it was */
+    int err;
+    char message[CR_BATCH_MESSAGE_SIZE];
+} batch_result_t; /* (small enough to be written to a pipe all at once) */
+
+static void batch_worker(const batch_t* batch, int jobs, int results) {
+    /* Reduces the files whose indices come through jobs, until it's closed (in a child process) */
+    size_t index;
+    while (read(jobs, &index, sizeof(index)) == sizeof(index)) {
+        batch_result_t result;
+        memset(&result, 0, sizeof(result));
+        result.index = index;
+        result.err = batch_file(batch, index);
+        if (result.err)
+            sprintf(result.message, "%.*s", (int)sizeof(result.message) - 1, u_error_message);
+        if (write(results, &result, sizeof(result)) != sizeof(result))
+            break;
+    }
+}
+
+static int batch_worker_start(const batch_t* batch, size_t nworkers, size_t worker, int* jobs, int* results, pid_t* pids) {
+    /* Forks a process for worker number worker, with a pipe to send it files, and one to get
+       back its results. Returns nonzero if it couldn't be started. */
+    int job[2], result[2];
+    pid_t pid;
+    size_t i;
+    if (pipe(job))
+        return -1;
+    if (pipe(result)) {
+        close(job[0]);
+        close(job[1]);
+        return -1;
+    }
+    fflush(NULL); /* (so nothing buffered gets written by the worker too) */
+    pid = fork();
+    if (pid == 0) {
+        close(job[1]);
+        close(result[0]);
+        for (i = 0; i < nworkers; i++) {
+            /* (the other workers' pipes; they need to see their jobs pipe close when this process's parent closes it) */
+            if (jobs[i] >= 0) close(jobs[i]);
+            if (results[i] >= 0) close(results[i]);
+        }
+        u_threads_count_set(1); /* (the workers use every core between them) */
+        batch_worker(batch, job[0], result[1]);
+        _exit(0);
+    }
+    close(job[0]);
+    close(result[1]);
+    if (pid < 0) {
+        close(job[1]);
+        close(result[0]);
+        return -1;
+    }
+    jobs[worker] = job[1];
+    results[worker] = result[0];
+    pids[worker] = pid;
+    return 0;
+}
+
+static void batch_send(batch_t* batch, int* jobs, size_t* current, size_t worker, size_t* next) {
+    /* Gives the worker the next file, or tells it there are none left */
+    if (*next < batch->n && write(jobs[worker], next, sizeof(*next)) == sizeof(*next)) {
+        current[worker] = (*next)++;
+        return;
+    }
+    close(jobs[worker]);
+    jobs[worker] = -1;
+}
+
+static int batch_run_workers(batch_t* batch, size_t nworkers) {
+    int* jobs = malloc(nworkers * sizeof(*jobs));
+    int* results = malloc(nworkers * sizeof(*results));
+    pid_t* pids = malloc(nworkers * sizeof(*pids));
+    size_t* current = malloc(nworkers * sizeof(*current));
+    struct pollfd* fds = malloc(nworkers * sizeof(*fds));
+    size_t nrunning = 0, next = 0, w;
+    int err = U_ERROR_SUCCESS;
+    void (*old_sigpipe)(int);
+    batch_result_t result;
+    if (!jobs || !results || !pids || !current || !fds) {
+        free(jobs);
+        free(results);
+        free(pids);
+        free(current);
+        free(fds);
+        return u_error_nomem();
+    }
+    for (w = 0; w < nworkers; w++) {
+        jobs[w] = results[w] = -1;
+        current[w] = BATCH_NONE;
+    }
+    /* (so a worker which has died can't kill this process when it's sent a file) */
+    old_sigpipe = signal(SIGPIPE, SIG_IGN);
+    for (w = 0; w < nworkers; w++) {
+        if (batch_worker_start(batch, nworkers, w, jobs, results, pids))
+            break;
+        nrunning++;
+    }
+    if (!nrunning)
+        err = u_error_set(U_ERROR_SYSTEM, "Failed to start batch workers.");
+
+    /* Give each worker a file, then another one each time it finishes one */
+    for (w = 0; w < nrunning; w++)
+        batch_send(batch, jobs, current, w, &next);
+    while (nrunning) {
+        for (w = 0; w < nworkers; w++) {
+            fds[w].fd = results[w]; /* (poll skips the negative ones, for workers which have exited) */
+            fds[w].events = POLLIN;
+            fds[w].revents = 0;
+        }
+        if (poll(fds, nworkers, -1) < 0) {
+            if (errno == EINTR) continue;
+            err = u_error_set(U_ERROR_SYSTEM, "Failed to wait for batch workers.");
+            break;
+        }
+        for (w = 0; w < nworkers; w++) {
+            if (results[w] < 0 || !fds[w].revents)
+                continue;
+            if (read(results[w], &result, sizeof(result)) == sizeof(result)) {
+                batch_report(batch, result.index, result.err, result.message);
+                current[w] = BATCH_NONE;
+                batch_send(batch, jobs, current, w, &next);
+                continue;
+            }
+            /* The worker has exited */
+            close(results[w]);
+            results[w] = -1;
+            if (jobs[w] >= 0) {
+                close(jobs[w]);
+                jobs[w] = -1;
+            }
+            waitpid(pids[w], NULL, 0);
+            nrunning--;
+            if (current[w] != BATCH_NONE) {
+                /* It crashed reducing its file, so that file fails, and a new worker takes its place */
+                batch_report(batch, current[w], U_ERROR_OTHER, "The worker reducing this file exited unexpectedly.");
+                current[w] = BATCH_NONE;
+                if (next < batch->n && !batch_worker_start(batch, nworkers, w, jobs, results, pids)) {
+                    nrunning++;
+                    batch_send(batch, jobs, current, w, &next);
+                }
+            }
+        }
+    }
+
+    /* Anything left over couldn't be given to a worker */
+    for (w = 0; w < nworkers; w++) {
+        if (results[w] < 0) continue;
+        if (jobs[w] >= 0) close(jobs[w]);
+        close(results[w]);
+        waitpid(pids[w], NULL, 0);
+        if (current[w] != BATCH_NONE)
+            batch_report(batch, current[w], U_ERROR_OTHER, "The worker reducing this file exited unexpectedly.");
+    }
+    for (; !err && next < batch->n; next++)
+        batch_report(batch, next, U_ERROR_OTHER, "Every worker exited unexpectedly.");
+    signal(SIGPIPE, old_sigpipe);
+    free(jobs);
+    free(results);
+    free(pids);
+    free(current);
+    free(fds);
+    return err;
+}
+#endif
+
+int cr_batch_run(const char* input, const char* out_dir, size_t nworkers, cr_batch_fn_t fn, void* arg, FILE* report, size_t* nfailed) {
+    batch_t batch;
+    struct stat st;
+    size_t i;
+    int err;
+    memset(&batch, 0, sizeof(batch));
+    batch.fn = fn;
+    batch.arg = arg;
+    batch.report = report;
+    *nfailed = 0;
+
+    if (stat(input, &st))
+        return u_error_fopen(input, "reading");
+    if (S_ISDIR(st.st_mode))
+        err = batch_dir_read(&batch, input, out_dir);
+    else
+        err = batch_list_read(&batch, input, out_dir);
+    if (!err)
+        err = batch_collisions_find(&batch);
+    if (!err && stat(out_dir, &st)) {
+        #ifdef _WIN32
+        if (_mkdir(out_dir))
+        #else
+        if (mkdir(out_dir, 0777))
+        #endif
+            err = u_error_fopen(out_dir, "writing");
+    }
+
+    if (!err) {
+        if (nworkers > batch.n) nworkers = batch.n;
+        if (nworkers == 0) nworkers = 1;
+        #ifdef BATCH_FORK
+        err = batch_run_workers(&batch, nworkers);
+        #else
+        for (i = 0; i < batch.n; i++) {
+            int file_err = batch_file(&batch, i);
+            batch_report(&batch, i, file_err, u_error_message);
+        }
+        #endif
+    }
+    if (!err)
+        fprintf(report, "%lu of %lu files reduced, %lu failed.\n", (unsigned long)(batch.n - batch.nfailed),
+                (unsigned long)batch.n, (unsigned long)batch.nfailed);
+    *nfailed = batch.nfailed;
+
+    for (i = 0; i < batch.n; i++) {
+        free(batch.inputs[i]);
+        free(batch.outputs[i]);
+    }
+    free(batch.inputs);
+    free(batch.outputs);
+    free(batch.collides);
+    return err;
+}
@@ -0,0 +1,59 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of ColorReducer.
+
+    ColorReducer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ColorReducer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file batch.h
+\brief Reducing lots of files at once.
+
+Rather than starting ColorReducer once per file, a whole directory of files (or a list
+of them) can be reduced by one process, with a fixed pool of workers, so that every core
+is kept busy with a different file.
+
+On Unix-like systems, the workers are processes forked once at the start, which are sent
+one file at a time as they finish the last one. The reduce functions keep their error
+state in globals (see utils/misc/error.h), so they can't safely run side by side on
+threads of one process; separate processes also mean a file which crashes its worker
+only fails that file (a new worker is forked to take over the rest). Elsewhere, the files are reduced one after another.
+*/
+#ifndef COLORREDUCER_BATCH_H
+#define COLORREDUCER_BATCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define CR_BATCH_MESSAGE_SIZE 256 /**< The longest error message reported for a file */
+
+/** A function which reduces the file \p filename_in to \p filename_out (e.g. by calling the
+    right `cr_reduce_*_file` function for its type). \returns An error code, with the error
+    message set if it isn't \ref U_ERROR_SUCCESS. */
+typedef int (*cr_batch_fn_t)(const char* filename_in, const char* filename_out, void* arg);
+
+/**
+Reduces every file in \p input with \p fn, writing each one to a file of the same name in
+\p out_dir (which is created if it doesn't exist). Files which would be written to the same
+place as another one (e.g. `a/x.png` and `b/x.png` in a list) all fail, rather than
+overwriting each other.
+\param input Either a directory (every regular file in it is reduced, in name order, but not
+    those in its subdirectories), or a text file listing the files to reduce, one per line.
+\param nworkers The number of files to reduce at once (each worker reduces its file on one thread).
+\param report Each file is reported here as it finishes (`OK` or `FAILED`, with the error
+    message), followed by a summary.
+\param nfailed Set to the number of files which failed.
+\returns An error code, if the batch couldn't be run at all (a failing file isn't an error).
+*/
+int cr_batch_run(const char* input, const char* out_dir, size_t nworkers, cr_batch_fn_t fn, void* arg, FILE* report, size_t* nfailed);
+
+#endif /* COLORREDUCER_BATCH_H */
@@ -20,52 +20,131 @@
 #include "kmeans.h"
 #include "utils/filetypes/image.h"
 #include "utils/misc/error.h"
+#include "utils/misc/files.h"
+#include "utils/math/rand.h"
 
 #include <stdlib.h>
 
-int cr_reduce_image(u_image_t* image, size_t ncolors, size_t take, float epsilon, size_t iterations) {
-    int width = u_image_width_get(image),
-        height = u_image_height_get(image);
+typedef struct {
+    u_u32_t rgb; /* The last color looked up (0xFFFFFFFF for none, which can't happen as alpha is ignored) */
+    size_t index; /* The mean it was closest to */
+} color_cache_t;
 
-    /* The color of every pixel in the image */
-    float* colors = malloc(3 * width * height * sizeof(*colors));
-    if (!colors)
-        return u_error_nomem();
+static void color_to_floats(u_color_t color, float* out) {
+    out[0] = color.r / 256.0f;
+    out[1] = color.g / 256.0f;
+    out[2] = color.b / 256.0f;
+}
+
+static u_color_t color_from_floats(const float* in) {
+    return u_color_from_rgb(256 * in[0], 256 * in[1], 256 * in[2]);
+}
 
-    u_color_t** pixels = u_image_pixels_get(image);
+static size_t color_nearest(cr_kmeans_map_t* map, u_color_t color, color_cache_t* cache) {
+    /* Neighboring pixels are often the same color, so remember the last one */
+    u_u32_t rgb = u_color_to_u32(color) & 0xFFFFFF00;
+    if (rgb != cache->rgb) {
+        float point[3];
+        color_to_floats(color, point);
+        cache->index = cr_kmeans_map_nearest(map, point);
+        cache->rgb = rgb;
+    }
+    return cache->index;
+}
+
+static float* image_colors_get(u_image_t* image) {
+    /* The color of every pixel in the image, as a float[3*width*height] */
+    int width = u_image_width_get(image),
+        height = u_image_height_get(image);
+    float* colors = malloc(3 * (size_t)width * height * sizeof(*colors));
+    if (!colors) {
+        u_error_nomem();
+        return NULL;
+    }
+    size_t stride;
+    u_color_t* data = u_image_data_get(image, &stride);
     int x, y;
     size_t i = 0;
     for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            u_color_t pixel = pixels[y][x];
-            colors[i+0] = pixel.r / 256.0f;
-            colors[i+1] = pixel.g / 256.0f;
-            colors[i+2] = pixel.b / 256.0f;
-            i += 3;
-        }
+        const u_color_t* row = &data[y * stride];
+        for (x = 0; x < width; x++, i += 3)
+            color_to_floats(row[x], &colors[i]);
     }
+    return colors;
+}
+
+int cr_reduce_image(u_image_t* image, size_t ncolors, size_t take, float epsilon, size_t iterations) {
+    int width = u_image_width_get(image),
+        height = u_image_height_get(image);
+
+    float* colors = image_colors_get(image);
+    if (!colors)
+        return u_error_code;
 
     int err = cr_kmeans_run(colors, width * height, 3, ncolors, take, epsilon, iterations);
     if (err) {
         free(colors);
         return err;
     }
-    i = 0;
+    size_t stride;
+    u_color_t* data = u_image_data_get(image, &stride);
+    int x, y;
+    size_t i = 0;
     for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            u_color_t pixel = u_color_from_rgb(
-                256 * colors[i+0],
-                256 * colors[i+1],
-                256 * colors[i+2]
-            );
-            pixels[y][x] = pixel;
-            i += 3;
-        }
+        u_color_t* row = &data[y * stride];
+        for (x = 0; x < width; x++, i += 3)
+            row[x] = color_from_floats(&colors[i]);
     }
     free(colors);
     return U_ERROR_SUCCESS;
 }
 
+static int reduce_image_palette(u_image_t* image, const char* filename_out, size_t ncolors, size_t take, float epsilon, size_t iterations) {
+    /* Like cr_reduce_image, but writes the image to filename_out as a palette PNG (ncolors <= U_IMAGE_MAX_PALETTE) */
+    int width = u_image_width_get(image),
+        height = u_image_height_get(image);
+    float* colors = image_colors_get(image);
+    if (!colors)
+        return u_error_code;
+    float means[3*U_IMAGE_MAX_PALETTE];
+    int err = cr_kmeans_train(colors, (size_t)width * height, 3, ncolors, take, epsilon, iterations, means);
+    free(colors);
+    if (err)
+        return err;
+
+    u_color_t palette[U_IMAGE_MAX_PALETTE];
+    size_t i;
+    for (i = 0; i < ncolors; i++)
+        palette[i] = color_from_floats(&means[3*i]);
+    cr_kmeans_map_t map;
+    err = cr_kmeans_map_init(&map, means, ncolors, 3);
+    if (err)
+        return err;
+    u_u8_t* indices = malloc(width * sizeof(*indices));
+    u_image_writer_t* writer = indices ? u_image_writer_palette_open(filename_out, width, height, palette, ncolors) : NULL;
+    if (!writer) {
+        err = indices ? u_error_code : u_error_nomem();
+        free(indices);
+        cr_kmeans_map_destroy(&map);
+        return err;
+    }
+    size_t stride;
+    u_color_t* data = u_image_data_get(image, &stride);
+    color_cache_t cache = {0xFFFFFFFF, 0};
+    int x, y;
+    for (y = 0; y < height && !err; y++) {
+        const u_color_t* row = &data[y * stride];
+        for (x = 0; x < width; x++)
+            indices[x] = color_nearest(&map, row[x], &cache);
+        err = u_image_writer_indices_write(writer, &indices, 1);
+    }
+    int close_err = u_image_writer_close(writer);
+    if (!err) err = close_err;
+    free(indices);
+    cr_kmeans_map_destroy(&map);
+    return err;
+}
+
 int cr_reduce_image_file(const char* filename_in, const char* filename_out, size_t ncolors, float take, float epsilon, size_t iterations) {
     u_image_t* image = u_image_read(filename_in);
     if (!image)
@@ -73,10 +152,110 @@ int cr_reduce_image_file(const char* filename_in, const char* filename_out, size
 
     if (take < 0 || take >= 1) take = 0;
     size_t ntake = u_image_width_get(image)  * u_image_height_get(image) * take;
-    int err = cr_reduce_image(image, ncolors, ntake, epsilon, iterations);
-    if (err) return err;
-    err = u_image_write(filename_out, image);
-    if (err) return err;
+    int err;
+    if (ncolors <= U_IMAGE_MAX_PALETTE) {
+        err = reduce_image_palette(image, filename_out, ncolors, ntake, epsilon, iterations);
+    } else {
+        err = cr_reduce_image(image, ncolors, ntake, epsilon, iterations);
+        if (!err)
+            err = u_image_write(filename_out, image);
+    }
     u_image_free(image);
-    return U_ERROR_SUCCESS;
+    return err;
+}
+
+int cr_reduce_image_file_stream(const char* filename_in, const char* filename_out, size_t ncolors, float take, float epsilon, size_t iterations) {
+    /* Pass 2 reads the input again while writing the output, so they can't be the same file */
+    if (u_files_same(filename_in, filename_out))
+        return u_error_set(U_ERROR_ARGUMENT, "The output file is the input file, which would be overwritten before it was read.");
+
+    /* Pass 1: Pick the pixels to train on */
+    u_image_reader_t* reader = u_image_reader_open(filename_in);
+    if (!reader)
+        return u_error_code;
+    int width = u_image_reader_width_get(reader), height = u_image_reader_height_get(reader);
+    size_t npixels = (size_t)width * height;
+    if (take <= 0 || take >= 1) take = 1;
+    size_t nsamples = npixels * take;
+    if (nsamples > CR_STREAM_MAX_SAMPLES) nsamples = CR_STREAM_MAX_SAMPLES;
+    if (nsamples < ncolors) nsamples = ncolors;
+    if (nsamples > npixels) nsamples = npixels;
+
+    float* samples = malloc(3 * nsamples * sizeof(*samples));
+    float* means = malloc(3 * ncolors * sizeof(*means));
+    u_color_t* palette = malloc(ncolors * sizeof(*palette));
+    u_color_t* row = malloc(width * sizeof(*row));
+    u_u8_t* indices = malloc(width * sizeof(*indices));
+    if (!samples || !means || !palette || !row || !indices) {
+        free(samples);
+        free(means);
+        free(palette);
+        free(row);
+        free(indices);
+        u_image_reader_close(reader);
+        return u_error_nomem();
+    }
+
+    u_rand_reservoir_t reservoir;
+    u_rand_reservoir_init(&reservoir, nsamples);
+    size_t i;
+    int x, y, err = U_ERROR_SUCCESS;
+    for (y = 0; y < height && !err; y++) {
+        err = u_image_reader_rows_read(reader, &row, 1);
+        for (x = 0; x < width && !err; x++) {
+            size_t slot = u_rand_reservoir_next(&reservoir);
+            if (slot != (size_t)-1)
+                color_to_floats(row[x], &samples[3*slot]);
+        }
+    }
+    u_image_reader_close(reader);
+    if (!err)
+        err = cr_kmeans_train(samples, nsamples, 3, ncolors, 0, epsilon, iterations, means);
+    free(samples);
+    cr_kmeans_map_t map;
+    if (!err)
+        err = cr_kmeans_map_init(&map, means, ncolors, 3);
+    if (err) {
+        free(means);
+        free(palette);
+        free(row);
+        free(indices);
+        return err;
+    }
+    for (i = 0; i < ncolors; i++)
+        palette[i] = color_from_floats(&means[3*i]);
+
+    /* Pass 2: Map each row to the palette and write it straight away */
+    u_bool_t indexed = ncolors <= U_IMAGE_MAX_PALETTE;
+    u_image_writer_t* writer = NULL;
+    reader = u_image_reader_open(filename_in);
+    if (reader)
+        writer = indexed ? u_image_writer_palette_open(filename_out, width, height, palette, ncolors)
+                         : u_image_writer_open(filename_out, width, height);
+    if (!writer) err = u_error_code;
+    color_cache_t cache = {0xFFFFFFFF, 0};
+    for (y = 0; y < height && !err; y++) {
+        err = u_image_reader_rows_read(reader, &row, 1);
+        if (err) break;
+        if (indexed) {
+            for (x = 0; x < width; x++)
+                indices[x] = color_nearest(&map, row[x], &cache);
+            err = u_image_writer_indices_write(writer, &indices, 1);
+        } else {
+            for (x = 0; x < width; x++)
+                row[x] = palette[color_nearest(&map, row[x], &cache)];
+            err = u_image_writer_rows_write(writer, &row, 1);
+        }
+    }
+    if (writer) {
+        int close_err = u_image_writer_close(writer);
+        if (!err) err = close_err;
+    }
+    if (reader) u_image_reader_close(reader);
+    cr_kmeans_map_destroy(&map);
+    free(means);
+    free(palette);
+    free(row);
+    free(indices);
+    return err;
 }
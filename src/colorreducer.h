@@ -49,4 +49,18 @@ Applies color reduction to an image file.
  */
 int cr_reduce_image_file(const char* filename_in, const char* filename_out, size_t ncolors, float take, float epsilon, size_t iterations);
 
+/** The most pixels \ref cr_reduce_image_file_stream will train k-means on. */
+#define CR_STREAM_MAX_SAMPLES ((size_t)1 << 20)
+
+/**
+Like \ref cr_reduce_image_file, but never has the whole image in memory, so it can
+be used on enormous images. It reads the image twice: the first time, it picks
+a random sample of the pixels (at most \ref CR_STREAM_MAX_SAMPLES) to run k-means on,
+and the second time, it changes each row to the closest colors and writes it to the
+output file straight away. This uses `O(width+ncolors)` memory (plus the sample).
+The input can't be an interlaced PNG.
+\param take The fraction of pixels to sample. If this is not between 0 and 1, every pixel is (up to \ref CR_STREAM_MAX_SAMPLES).
+ */
+int cr_reduce_image_file_stream(const char* filename_in, const char* filename_out, size_t ncolors, float take, float epsilon, size_t iterations);
+
 #endif /* COLORREDUCER_COLORREDUCER_H */
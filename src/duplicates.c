@@ -0,0 +1,258 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of ColorReducer.
+
+    ColorReducer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ColorReducer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "duplicates.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils/misc/error.h"
+#include "utils/misc/threads.h"
+
+#define DUPLICATES_EMPTY ((size_t)-1)
+#define DUPLICATES_MIN_CAPACITY 16
+#define DUPLICATES_BATCH_ROWS ((size_t)1 << 20) /* The number of pieces of data which are hashed at a time */
+#define DUPLICATES_BLOCK_ROWS 4096 /* The number of pieces of data each thread hashes (or labels) at a time */
+
+typedef struct {
+    cr_duplicates_t* dups;
+    size_t first; /* The index of the first piece of data in the batch */
+    u_u4b_t* hashes; /* The hash of each piece of data in the batch */
+    size_t* order; /* The pieces of data in the batch (relative to first), sorted by shard */
+    size_t shard_starts[CR_DUPLICATES_SHARDS+1]; /* Where each shard's pieces of data start in order */
+    size_t unique_starts[CR_DUPLICATES_SHARDS]; /* The index of each shard's first unique row (when finishing) */
+    cr_kmeans_map_t* map; /* (when labelling) */
+    size_t* labels;
+} duplicates_batch_t;
+
+static u_u4b_t duplicates_hash(const float* point, size_t data_size) {
+    /* FNV-1a of the bytes, then a finalizer so that the top bits (which pick the shard) are well mixed */
+    const unsigned char* p = (const unsigned char*)point;
+    size_t i, n = data_size * sizeof(*point);
+    u_u4b_t h = 2166136261U;
+    for (i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static size_t duplicates_shard_of(u_u4b_t hash) {
+    return hash >> 24;
+}
+
+static cr_duplicates_entry_t* duplicates_lookup(const cr_duplicates_t* dups, const cr_duplicates_shard_t* shard, const float* point, u_u4b_t hash) {
+    /* Returns the entry of point, or the empty entry where it should go */
+    size_t mask = shard->capacity - 1, i, ds = dups->data_size;
+    for (i = hash & mask; ; i = (i + 1) & mask) {
+        cr_duplicates_entry_t* entry = &shard->entries[i];
+        if (entry->row == DUPLICATES_EMPTY
+            || (entry->hash == hash && !memcmp(&dups->data[entry->row * ds], point, ds * sizeof(*point))))
+            return entry;
+    }
+}
+
+static int duplicates_shard_grow(cr_duplicates_shard_t* shard) {
+    /* Doubles the capacity of shard */
+    size_t capacity = shard->capacity ? 2 * shard->capacity : DUPLICATES_MIN_CAPACITY, i, j;
+    cr_duplicates_entry_t* entries = malloc(capacity * sizeof(*entries));
+    if (!entries)
+        return u_error_nomem();
+    for (i = 0; i < capacity; i++)
+        entries[i].row = DUPLICATES_EMPTY;
+    for (i = 0; i < shard->capacity; i++) {
+        if (shard->entries[i].row == DUPLICATES_EMPTY) continue;
+        for (j = shard->entries[i].hash & (capacity - 1); entries[j].row != DUPLICATES_EMPTY; j = (j + 1) & (capacity - 1));
+        entries[j] = shard->entries[i];
+    }
+    free(shard->entries);
+    shard->entries = entries;
+    shard->capacity = capacity;
+    return U_ERROR_SUCCESS;
+}
+
+static int duplicates_hash_rows(void* arg, size_t from, size_t to) {
+    /* Hashes pieces of data from..to of the batch */
+    duplicates_batch_t* batch = arg;
+    const cr_duplicates_t* dups = batch->dups;
+    size_t i;
+    for (i = from; i < to; i++)
+        batch->hashes[i] = duplicates_hash(&dups->data[(batch->first + i) * dups->data_size], dups->data_size);
+    return U_ERROR_SUCCESS;
+}
+
+static int duplicates_insert_rows(void* arg, size_t from, size_t to) {
+    /* Adds the batch's pieces of data in shards from..to to their hash tables (only one thread uses each shard) */
+    duplicates_batch_t* batch = arg;
+    cr_duplicates_t* dups = batch->dups;
+    size_t s, i;
+    for (s = from; s < to; s++) {
+        cr_duplicates_shard_t* shard = &dups->shards[s];
+        for (i = batch->shard_starts[s]; i < batch->shard_starts[s+1]; i++) {
+            size_t row = batch->first + batch->order[i];
+            u_u4b_t hash = batch->hashes[batch->order[i]];
+            if (2 * (shard->count + 1) > shard->capacity) {
+                int err = duplicates_shard_grow(shard);
+                if (err) return err;
+            }
+            cr_duplicates_entry_t* entry = duplicates_lookup(dups, shard, &dups->data[row * dups->data_size], hash);
+            if (entry->row == DUPLICATES_EMPTY) {
+                entry->row = row;
+                entry->n = 0;
+                entry->hash = hash;
+                shard->count++;
+            }
+            entry->n++;
+        }
+    }
+    return U_ERROR_SUCCESS;
+}
+
+static int duplicates_number_rows(void* arg, size_t from, size_t to) {
+    /* Copies the unique rows of shards from..to, and replaces their counts with their indices */
+    duplicates_batch_t* batch = arg;
+    cr_duplicates_t* dups = batch->dups;
+    size_t s, i, ds = dups->data_size;
+    for (s = from; s < to; s++) {
+        cr_duplicates_shard_t* shard = &dups->shards[s];
+        size_t index = batch->unique_starts[s];
+        for (i = 0; i < shard->capacity; i++) {
+            cr_duplicates_entry_t* entry = &shard->entries[i];
+            if (entry->row == DUPLICATES_EMPTY) continue;
+            memcpy(&dups->rows[index * ds], &dups->data[entry->row * ds], ds * sizeof(*dups->rows));
+            dups->counts[index] = entry->n;
+            entry->n = index++;
+        }
+    }
+    return U_ERROR_SUCCESS;
+}
+
+static void duplicates_shards_free(cr_duplicates_t* dups) {
+    size_t s;
+    for (s = 0; s < CR_DUPLICATES_SHARDS; s++) {
+        free(dups->shards[s].entries);
+        dups->shards[s].entries = NULL;
+        dups->shards[s].capacity = dups->shards[s].count = 0;
+    }
+}
+
+int cr_duplicates_collapse(cr_duplicates_t* dups, const float* data, size_t ndata, size_t data_size, size_t max_unique) {
+    duplicates_batch_t batch;
+    size_t batch_rows = ndata < DUPLICATES_BATCH_ROWS ? ndata : DUPLICATES_BATCH_ROWS, n, i, s;
+    int err = U_ERROR_SUCCESS;
+    memset(dups, 0, sizeof(*dups));
+    dups->data = data;
+    dups->ndata = ndata;
+    dups->data_size = data_size;
+    batch.dups = dups;
+    batch.hashes = malloc((batch_rows ? batch_rows : 1) * sizeof(*batch.hashes));
+    batch.order = malloc((batch_rows ? batch_rows : 1) * sizeof(*batch.order));
+    if (!batch.hashes || !batch.order)
+        err = u_error_nomem();
+
+    for (batch.first = 0; batch.first < ndata && !err; batch.first += n) {
+        n = ndata - batch.first < batch_rows ? ndata - batch.first : batch_rows;
+        err = u_threads_for(n, DUPLICATES_BLOCK_ROWS, duplicates_hash_rows, &batch);
+        if (err) break;
+        /* Sort the batch by shard (counting sort), so each shard's pieces of data can be added by one thread */
+        memset(batch.shard_starts, 0, sizeof(batch.shard_starts));
+        for (i = 0; i < n; i++)
+            batch.shard_starts[duplicates_shard_of(batch.hashes[i]) + 1]++;
+        for (s = 0; s < CR_DUPLICATES_SHARDS; s++)
+            batch.shard_starts[s+1] += batch.shard_starts[s];
+        for (i = 0; i < n; i++)
+            batch.order[batch.shard_starts[duplicates_shard_of(batch.hashes[i])]++] = i;
+        for (s = CR_DUPLICATES_SHARDS; s > 0; s--) /* Each start was moved to the next shard's start */
+            batch.shard_starts[s] = batch.shard_starts[s-1];
+        batch.shard_starts[0] = 0;
+        err = u_threads_for(CR_DUPLICATES_SHARDS, 1, duplicates_insert_rows, &batch);
+        if (err) break;
+
+        dups->nunique = 0;
+        for (s = 0; s < CR_DUPLICATES_SHARDS; s++)
+            dups->nunique += dups->shards[s].count;
+        if (dups->nunique > max_unique) {
+            /* Too many unique rows for collapsing to be worth it */
+            free(batch.hashes);
+            free(batch.order);
+            duplicates_shards_free(dups);
+            dups->nunique = 0;
+            return U_ERROR_SUCCESS;
+        }
+    }
+    free(batch.hashes);
+    free(batch.order);
+    if (err) return err;
+
+    dups->rows = malloc((dups->nunique ? dups->nunique : 1) * data_size * sizeof(*dups->rows));
+    dups->counts = malloc((dups->nunique ? dups->nunique : 1) * sizeof(*dups->counts));
+    if (!dups->rows || !dups->counts)
+        return u_error_nomem();
+    batch.unique_starts[0] = 0;
+    for (s = 1; s < CR_DUPLICATES_SHARDS; s++)
+        batch.unique_starts[s] = batch.unique_starts[s-1] + dups->shards[s-1].count;
+    return u_threads_for(CR_DUPLICATES_SHARDS, 1, duplicates_number_rows, &batch);
+}
+
+size_t cr_duplicates_find(const cr_duplicates_t* dups, const float* point) {
+    u_u4b_t hash = duplicates_hash(point, dups->data_size);
+    return duplicates_lookup(dups, &dups->shards[duplicates_shard_of(hash)], point, hash)->n;
+}
+
+int cr_duplicates_train(const cr_duplicates_t* dups, size_t k, size_t take, float epsilon, size_t iterations, float* means) {
+    size_t ds = dups->data_size, i;
+    if (dups->nunique == 0)
+        return U_ERROR_ARGUMENT;
+    if (dups->nunique <= k) {
+        memcpy(means, dups->rows, dups->nunique * ds * sizeof(*means));
+        for (i = dups->nunique; i < k; i++)
+            memcpy(&means[i * ds], &dups->rows[(dups->nunique - 1) * ds], ds * sizeof(*means));
+        return U_ERROR_SUCCESS;
+    }
+    return cr_kmeans_train_weighted(dups->rows, dups->counts, dups->nunique, ds, k, take, epsilon, iterations, means);
+}
+
+static int duplicates_label_rows(void* arg, size_t from, size_t to) {
+    /* Finds the closest means to unique rows from..to */
+    duplicates_batch_t* batch = arg;
+    const cr_duplicates_t* dups = batch->dups;
+    size_t i;
+    for (i = from; i < to; i++)
+        batch->labels[i] = cr_kmeans_map_nearest(batch->map, &dups->rows[i * dups->data_size]);
+    return U_ERROR_SUCCESS;
+}
+
+int cr_duplicates_label(const cr_duplicates_t* dups, cr_kmeans_map_t* map, size_t* labels) {
+    duplicates_batch_t batch;
+    batch.dups = (cr_duplicates_t*)dups; /* (not modified) */
+    batch.map = map;
+    batch.labels = labels;
+    return u_threads_for(dups->nunique, DUPLICATES_BLOCK_ROWS, duplicates_label_rows, &batch);
+}
+
+void cr_duplicates_free(cr_duplicates_t* dups) {
+    duplicates_shards_free(dups);
+    free(dups->rows);
+    dups->rows = NULL;
+    free(dups->counts);
+    dups->counts = NULL;
+}
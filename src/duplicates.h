@@ -0,0 +1,92 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of ColorReducer.
+
+    ColorReducer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ColorReducer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file duplicates.h
+\brief Collapsing identical pieces of data
+
+Lots of data sets have many identical pieces of data (e.g. the pixels of a
+static background in a video). Instead of running k-means on all of them,
+\ref cr_duplicates_collapse finds the different pieces of data (which must be
+exactly the same, bit for bit, to count as identical), and how many times each
+one appears. k-means can then be run on just those, weighted by their counts
+(\ref cr_duplicates_train), and the mean of each piece of data can be looked up
+from the mean of its unique row (\ref cr_duplicates_find).
+
+The pieces of data are hashed and collapsed a batch at a time, in parallel (see
+utils/misc/threads.h). Each thread owns some of the \ref CR_DUPLICATES_SHARDS hash
+tables, which only store an index into the data (and a count) for each unique
+row, so the memory used grows with the number of unique rows, not the number of
+pieces of data.
+*/
+#ifndef COLORREDUCER_DUPLICATES_H
+#define COLORREDUCER_DUPLICATES_H
+
+#include <stddef.h>
+
+#include "utils/misc/types_exact.h"
+#include "kmeans.h"
+
+#define CR_DUPLICATES_SHARDS 256 /**< The number of hash tables the unique rows are split between */
+
+/** One entry of a \ref cr_duplicates_shard_t. */
+typedef struct {
+    size_t row; /**< The index of the first piece of data with these values (`(size_t)-1` if the entry is empty) */
+    size_t n; /**< How many pieces of data have these values (while collapsing), then the index of the unique row */
+    u_u4b_t hash; /**< The hash of the values */
+} cr_duplicates_entry_t;
+
+/** A hash table of some of the unique rows (the ones whose hashes start with the same byte). */
+typedef struct {
+    cr_duplicates_entry_t* entries; /**< The entries (a power of 2 of them, at most half full) */
+    size_t capacity; /**< The number of entries */
+    size_t count; /**< The number of entries which are used */
+} cr_duplicates_shard_t;
+
+/** The unique rows of some data. */
+typedef struct {
+    const float* data; /**< The data (which is not copied, so it must not be changed or freed while this is used) */
+    size_t ndata; /**< The number of pieces of data */
+    size_t data_size; /**< The size of each piece of data */
+    cr_duplicates_shard_t shards[CR_DUPLICATES_SHARDS]; /**< The hash tables */
+    size_t nunique; /**< The number of unique rows */
+    float* rows; /**< The unique rows, as a `float[nunique*data_size]` (NULL if collapsing was given up on) */
+    size_t* counts; /**< How many times each unique row appears in the data */
+} cr_duplicates_t;
+
+/**
+Finds the unique rows of \p data (a `float[ndata*data_size]`).
+\param max_unique If there are more unique rows than this, collapsing isn't worth it, so it is given
+                  up on: `dups->rows` is set to NULL, and the data should be used as it is.
+\returns An error code. \ref cr_duplicates_free should be called afterwards, even if it fails. */
+int    cr_duplicates_collapse(cr_duplicates_t* dups, const float* data, size_t ndata, size_t data_size, size_t max_unique);
+/** \returns The index of the unique row equal to \p point, which must be one of the pieces of data.
+    Doesn't modify \p dups, so this can be used by several threads at once. */
+size_t cr_duplicates_find(const cr_duplicates_t* dups, const float* point);
+/**
+Runs k-means on the unique rows, weighted by their counts (see \ref cr_kmeans_train_weighted).
+If there are only \p k unique rows or fewer, they are the means (the last one is repeated to make
+up \p k means), so no pieces of data are put together unnecessarily.
+\param take If this is positive, k-means is run on this many unique rows, randomly selected.
+\returns An error code. */
+int    cr_duplicates_train(const cr_duplicates_t* dups, size_t k, size_t take, float epsilon, size_t iterations, float* means);
+/** Sets `labels[i]` to the index of the closest mean (in \p map) to unique row `i`, for each of
+    the `dups->nunique` unique rows, in parallel. \returns An error code. */
+int    cr_duplicates_label(const cr_duplicates_t* dups, cr_kmeans_map_t* map, size_t* labels);
+/** Frees the memory used by \p dups (but not \p dups itself, or its data). */
+void   cr_duplicates_free(cr_duplicates_t* dups);
+
+#endif /* COLORREDUCER_DUPLICATES_H */
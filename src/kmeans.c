@@ -34,6 +34,7 @@ typedef struct {
     u_kdtree_t kdtree;
     size_t data_size, ndata, k;
     float* data;
+    size_t* weights; /* How many times each piece of data counts (NULL if they all count once) */
     float* means;
     float* new_means;
     size_t* data_idxs;
@@ -56,28 +57,34 @@ static void kmeans_state_free(kmeans_state_t* state) {
     state->data_idxs = NULL;
     free(state->num_belonging_to);
     state->num_belonging_to = NULL;
-    if (state->was_data_alloced)
+    if (state->was_data_alloced) {
         free(state->data);
+        free(state->weights);
+    }
 }
 
-static int kmeans_state_init(kmeans_state_t* state, float* data, size_t ndata, size_t data_size, size_t k, size_t take) {
+static int kmeans_state_init(kmeans_state_t* state, const float* data, const size_t* weights, size_t ndata, size_t data_size, size_t k, size_t take) {
     /* Initializes various variables and initializes means to random points. Returns an error code */
 
     memset(state, 0, sizeof(*state)); /* Most things are initialized to 0 (make sure pointers are NULL so that kmeans_state_free doesn't try to free them) */
     if (take > 0 && take < ndata) {
 
         state->data = malloc(take * data_size * sizeof(*state->data));
-        if (!state->data) {
+        state->was_data_alloced = U_TRUE;
+        if (weights)
+            state->weights = malloc(take * sizeof(*state->weights));
+        if (!state->data || (weights && !state->weights)) {
             kmeans_state_free(state);
             return u_error_nomem();
         }
-        state->was_data_alloced = U_TRUE;
         size_t i, need = take, left = ndata, data_index = 0;
         for (i = 0; i < ndata; i++) {
-            if (u_rand_double() < (double)need/left) {
+            if (u_rand_size(0, left) < need) { /* (so once need == left, every point left is picked) */
                 /* take this one */
                 memcpy(&state->data[data_index * data_size], &data[i * data_size],
                        data_size * sizeof(*state->data));
+                if (weights)
+                    state->weights[data_index] = weights[i];
                 need--;
                 data_index++;
             }
@@ -87,7 +94,8 @@ static int kmeans_state_init(kmeans_state_t* state, float* data, size_t ndata, s
         state->ndata = take;
 
     } else {
-        state->data = data;
+        state->data = (float*)data; /* Not modified, since was_data_alloced is false */
+        state->weights = (size_t*)weights;
         state->ndata = ndata;
     }
 
@@ -135,7 +143,7 @@ static int kmeans_state_init(kmeans_state_t* state, float* data, size_t ndata, s
     }
 
     for (i = 0; i < k; i++) {
-        memcpy(&state->means[i*data_size], &data[state->data_idxs[i]*data_size],
+        memcpy(&state->means[i*data_size], &state->data[state->data_idxs[i]*data_size],
                 data_size * sizeof(*state->means));
     }
     free(state->data_idxs);
@@ -173,9 +181,10 @@ static int kmeans_state_run_iteration(kmeans_state_t* state) {
     size_t i, j;
     for (i = 0; i < state->ndata; i++) {
         size_t belongs_to = *(size_t*)u_kdtree_nearest(&state->kdtree, &state->data[i*ds], NULL);
+        size_t weight = state->weights ? state->weights[i] : 1;
         for (j = 0; j < state->data_size; j++)
-            state->new_means[belongs_to*ds+j] += state->data[i*ds+j];
-        state->num_belonging_to[belongs_to]++;
+            state->new_means[belongs_to*ds+j] += weight * state->data[i*ds+j];
+        state->num_belonging_to[belongs_to] += weight;
     }
 
     /* Turn sum into mean, compute change. Move new_means to means. */
@@ -193,16 +202,23 @@ static int kmeans_state_run_iteration(kmeans_state_t* state) {
     return U_ERROR_SUCCESS;
 }
 
-int cr_kmeans_run(float* data, size_t ndata, size_t data_size, size_t k, size_t take, float epsilon, size_t iterations) {
+int cr_kmeans_train(const float* data, size_t ndata, size_t data_size, size_t k, size_t take, float epsilon, size_t iterations, float* means) {
+    return cr_kmeans_train_weighted(data, NULL, ndata, data_size, k, take, epsilon, iterations, means);
+}
+
+static int kmeans_train(const float* data, const size_t* weights, size_t ndata, size_t data_size, size_t k, size_t take, float epsilon, size_t iterations, const float* start, float* means) {
+    /* Runs k-means, starting at the means in start (or random pieces of data if it's NULL) */
     if (ndata == 0 || data_size == 0) return U_ERROR_ARGUMENT;
     kmeans_state_t state;
-    int err = kmeans_state_init(&state, data, ndata, data_size, k, take);
+    int err = kmeans_state_init(&state, data, weights, ndata, data_size, k, take);
     if (err) return err;
+    if (start)
+        memcpy(state.means, start, k * data_size * sizeof(*state.means));
 
     size_t i = 0;
     while (state.change > epsilon && (iterations == 0 || i < iterations)) {
         #ifdef CR_KMEANS_DEBUG
-        printf("Iteration %lu. Change: %f\n", i+1, state.change);
+        fprintf(stderr, "Iteration %lu. Change: %f\n", i+1, state.change);
         #endif
         err = kmeans_state_run_iteration(&state);
         if (err) return err;
@@ -210,16 +226,71 @@ int cr_kmeans_run(float* data, size_t ndata, size_t data_size, size_t k, size_t
     }
 
     #ifdef CR_KMEANS_DEBUG
-    printf("Iteration %lu. Change: %f\n", i+1, state.change);
+    fprintf(stderr, "Iteration %lu. Change: %f\n", i+1, state.change);
     #endif
 
+    memcpy(means, state.means, k * data_size * sizeof(*means));
+    kmeans_state_free(&state);
+    return U_ERROR_SUCCESS;
+}
+
+int cr_kmeans_train_weighted(const float* data, const size_t* weights, size_t ndata, size_t data_size, size_t k, size_t take, float epsilon, size_t iterations, float* means) {
+    return kmeans_train(data, weights, ndata, data_size, k, take, epsilon, iterations, NULL, means);
+}
+
+int cr_kmeans_train_from(const float* data, size_t ndata, size_t data_size, size_t k, size_t take, float epsilon, size_t iterations, float* means) {
+    return kmeans_train(data, NULL, ndata, data_size, k, take, epsilon, iterations, means, means);
+}
+
+int cr_kmeans_map_init(cr_kmeans_map_t* map, const float* means, size_t k, size_t data_size) {
+    map->means = means;
+    map->k = k;
+    map->data_size = data_size;
+    u_kdtree_construct(&map->kdtree, data_size, sizeof(size_t));
+    size_t* idxs = malloc(k * sizeof(*idxs));
+    if (!idxs)
+        return u_error_nomem();
+    size_t i;
+    for (i = 0; i < k; i++)
+        idxs[i] = i;
+    int err = u_kdtree_build(&map->kdtree, means, idxs, k);
+    free(idxs);
+    if (err) return u_error_code;
+    return U_ERROR_SUCCESS;
+}
+
+size_t cr_kmeans_map_nearest(cr_kmeans_map_t* map, const float* point) {
+    return *(const size_t*)u_kdtree_nearest(&map->kdtree, point, NULL);
+}
+
+void cr_kmeans_map_destroy(cr_kmeans_map_t* map) {
+    u_kdtree_destroy(&map->kdtree);
+}
+
+int cr_kmeans_run(float* data, size_t ndata, size_t data_size, size_t k, size_t take, float epsilon, size_t iterations) {
+    if (ndata == 0 || data_size == 0) return U_ERROR_ARGUMENT;
+    float* means = malloc(k * data_size * sizeof(*means));
+    if (!means)
+        return u_error_nomem();
+    int err = cr_kmeans_train(data, ndata, data_size, k, take, epsilon, iterations, means);
+    if (err) {
+        free(means);
+        return err;
+    }
+
     /* Move data to means */
-    err = kmeans_state_build_kdtree(&state);
-    if (err) return err;
+    cr_kmeans_map_t map;
+    err = cr_kmeans_map_init(&map, means, k, data_size);
+    if (err) {
+        free(means);
+        return err;
+    }
+    size_t i;
     for (i = 0; i < ndata; i++) {
-        size_t belongs_to = *(size_t*)u_kdtree_nearest(&state.kdtree, &data[i*data_size], NULL);
-        memcpy(&data[i*data_size], &state.means[belongs_to*data_size], data_size * sizeof(*data));
+        size_t belongs_to = cr_kmeans_map_nearest(&map, &data[i*data_size]);
+        memcpy(&data[i*data_size], &means[belongs_to*data_size], data_size * sizeof(*data));
     }
-    kmeans_state_free(&state);
+    cr_kmeans_map_destroy(&map);
+    free(means);
     return U_ERROR_SUCCESS;
 }
@@ -29,6 +29,8 @@ and (additional) memory `O(k*data_size)`.
 
 #include <stddef.h>
 
+#include "utils/containers/kdtree.h"
+
 /**
  Run k-means on \p data **and sets each element of data to its respective mean**.
 \p data is expected to be a `float[ndata*data_size]` (where data[0..data_size] refers to the first piece of data, etc.).
@@ -42,4 +44,43 @@ and (additional) memory `O(k*data_size)`.
 \returns An error code. */
 int cr_kmeans_run(float* data, size_t ndata, size_t data_size, size_t k, size_t take, float epsilon, size_t iterations);
 
+/**
+Like \ref cr_kmeans_run, but doesn't change \p data. Instead, the means are put in \p means,
+which should be a `float[k*data_size]`. Use \ref cr_kmeans_map_t to find which mean
+each piece of data belongs to.
+\returns An error code. */
+int cr_kmeans_train(const float* data, size_t ndata, size_t data_size, size_t k, size_t take, float epsilon, size_t iterations, float* means);
+
+/**
+Like \ref cr_kmeans_train, but piece of data `i` counts as `weights[i]` pieces of data
+(e.g. if it stands for that many identical ones; see duplicates.h). If \p take is positive,
+that many pieces of data are picked (each with the same chance, whatever its weight), and they
+keep their weights. If \p weights is NULL, every piece of data counts once.
+\returns An error code. */
+int cr_kmeans_train_weighted(const float* data, const size_t* weights, size_t ndata, size_t data_size, size_t k, size_t take, float epsilon, size_t iterations, float* means);
+
+/**
+Like \ref cr_kmeans_train, but the means start at the values already in \p means (e.g. the
+means of similar data, like the previous frame of a video), rather than at random pieces of
+data. If the data hasn't changed much, this only takes an iteration or two.
+\returns An error code. */
+int cr_kmeans_train_from(const float* data, size_t ndata, size_t data_size, size_t k, size_t take, float epsilon, size_t iterations, float* means);
+
+/** For finding the closest mean to a piece of data. */
+typedef struct {
+    u_kdtree_t kdtree; /**< The means (the values are their indices) */
+    const float* means; /**< The means, as a `float[k*data_size]` */
+    size_t k; /**< The number of means */
+    size_t data_size; /**< The size of each mean */
+} cr_kmeans_map_t;
+
+/** Sets up \p map to find the closest of the \p k means in \p means. \p means is not
+    copied, so it must not be freed before \p map is destroyed. \returns An error code. */
+int    cr_kmeans_map_init(cr_kmeans_map_t* map, const float* means, size_t k, size_t data_size);
+/** \returns The index of the closest mean to \p point. Doesn't modify \p map, so this can
+    be used by several threads at once. */
+size_t cr_kmeans_map_nearest(cr_kmeans_map_t* map, const float* point);
+/** Frees the memory used by \p map (but not \p map itself, or its means). */
+void   cr_kmeans_map_destroy(cr_kmeans_map_t* map);
+
 #endif /* COLORREDUCER_KMEANS_H */
@@ -20,6 +20,8 @@
 #include "audioreducer.h"
 #include "rawreducer.h"
 #include "textreducer.h"
+#include "videoreducer.h"
+#include "batch.h"
 #include "version.h"
 
 #include <stdio.h>
@@ -29,14 +31,17 @@
 
 #include "utils/misc/error.h"
 #include "utils/filetypes/audio.h"
+#include "utils/filetypes/image.h"
 #include "utils/misc/args.h"
+#include "utils/misc/files.h"
+#include "utils/misc/threads.h"
 
 int voronoify_main(int argc, char** argv) {
     if (argc < 3) {
         fprintf(stderr, "Error: Usage: %s <input image> <output image>\n", argv[0]);
         return EXIT_FAILURE;
     }
-    int err = cr_voronoify(argv[1], argv[2]);
+    int err = cr_voronoify(argv[1], argv[2], CR_VORONOI_KDTREE);
     if (err) u_error_throw();
 
     return EXIT_SUCCESS;
@@ -58,15 +63,52 @@ void show_help(void) {
     printf("ColorReducer Version %d.%d\n", CR_VERSION_MAJOR, CR_VERSION_MINOR);
     printf("Usage: ColorReducer <input file> <output file>\n");
     printf("Command-line options:\n"
+            "-A, --voronoi-animation\tThe input file describes moving voronoi seeds (see voronoi.h), and the output\n"
+            "\t\t\tfile name contains a number format like %%04d for the frame number.\n"
             "-a, --audio\t\tSpecifies the input file as an audio file (currently only WAV is supported).\n"
+            "-b, --batch\t\tReduce every file in a directory, or listed (one per line) in a text file, into\n"
+            "\t\t\tthe directory given by -O, several files at once (see -j). Usage: --batch <input dir|list file> -O <output dir>\n"
+            "-c, --channels\t\tThe number of channels of raw PCM audio read from a stream (default: 2).\n"
+            "-d, --timing\t\tWhen streaming audio, report how long each block takes to stderr. For video,\n"
+            "\t\t\treport how busy each stage of the pipeline was.\n"
             "-e, --epsilon\t\tSet the value for epsilon\n"
-            "-i, --image\t\tSpecifies the input file as an image file (currently only PNG is supported).\n"
+            "-F, --train-frames\tThe number of frames of video to train on (default: %d).\n"
+            "-f, --crossfade\t\tWith --segment, mix the values of neighboring segments over this many seconds.\n"
+            "-g, --segment\t\tReduce each channel of each segment of this many seconds of audio separately.\n"
+            "-i, --image\t\tSpecifies the input file as an image file (PNG, PPM, PAM or QOI).\n"
+            "-j, --threads\t\tSet the number of threads to use (default: one per processor).\n"
             "-k, --values\t\tSet the number of values to reduce the file to.\n"
+            "-l, --latency\t\tWhen streaming audio, reduce it this many seconds at a time (default: 0.02).\n"
+            "-m, --voronoi-method\tHow to make voronoi diagrams: kdtree (default) or exact.\n"
             "-n, --iterations\tSet the number of iterations to run on the data.\n"
+            "-O, --out-dir\t\tThe directory to write the files reduced with --batch to.\n"
+            "-o, --raw-format\tThe format of raw output: same (as the input, the default), v1, v2, or codebook.\n"
+            "-P, --per-frame\t\tRetrain the colors of video for each frame, starting from the last frame's\n"
+            "\t\t\tcolors (or from scratch after a scene cut; see -S).\n"
+            "-p, --png-speed\t\tHow to compress PNG files: fast, default, or small.\n"
+            "-Q, --queue-depth\tThe most video frames waiting to be mapped, and to be written (default: %d).\n"
+            "-q, --sample-rate\tThe sample rate of raw PCM audio read from a stream (default: 44100).\n"
+            "-R, --voronoi-random\tMake a voronoi diagram with random seeds. Usage: --voronoi-random <width> <height> <number of seeds> <output file>\n"
             "-r, --raw\t\tSpecifies the input file as a raw file.\n"
+            "-S, --scene-cut\t\tWith --per-frame, how different the colors of two frames have to be (from 0-1)\n"
+            "\t\t\tfor the second one to count as a new scene (default: %.1f).\n"
+            "-s, --stream\t\tReduce images without loading them all into memory (for huge PNGs), or reduce\n"
+            "\t\t\taudio as it streams in, adapting to it as it goes (see -l and -w). Audio can be\n"
+            "\t\t\tstreamed from stdin to stdout by using - as the file names.\n"
             "-t, --take\t\tSet how much of the data to actually use (from 0-1).\n"
+            "-u, --unique\t\tFor raw and text files, run k-means on just the unique pieces of data, each counted\n"
+            "\t\t\tas many times as it appears (much faster if lots of the data is the same).\n"
+            "-V, --video\t\tSpecifies the input file as a Y4M video (e.g. from ffmpeg -f yuv4mpegpipe). Video can\n"
+            "\t\t\tbe piped from stdin to stdout by using - as the file names.\n"
             "-v, --voronoi\t\tInstead of color reducing, the input image will be turned into a voronoi diagram.\n"
-            "-x, --text\t\tSpecifies the input file as a text file.\n");
+            "\t\t\tThe input can also be a .txt or .raw file listing the seeds (see voronoi.h).\n"
+            "-w, --warmup\t\tWhen streaming audio, train on this many seconds of it before starting (default: 1).\n"
+            "-x, --text\t\tSpecifies the input file as a text file.\n"
+            "-y, --raw-type\t\tThe type of raw output values: same (as the input, the default), f32, f16, u16, or u8.\n"
+            "-z, --gzip\t\tGzip raw or text output with this compression level (1-9; the default is 6 if the output\n"
+            "\t\t\tfile name ends in .gz, otherwise 0, for no compression). Gzipped input is detected automatically.\n",
+            CR_VIDEO_TRAIN_FRAMES, CR_VIDEO_QUEUE_DEPTH, CR_VIDEO_SCENE_CUT);
+
 }
 
 
@@ -74,9 +116,157 @@ typedef enum {
     AUDIO,
     IMAGE,
     RAW,
-    TEXT
+    TEXT,
+    VIDEO
 } input_type_t;
 
+typedef struct {
+    /* The command line parameters which say how to reduce a file */
+    int is_audio, is_image, is_raw, is_text, is_video;
+    int is_per_frame, is_stream, is_timing, is_unique;
+    float epsilon, take;
+    size_t iterations, values;
+    float segment_seconds, crossfade_seconds, latency_seconds, warmup_seconds, scene_cut;
+    long stream_channels, stream_sample_rate, gzip_level, train_frames, queue_depth;
+    cr_raw_layout_t raw_layout;
+    cr_raw_dtype_t raw_dtype;
+} reduce_options_t;
+
+static int input_type_get(const char* input_filename, const reduce_options_t* options, input_type_t* type) {
+    /* Works out what type of file the input is (from the options, or its extension), and puts it in *type
+       (if type isn't NULL). Returns an error code. */
+    input_type_t input_type_value;
+    input_type_t* input_type = type ? type : &input_type_value;
+    if (options->is_video) {
+        *input_type = VIDEO;
+    } else if (options->is_audio || !strcmp(input_filename, "-")) {
+        *input_type = AUDIO; /* (only audio and video can be streamed from stdin) */
+    } else if (options->is_image) {
+        *input_type = IMAGE;
+    } else if (options->is_raw) {
+        *input_type = RAW;
+    } else if (options->is_text) {
+        *input_type = TEXT;
+    } else {
+        /* The extension of the file's name (not its directory's), before any .gz */
+        const char* base = strrchr(input_filename, '/');
+        const char* file_extension;
+        base = base ? base + 1 : input_filename;
+        file_extension = strrchr(base, '.');
+        if (file_extension && file_extension != base && !strcmp(file_extension, ".gz")) {
+            const char* before = file_extension;
+            while (before > base && before[-1] != '.') before--;
+            if (before > base + 1) file_extension = before - 1;
+        }
+        if (!file_extension) {
+            sprintf(u_error_message, "No file extension on %.256s. Please specify -a, -i, -r, -t, or -V.", input_filename);
+            return u_error_code = U_ERROR_ARGUMENT;
+        }
+        if (!strncmp(file_extension, ".png", 4) || !strncmp(file_extension, ".ppm", 4) || !strncmp(file_extension, ".pgm", 4)
+         || !strncmp(file_extension, ".pnm", 4) || !strncmp(file_extension, ".pam", 4) || !strncmp(file_extension, ".qoi", 4)) {
+            *input_type = IMAGE;
+        } else if (!strncmp(file_extension, ".wav", 4)) {
+            *input_type = AUDIO;
+        } else if (!strncmp(file_extension, ".txt", 4)) {
+            *input_type = TEXT;
+        } else if (!strncmp(file_extension, ".raw", 4)) {
+            *input_type = RAW;
+        } else if (!strncmp(file_extension, ".y4m", 4)) {
+            *input_type = VIDEO;
+        } else {
+            sprintf(u_error_message, "Unrecognized file extension: %.256s. Please specify -a, -i, -r, -t, or -V.", file_extension);
+            return u_error_code = U_ERROR_ARGUMENT;
+        }
+    }
+
+    return U_ERROR_SUCCESS;
+}
+
+static int reduce_file(const char* input_filename, const char* output_filename, void* arg) {
+    /* Reduces one file, as the options in arg say. Returns an error code. */
+    const reduce_options_t* options = arg;
+    long gzip_level = options->gzip_level;
+    input_type_t input_type;
+    int err = input_type_get(input_filename, options, &input_type);
+    if (err) return err;
+    if (strcmp(input_filename, "-") && strcmp(output_filename, "-") && u_files_same(input_filename, output_filename)) {
+        /* Reducing a file in place, so write to a temporary file, and only replace the input once it's all been read */
+        char* temp_filename = u_files_temp_name(output_filename);
+        if (!temp_filename) return u_error_code;
+        err = reduce_file(input_filename, temp_filename, arg);
+        if (!err) err = u_files_replace(temp_filename, output_filename);
+        if (err) remove(temp_filename);
+        free(temp_filename);
+        return err;
+    }
+    if (gzip_level < 0) {
+        /* By default, only gzip output whose name ends in .gz */
+        size_t len = strlen(output_filename);
+        gzip_level = len >= 3 && !strcmp(output_filename + len - 3, ".gz") ? 6 : 0;
+    }
+
+    switch (input_type) {
+    case AUDIO:
+        if (options->is_stream || !strcmp(input_filename, "-") || !strcmp(output_filename, "-")) {
+            FILE* in = strcmp(input_filename, "-") ? fopen(input_filename, "rb") : stdin;
+            FILE* out = strcmp(output_filename, "-") ? fopen(output_filename, "wb") : stdout;
+            if (!in) {
+                err = u_error_fopen(input_filename, "reading");
+            } else if (!out) {
+                err = u_error_fopen(output_filename, "writing");
+            } else if (options->stream_channels <= 0 || options->stream_channels > 65535 || options->stream_sample_rate <= 0) {
+                err = u_error_set(U_ERROR_ARGUMENT, "Invalid number of channels or sample rate.");
+            } else {
+                err = cr_reduce_audio_stream(in, out, options->values, options->stream_channels, options->stream_sample_rate,
+                                             options->latency_seconds, options->warmup_seconds, options->epsilon, options->iterations, options->is_timing ? stderr : NULL);
+            }
+            if (in && in != stdin) fclose(in);
+            if (out && out != stdout && fclose(out) && !err)
+                err = u_error_set(U_ERROR_ACCESS, "Failed to write audio file.");
+        } else if (options->segment_seconds > 0)
+            err = cr_reduce_audio_file_segmented(input_filename, output_filename, options->values, options->segment_seconds, options->crossfade_seconds, options->take, options->epsilon, options->iterations);
+        else
+            err = cr_reduce_audio_file(input_filename, output_filename, options->values, options->take, options->epsilon, options->iterations);
+        break;
+    case IMAGE:
+        if (options->is_stream)
+            err = cr_reduce_image_file_stream(input_filename, output_filename, options->values, options->take, options->epsilon, options->iterations);
+        else
+            err = cr_reduce_image_file(input_filename, output_filename, options->values, options->take, options->epsilon, options->iterations);
+        break;
+    case RAW:
+        err = cr_reduce_raw_file_format(input_filename, output_filename, options->values, options->take, options->epsilon, options->iterations, options->raw_layout, options->raw_dtype, options->is_unique, gzip_level);
+        break;
+    case TEXT:
+        err = cr_reduce_text_file(input_filename, output_filename, options->values, options->take, options->epsilon, options->iterations, options->is_unique, gzip_level);
+        break;
+    case VIDEO: {
+        FILE* in = strcmp(input_filename, "-") ? fopen(input_filename, "rb") : stdin;
+        FILE* out = strcmp(output_filename, "-") ? fopen(output_filename, "wb") : stdout;
+        if (!in) {
+            err = u_error_fopen(input_filename, "reading");
+        } else if (!out) {
+            err = u_error_fopen(output_filename, "writing");
+        } else if (options->train_frames <= 0) {
+            err = u_error_set(U_ERROR_ARGUMENT, "The number of training frames must be positive.");
+        } else if (options->queue_depth <= 0) {
+            err = u_error_set(U_ERROR_ARGUMENT, "The queue depth must be positive.");
+        } else if (options->is_per_frame && options->scene_cut < 0) {
+            err = u_error_set(U_ERROR_ARGUMENT, "The scene cut threshold must not be negative.");
+        } else {
+            err = cr_reduce_video_stream(in, out, options->values, options->train_frames, options->is_per_frame ? options->scene_cut : -1, options->queue_depth,
+                                         options->take, options->epsilon, options->iterations, options->is_timing ? stderr : NULL);
+        }
+        if (in && in != stdin) fclose(in);
+        if (out && out != stdout && fclose(out) && !err)
+            err = u_error_set(U_ERROR_ACCESS, "Failed to write video file.");
+        break;
+    }
+    }
+
+    return err;
+}
+
 int main(int argc, char** argv) {
     srand(time(NULL));
     u_args_load(argc, argv);
@@ -86,16 +276,117 @@ int main(int argc, char** argv) {
     }
 
     /* Command line parameters */
-    int is_audio = u_args_param_has('a', "audio");
-    int is_image = u_args_param_has('i', "image");
-    int is_raw   = u_args_param_has('r', "raw");
-    int is_text  = u_args_param_has('t', "text");
+    reduce_options_t options;
+    options.is_audio = u_args_param_has('a', "audio");
+    options.is_image = u_args_param_has('i', "image");
+    options.is_raw   = u_args_param_has('r', "raw");
+    options.is_text  = u_args_param_has('t', "text");
+    options.is_video = u_args_param_has('V', "video");
+    options.is_per_frame = u_args_param_has('P', "per-frame");
     int is_voronoi = u_args_param_has('v', "voronoi");
-    float epsilon = u_args_param_double_get('e', "epsilon", 0.000002);
-    size_t iterations = u_args_param_long_get('n', "iterations", 2000);
-    size_t values = u_args_param_long_get('k', "values", 5);
-    float take = u_args_param_double_get('t', "take", 0.1);
+    options.is_stream = u_args_param_has('s', "stream");
+    options.is_timing = u_args_param_has('d', "timing");
+    options.is_unique = u_args_param_has('u', "unique");
+    int is_voronoi_animation = u_args_param_has('A', "voronoi-animation");
+    int is_voronoi_random = u_args_param_has('R', "voronoi-random");
+    options.epsilon = u_args_param_double_get('e', "epsilon", 0.000002);
+    options.iterations = u_args_param_long_get('n', "iterations", 2000);
+    options.values = u_args_param_long_get('k', "values", 5);
+    long threads = u_args_param_long_get('j', "threads", 0);
+    const char* batch_input = u_args_param_str_get('b', "batch", NULL);
+    const char* out_dir = u_args_param_str_get('O', "out-dir", NULL);
+    const char* voronoi_method_name = u_args_param_str_get('m', "voronoi-method", "kdtree");
+    const char* png_speed_name = u_args_param_str_get('p', "png-speed", "default");
+    const char* raw_format_name = u_args_param_str_get('o', "raw-format", "same");
+    const char* raw_type_name = u_args_param_str_get('y', "raw-type", "same");
+    options.take = u_args_param_double_get('t', "take", 0.1);
+    options.segment_seconds = u_args_param_double_get('g', "segment", 0);
+    options.crossfade_seconds = u_args_param_double_get('f', "crossfade", 0);
+    options.latency_seconds = u_args_param_double_get('l', "latency", 0.02);
+    options.warmup_seconds = u_args_param_double_get('w', "warmup", 1);
+    options.stream_channels = u_args_param_long_get('c', "channels", 2);
+    options.stream_sample_rate = u_args_param_long_get('q', "sample-rate", 44100);
+    options.gzip_level = u_args_param_long_get('z', "gzip", -1);
+    options.train_frames = u_args_param_long_get('F', "train-frames", CR_VIDEO_TRAIN_FRAMES);
+    options.scene_cut = u_args_param_double_get('S', "scene-cut", CR_VIDEO_SCENE_CUT);
+    options.queue_depth = u_args_param_long_get('Q', "queue-depth", CR_VIDEO_QUEUE_DEPTH);
+
 
+    if (threads > 0) u_threads_count_set(threads);
+    if (!strcmp(png_speed_name, "fast")) {
+        u_image_png_speed_set(U_IMAGE_PNG_FAST);
+    } else if (!strcmp(png_speed_name, "small")) {
+        u_image_png_speed_set(U_IMAGE_PNG_SMALL);
+    } else if (strcmp(png_speed_name, "default")) {
+        fprintf(stderr, "Error: Unrecognized PNG speed: %s.\n", png_speed_name);
+        show_help();
+        return EXIT_FAILURE;
+    }
+
+    if (!strcmp(raw_format_name, "same")) {
+        options.raw_layout = CR_RAW_SAME_LAYOUT;
+    } else if (!strcmp(raw_format_name, "v1")) {
+        options.raw_layout = CR_RAW_V1;
+    } else if (!strcmp(raw_format_name, "v2")) {
+        options.raw_layout = CR_RAW_V2;
+    } else if (!strcmp(raw_format_name, "codebook")) {
+        options.raw_layout = CR_RAW_CODEBOOK;
+    } else {
+        fprintf(stderr, "Error: Unrecognized raw format: %s.\n", raw_format_name);
+        show_help();
+        return EXIT_FAILURE;
+    }
+    if (!strcmp(raw_type_name, "same")) {
+        options.raw_dtype = CR_RAW_SAME_DTYPE;
+    } else if (!strcmp(raw_type_name, "f32")) {
+        options.raw_dtype = CR_RAW_F32;
+    } else if (!strcmp(raw_type_name, "f16")) {
+        options.raw_dtype = CR_RAW_F16;
+    } else if (!strcmp(raw_type_name, "u16")) {
+        options.raw_dtype = CR_RAW_U16;
+    } else if (!strcmp(raw_type_name, "u8")) {
+        options.raw_dtype = CR_RAW_U8;
+    } else {
+        fprintf(stderr, "Error: Unrecognized raw type: %s.\n", raw_type_name);
+        show_help();
+        return EXIT_FAILURE;
+    }
+
+    if (is_voronoi_random) {
+        /* ColorReducer --voronoi-random <width> <height> <number of seeds> <output file> */
+        char* voronoi_args[4];
+        int nargs = 0;
+        char** lone = u_args_lone_get(NULL);
+        while (lone && nargs < 4) {
+            voronoi_args[nargs++] = *lone;
+            lone = u_args_lone_get(lone);
+        }
+        if (nargs < 4 || lone) {
+            fprintf(stderr, "Error: Usage: --voronoi-random <width> <height> <number of seeds> <output file>\n");
+            return EXIT_FAILURE;
+        }
+        int err = cr_voronoi_random(atoi(voronoi_args[0]), atoi(voronoi_args[1]), atoi(voronoi_args[2]), voronoi_args[3]);
+        if (err) u_error_throw();
+        return EXIT_SUCCESS;
+    }
+
+    if (batch_input) {
+        /* ColorReducer --batch <input dir|list file> --out-dir <output dir>, with one worker per thread */
+        size_t nfailed;
+        if (!out_dir) {
+            fprintf(stderr, "Error: You must supply an output directory (-O) with --batch.\n");
+            show_help();
+            return EXIT_FAILURE;
+        }
+        if (u_args_lone_get(NULL)) {
+            fprintf(stderr, "Error: Stray argument: %s.\n", *u_args_lone_get(NULL));
+            show_help();
+            return EXIT_FAILURE;
+        }
+        int err = cr_batch_run(batch_input, out_dir, u_threads_count_get(), reduce_file, &options, stdout, &nfailed);
+        if (err) u_error_throw();
+        return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
     char* input_filename = NULL;
     char* output_filename = NULL;
@@ -125,60 +416,41 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
-    if (is_voronoi) {
-        int err = cr_voronoify(input_filename, output_filename);
+    if (is_voronoi_animation) {
+        int err = cr_voronoi_animate(input_filename, output_filename);
         if (err) u_error_throw();
         return EXIT_SUCCESS;
     }
 
-    input_type_t input_type;
-
-    if (is_audio) {
-        input_type = AUDIO;
-    } else if (is_image) {
-        input_type = IMAGE;
-    } else if (is_raw) {
-        input_type = RAW;
-    } else if (is_text) {
-        input_type = TEXT;
-    } else {
-        char* file_extension = strchr(input_filename, '.');
-        if (!file_extension) {
-            printf("No file extension on %s. Please specify -a, -i, -r, or -t.\n", input_filename);
-            show_help();
-            return EXIT_FAILURE;
-        }
-        if (!strncmp(file_extension, ".png", 4)) {
-            input_type = IMAGE;
-        } else if (!strncmp(file_extension, ".wav", 4)) {
-            input_type = AUDIO;
-        } else if (!strncmp(file_extension, ".txt", 4)) {
-            input_type = TEXT;
-        } else if (!strncmp(file_extension, ".raw", 4)) {
-            input_type = RAW;
+    if (is_voronoi) {
+        cr_voronoi_method_t voronoi_method;
+        if (!strcmp(voronoi_method_name, "kdtree")) {
+            voronoi_method = CR_VORONOI_KDTREE;
+        } else if (!strcmp(voronoi_method_name, "exact")) {
+            voronoi_method = CR_VORONOI_EXACT;
         } else {
-            printf("Unrecognized file extension: %s. Please specify -a, -i, -r, or -t.\n", file_extension);
+            fprintf(stderr, "Error: Unrecognized voronoi method: %s.\n", voronoi_method_name);
             show_help();
             return EXIT_FAILURE;
         }
+        /* The seeds can either be pixels in a PNG image or listed in a text/raw file */
+        const char* extension = strrchr(input_filename, '.');
+        int err;
+        if (extension && (!strcmp(extension, ".txt") || !strcmp(extension, ".raw")))
+            err = cr_voronoi_seeds(input_filename, output_filename, voronoi_method);
+        else
+            err = cr_voronoify(input_filename, output_filename, voronoi_method);
+        if (err) u_error_throw();
+        return EXIT_SUCCESS;
     }
 
-    int err;
-    switch (input_type) {
-    case AUDIO:
-        err = cr_reduce_audio_file(input_filename, output_filename, values, take, epsilon, iterations);
-        break;
-    case IMAGE:
-        err = cr_reduce_image_file(input_filename, output_filename, values, take, epsilon, iterations);
-        break;
-    case RAW:
-        err = cr_reduce_raw_file(input_filename, output_filename, values, take, epsilon, iterations);
-        break;
-    case TEXT:
-        err = cr_reduce_text_file(input_filename, output_filename, values, take, epsilon, iterations);
-        break;
+    int err = input_type_get(input_filename, &options, NULL);
+    if (err) {
+        printf("%s\n", u_error_message);
+        show_help();
+        return EXIT_FAILURE;
     }
-
+    err = reduce_file(input_filename, output_filename, &options);
     if (err) u_error_throw();
 
     /*cr_main(argc, argv);*/
@@ -15,57 +15,715 @@
     You should have received a copy of the GNU General Public License
     along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
 */
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200112L /* For fileno, ftruncate, posix_fallocate, mmap and posix_madvise */
+#define RAW_MMAP
+#endif
+#ifdef __linux__
+#define _DEFAULT_SOURCE /* For MAP_POPULATE (which _POSIX_C_SOURCE hides on glibc) */
+#endif
+
 #include "rawreducer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef RAW_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "utils/filetypes/gzip.h"
 #include "utils/misc/error.h"
+#include "utils/misc/files.h"
+#include "utils/misc/threads.h"
+#include "utils/misc/types.h"
 #include "utils/misc/types_exact.h"
+#include "utils/math/floats.h"
 #include "kmeans.h"
+#include "duplicates.h"
+#include "sparse.h"
 
-int cr_reduce_raw_file(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations) {
-    if (sizeof(float) != 4)
-        return u_error_set(U_ERROR_SYSTEM, "sizeof(float) must be 4 to read raw files.");
+#define RAW_MAGIC "\211RAW\r\n\032\n" /* Can't be the start of a valid version 1 file */
+#define RAW_MAGIC_SIZE 8
+#define RAW_V1_HEADER_SIZE (2 * sizeof(u_u4b_t))
+#define RAW_V2_HEADER_SIZE 32
+#define RAW_SPARSE_HEADER_SIZE (RAW_V2_HEADER_SIZE + 8) /* (with nnz) */
+#define RAW_LAYOUT_DENSE 0 /* The values of byte 11 of a version 2 header */
+#define RAW_LAYOUT_CODEBOOK 1
+#define RAW_LAYOUT_SPARSE 2
+#define RAW_BLOCK_ROWS 4096 /* The number of pieces of data each thread does at a time (a multiple of 8, so blocks of labels are whole bytes) */
 
-    FILE* in = fopen(filename_in, "r");
-    if (!in)
-        return u_error_fopen(filename_in, "reading");
+typedef struct {
+    int version; /* 1 or 2 */
+    cr_raw_dtype_t dtype;
+    u_bool_t big_endian; /* Whether the elements are big-endian */
+    u_bool_t codebook; /* Whether the file holds a codebook and labels, rather than the data itself */
+    u_bool_t sparse; /* Whether the file holds the data in CSR form */
+    size_t data_size;
+    size_t ndata;
+    size_t k; /* The size of the codebook */
+    int bits; /* The number of bits in each label */
+    size_t nnz; /* The number of nonzero elements (in a sparse file) */
+    size_t header_size;
+} raw_header_t;
 
-    u_u4b_t ndata, data_size;
-    if (fread(&ndata, sizeof(ndata), 1, in) != 1)
-        return u_error_set(U_ERROR_FORMAT, "Invalid raw file format.");
-    if (fread(&data_size, sizeof(data_size), 1, in) != 1)
-        return u_error_set(U_ERROR_FORMAT, "Invalid raw file format.");
+typedef struct {
+    const float* data;
+    float* out; /* Where the reduced data goes (for raw_remap) */
+    u_u4b_t* labels; /* Where the index of each piece of data's mean goes (for raw_label) */
+    size_t first; /* The index of the first piece of data labelled (for raw_label) */
+    size_t data_size;
+    cr_kmeans_map_t* map;
+    const cr_sparse_t* sparse; /* The data, if it's sparse (then data is NULL) */
+    const cr_sparse_map_t* sparse_map;
+    const cr_duplicates_t* dups; /* The unique rows (NULL if they weren't collapsed) */
+    const size_t* unique_labels; /* The index of each unique row's mean */
+} raw_remap_t;
 
-    float* data = malloc(data_size * ndata * sizeof(*data));
-    if (!data) {
-        fclose(in);
-        return u_error_nomem();
+static u_bool_t raw_native_big_endian(void) {
+    u_u2b_t one = 1;
+    return *(u_u1b_t*)&one == 0;
+}
+
+static size_t raw_dtype_size(cr_raw_dtype_t dtype) {
+    switch (dtype) {
+    case CR_RAW_F16: case CR_RAW_U16: return 2;
+    case CR_RAW_U8: return 1;
+    default: return 4;
     }
+}
 
-    if (fread(data, sizeof(*data), data_size * ndata, in) != data_size * ndata)
+static u_u4b_t raw_u32_get(const u_u1b_t* p) {
+    return (u_u4b_t)p[0] | ((u_u4b_t)p[1] << 8) | ((u_u4b_t)p[2] << 16) | ((u_u4b_t)p[3] << 24);
+}
+
+static void raw_u32_put(u_u1b_t* p, u_u4b_t x) {
+    p[0] = x & 0xFF;
+    p[1] = (x >> 8) & 0xFF;
+    p[2] = (x >> 16) & 0xFF;
+    p[3] = (x >> 24) & 0xFF;
+}
+
+static size_t raw_u64_get(const u_u1b_t* p) {
+    /* (the caller must make sure the top half is 0 if size_t only has 32 bits) */
+    return raw_u32_get(p) | (size_t)raw_u32_get(p + 4) << 16 << 16;
+}
+
+static u_bool_t raw_u64_fits(const u_u1b_t* p) {
+    return sizeof(size_t) > sizeof(u_u4b_t) || !raw_u32_get(p + 4);
+}
+
+static int raw_read(u_gzip_reader_t* in, void* ptr, size_t size, size_t n) {
+    /* Reads n elements of size bytes each. Returns an error code (if the file ends first, it's an invalid file). */
+    int err;
+    if (u_gzip_read(in, ptr, size, n) == n)
+        return U_ERROR_SUCCESS;
+    err = u_gzip_reader_error(in);
+    return err ? err : u_error_set(U_ERROR_FORMAT, "Invalid raw file format.");
+}
+
+static int raw_header_read(u_gzip_reader_t* in, raw_header_t* header) {
+    u_u1b_t bytes[RAW_V2_HEADER_SIZE];
+    int err = raw_read(in, bytes, 1, RAW_V1_HEADER_SIZE);
+    if (err) return err;
+    memset(header, 0, sizeof(*header));
+    if (memcmp(bytes, RAW_MAGIC, RAW_MAGIC_SIZE)) {
+        /* Version 1: ndata and data_size, in the machine's byte order, then 32-bit floats */
+        u_u4b_t ndata, data_size;
+        memcpy(&ndata, bytes, sizeof(ndata));
+        memcpy(&data_size, bytes + sizeof(ndata), sizeof(data_size));
+        header->version = 1;
+        header->dtype = CR_RAW_F32;
+        header->big_endian = raw_native_big_endian();
+        header->data_size = data_size;
+        header->ndata = ndata;
+        header->header_size = RAW_V1_HEADER_SIZE;
+        return U_ERROR_SUCCESS;
+    }
+    err = raw_read(in, bytes + RAW_V1_HEADER_SIZE, 1, RAW_V2_HEADER_SIZE - RAW_V1_HEADER_SIZE);
+    if (err) return err;
+    if (bytes[8] != 2)
+        return u_error_set(U_ERROR_FORMAT, "Unsupported raw file version.");
+    if (bytes[9] > CR_RAW_U8 || bytes[10] > 1 || bytes[11] > RAW_LAYOUT_SPARSE)
         return u_error_set(U_ERROR_FORMAT, "Invalid raw file format.");
+    header->version = 2;
+    header->dtype = bytes[9];
+    header->big_endian = bytes[10];
+    header->codebook = bytes[11] == RAW_LAYOUT_CODEBOOK;
+    header->sparse = bytes[11] == RAW_LAYOUT_SPARSE;
+    header->data_size = raw_u32_get(&bytes[12]);
+    if (!raw_u64_fits(&bytes[16]))
+        return u_error_set(U_ERROR_SYSTEM, "This raw file has too much data for this system.");
+    header->ndata = raw_u64_get(&bytes[16]);
+    header->k = raw_u32_get(&bytes[24]);
+    header->bits = bytes[28];
+    header->header_size = RAW_V2_HEADER_SIZE;
+    if (header->sparse) {
+        err = raw_read(in, bytes, 1, RAW_SPARSE_HEADER_SIZE - RAW_V2_HEADER_SIZE);
+        if (err) return err;
+        if (!raw_u64_fits(bytes))
+            return u_error_set(U_ERROR_SYSTEM, "This raw file has too much data for this system.");
+        header->nnz = raw_u64_get(bytes);
+        header->header_size = RAW_SPARSE_HEADER_SIZE;
+    }
+    if (header->codebook && (!header->k || header->bits < 1 || header->bits > 32 || (header->bits < 32 && header->k > (1UL << header->bits))))
+        return u_error_set(U_ERROR_FORMAT, "Invalid raw file codebook.");
+    return U_ERROR_SUCCESS;
+}
 
-    fclose(in);
+static int raw_header_write(u_gzip_writer_t* out, const raw_header_t* header) {
+    u_u1b_t bytes[RAW_V2_HEADER_SIZE];
+    if (header->version == 1) {
+        u_u4b_t ndata = header->ndata, data_size = header->data_size;
+        if (ndata != header->ndata)
+            return u_error_set(U_ERROR_ARGUMENT, "Too much data for a version 1 raw file (use version 2).");
+        memcpy(bytes, &ndata, sizeof(ndata));
+        memcpy(bytes + sizeof(ndata), &data_size, sizeof(data_size));
+    } else {
+        memset(bytes, 0, sizeof(bytes));
+        memcpy(bytes, RAW_MAGIC, RAW_MAGIC_SIZE);
+        bytes[8] = 2;
+        bytes[9] = header->dtype;
+        bytes[10] = header->big_endian;
+        bytes[11] = header->codebook ? RAW_LAYOUT_CODEBOOK : RAW_LAYOUT_DENSE; /* (sparse files are never written) */
+        raw_u32_put(&bytes[12], header->data_size);
+        raw_u32_put(&bytes[16], header->ndata & 0xFFFFFFFFUL);
+        raw_u32_put(&bytes[20], (header->ndata >> 16 >> 16) & 0xFFFFFFFFUL);
+        raw_u32_put(&bytes[24], header->k);
+        bytes[28] = header->bits;
+    }
+    return u_gzip_write(out, bytes, header->header_size);
+}
 
-    cr_kmeans_run(data, ndata, data_size, nvals, take * ndata, epsilon, iterations);
+static void raw_decode(const u_u1b_t* in, float* out, size_t n, const raw_header_t* header) {
+    /* Converts n elements, as they are in the file, to floats */
+    size_t i, j, size = raw_dtype_size(header->dtype);
+    u_bool_t swap = header->big_endian != raw_native_big_endian();
+    u_u1b_t element[4];
+    for (i = 0; i < n; i++, in += size) {
+        for (j = 0; j < size; j++)
+            element[j] = in[swap ? size - 1 - j : j];
+        switch (header->dtype) {
+        case CR_RAW_F32:
+            memcpy(&out[i], element, sizeof(float));
+            break;
+        case CR_RAW_F16: {
+            u_u2b_t half;
+            memcpy(&half, element, sizeof(half));
+            out[i] = u_float_from_half(half);
+        } break;
+        case CR_RAW_U16: {
+            u_u2b_t x;
+            memcpy(&x, element, sizeof(x));
+            out[i] = x;
+        } break;
+        default:
+            out[i] = element[0];
+            break;
+        }
+    }
+}
 
-    FILE* out = fopen(filename_out, "w");
-    if (!out)
-        return u_error_fopen(filename_out, "writing");
+static void raw_encode(const float* in, u_u1b_t* out, size_t n, const raw_header_t* header) {
+    /* Converts n floats to elements as they are in the file (integers are rounded, and clamped to their range) */
+    size_t i, j, size = raw_dtype_size(header->dtype);
+    u_bool_t swap = header->big_endian != raw_native_big_endian();
+    u_u1b_t element[4];
+    for (i = 0; i < n; i++, out += size) {
+        float x = in[i];
+        switch (header->dtype) {
+        case CR_RAW_F32:
+            memcpy(element, &x, sizeof(float));
+            break;
+        case CR_RAW_F16: {
+            u_u2b_t half = u_float_to_half(x);
+            memcpy(element, &half, sizeof(half));
+        } break;
+        case CR_RAW_U16: {
+            u_u2b_t y = x < 0 ? 0 : x > 65535 ? 65535 : (u_u2b_t)(x + 0.5f);
+            memcpy(element, &y, sizeof(y));
+        } break;
+        default:
+            element[0] = x < 0 ? 0 : x > 255 ? 255 : (u_u1b_t)(x + 0.5f);
+            break;
+        }
+        for (j = 0; j < size; j++)
+            out[j] = element[swap ? size - 1 - j : j];
+    }
+}
 
-    if (fwrite(&ndata, sizeof(ndata), 1, out) != 1)
-        return u_error_set(U_ERROR_ACCESS, "File write failed.");
+static size_t raw_labels_pack(const u_u4b_t* labels, size_t n, int bits, u_u1b_t* out) {
+    /* Packs n labels of bits bits each into out, least significant bit first. Returns the number of bytes used. */
+    size_t i, nbytes = (n * bits + 7) / 8, bit = 0;
+    memset(out, 0, nbytes);
+    for (i = 0; i < n; i++) {
+        int done = 0;
+        while (done < bits) {
+            int shift = bit % 8, count = bits - done < 8 - shift ? bits - done : 8 - shift;
+            out[bit / 8] |= ((labels[i] >> done) & ((1U << count) - 1)) << shift;
+            done += count;
+            bit += count;
+        }
+    }
+    return nbytes;
+}
+
+static void raw_labels_unpack(const u_u1b_t* in, size_t n, int bits, u_u4b_t* labels) {
+    size_t i, bit = 0;
+    for (i = 0; i < n; i++) {
+        int done = 0;
+        labels[i] = 0;
+        while (done < bits) {
+            int shift = bit % 8, count = bits - done < 8 - shift ? bits - done : 8 - shift;
+            labels[i] |= (u_u4b_t)((in[bit / 8] >> shift) & ((1U << count) - 1)) << done;
+            done += count;
+            bit += count;
+        }
+    }
+}
 
-    if (fwrite(&data_size, sizeof(data_size), 1, out) != 1)
-        return u_error_set(U_ERROR_ACCESS, "File write failed.");
+static size_t raw_nearest(const raw_remap_t* remap, size_t i) {
+    /* Returns the index of the closest mean to piece of data i (looking it up from its unique row if possible) */
+    if (remap->sparse)
+        return cr_sparse_map_nearest(remap->sparse_map, remap->sparse, i);
+    const float* point = &remap->data[i * remap->data_size];
+    if (remap->dups)
+        return remap->unique_labels[cr_duplicates_find(remap->dups, point)];
+    return cr_kmeans_map_nearest(remap->map, point);
+}
 
-    if (fwrite(data, sizeof(*data), data_size * ndata, out) != data_size * ndata)
-        return u_error_set(U_ERROR_ACCESS, "File write failed.");
+static int raw_remap(void* arg, size_t from, size_t to) {
+    /* Sets pieces of data from..to of out to the means closest to those pieces of data */
+    raw_remap_t* remap = arg;
+    size_t i, ds = remap->data_size;
+    for (i = from; i < to; i++) {
+        size_t belongs_to = raw_nearest(remap, i);
+        memcpy(&remap->out[i*ds], &remap->map->means[belongs_to*ds], ds * sizeof(*remap->out));
+    }
+    return U_ERROR_SUCCESS;
+}
 
-    fclose(out);
-    free(data);
+static int raw_label(void* arg, size_t from, size_t to) {
+    /* Sets labels from..to to the indices of the means closest to pieces of data first+from..first+to */
+    raw_remap_t* remap = arg;
+    size_t i;
+    for (i = from; i < to; i++)
+        remap->labels[i] = raw_nearest(remap, remap->first + i);
     return U_ERROR_SUCCESS;
 }
+
+static void* raw_map(FILE* fp, size_t size, int writable) {
+    /* Maps the first size bytes of fp into memory. Returns NULL if that can't be done (then stdio is used instead). */
+#ifdef RAW_MMAP
+    struct stat st;
+    if (fstat(fileno(fp), &st) || !S_ISREG(st.st_mode) || (size_t)st.st_size < size)
+        return NULL; /* (reading past the end of the file would crash) */
+    int flags = writable ? MAP_SHARED : MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (!writable) flags |= MAP_POPULATE; /* It's all going to be read, so read it now */
+#endif
+    void* map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, flags, fileno(fp), 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    /* The input is read a few times (by k-means), but the output is just written once, from start to end */
+    posix_madvise(map, size, writable ? POSIX_MADV_SEQUENTIAL : POSIX_MADV_WILLNEED);
+    return map;
+#else
+    (void)fp; (void)size; (void)writable;
+    return NULL;
+#endif
+}
+
+static void raw_unmap(void* map, size_t size) {
+#ifdef RAW_MMAP
+    if (map) munmap(map, size);
+#else
+    (void)map; (void)size;
+#endif
+}
+
+static void* raw_output_map(FILE* fp, size_t size) {
+    /* Makes fp size bytes long (with its blocks allocated, so that writing to the mapping can't fail
+       because the disk is full) and maps it. Returns NULL if that can't be done. */
+#ifdef RAW_MMAP
+    if (fflush(fp))
+        return NULL;
+    if (posix_fallocate(fileno(fp), 0, size) && ftruncate(fileno(fp), size))
+        return NULL;
+    return raw_map(fp, size, 1);
+#else
+    (void)fp; (void)size;
+    return NULL;
+#endif
+}
+
+static int raw_data_read(u_gzip_reader_t* in, const raw_header_t* header, float* data) {
+    /* Reads (and converts) all the data in a file whose header has been read */
+    size_t nvalues = header->data_size * header->ndata, size = raw_dtype_size(header->dtype);
+    size_t chunk = (size_t)RAW_BLOCK_ROWS * header->data_size, done, n;
+    u_u1b_t* bytes = malloc(chunk * (size > sizeof(u_u4b_t) ? size : sizeof(u_u4b_t)));
+    u_u4b_t* labels = NULL;
+    float* codebook = NULL;
+    int err = U_ERROR_SUCCESS;
+    if (!bytes) return u_error_nomem();
+    if (!header->codebook) {
+        for (done = 0; done < nvalues && !err; done += n) {
+            n = nvalues - done < chunk ? nvalues - done : chunk;
+            err = raw_read(in, bytes, size, n);
+            if (!err)
+                raw_decode(bytes, &data[done], n, header);
+        }
+        free(bytes);
+        return err;
+    }
+    /* Look up each label in the codebook */
+    size_t k = header->k, ds = header->data_size, i;
+    codebook = malloc(k * ds * sizeof(*codebook));
+    labels = malloc(RAW_BLOCK_ROWS * sizeof(*labels));
+    if (!codebook || !labels) err = u_error_nomem();
+    for (done = 0; done < k * ds && !err; done += n) {
+        n = k * ds - done < chunk ? k * ds - done : chunk;
+        err = raw_read(in, bytes, size, n);
+        if (!err)
+            raw_decode(bytes, &codebook[done], n, header);
+    }
+    for (done = 0; done < header->ndata && !err; done += n) {
+        n = header->ndata - done < RAW_BLOCK_ROWS ? header->ndata - done : RAW_BLOCK_ROWS;
+        size_t nbytes = (n * header->bits + 7) / 8;
+        err = raw_read(in, bytes, 1, nbytes);
+        if (err) break;
+        raw_labels_unpack(bytes, n, header->bits, labels);
+        for (i = 0; i < n; i++) {
+            if (labels[i] >= k) {
+                err = u_error_set(U_ERROR_FORMAT, "Invalid raw file codebook label.");
+                break;
+            }
+            memcpy(&data[(done + i) * ds], &codebook[labels[i] * ds], ds * sizeof(*data));
+        }
+    }
+    free(bytes);
+    free(labels);
+    free(codebook);
+    return err;
+}
+
+static int raw_sparse_read(u_gzip_reader_t* in, const raw_header_t* header, cr_sparse_t* sparse) {
+    /* Reads the row starts, columns and values of a sparse file whose header has been read */
+    size_t ndata = header->ndata, nnz = header->nnz, ds = header->data_size;
+    size_t size = raw_dtype_size(header->dtype), chunk = 2 * RAW_BLOCK_ROWS, done, n, i;
+    int err = U_ERROR_SUCCESS;
+    memset(sparse, 0, sizeof(*sparse));
+    sparse->ndata = ndata;
+    sparse->data_size = ds;
+    sparse->nnz = nnz;
+    if (ndata >= ((size_t)-1) / sizeof(*sparse->row_starts) || nnz > ((size_t)-1) / sizeof(*sparse->values))
+        return u_error_set(U_ERROR_SYSTEM, "This raw file has too much data for this system.");
+    u_u1b_t* bytes = malloc(chunk * 2 * sizeof(u_u4b_t));
+    sparse->row_starts = malloc((ndata + 1) * sizeof(*sparse->row_starts));
+    sparse->columns = malloc((nnz ? nnz : 1) * sizeof(*sparse->columns));
+    sparse->values = malloc((nnz ? nnz : 1) * sizeof(*sparse->values));
+    if (!bytes || !sparse->row_starts || !sparse->columns || !sparse->values)
+        err = u_error_nomem();
+    /* ndata+1 row starts (64-bit), which must go up from 0 to nnz */
+    for (done = 0; done <= ndata && !err; done += n) {
+        n = ndata + 1 - done < chunk ? ndata + 1 - done : chunk;
+        err = raw_read(in, bytes, 2 * sizeof(u_u4b_t), n);
+        for (i = 0; i < n && !err; i++) {
+            size_t start = raw_u64_fits(&bytes[8 * i]) ? raw_u64_get(&bytes[8 * i]) : nnz + 1;
+            if (start > nnz || (done + i == 0 ? start != 0 : start < sparse->row_starts[done + i - 1]))
+                err = u_error_set(U_ERROR_FORMAT, "Invalid sparse raw file row starts.");
+            sparse->row_starts[done + i] = start;
+        }
+    }
+    if (!err && sparse->row_starts[ndata] != nnz)
+        err = u_error_set(U_ERROR_FORMAT, "Invalid sparse raw file row starts.");
+    /* The column of each nonzero element (32-bit) */
+    for (done = 0; done < nnz && !err; done += n) {
+        n = nnz - done < chunk ? nnz - done : chunk;
+        err = raw_read(in, bytes, sizeof(u_u4b_t), n);
+        for (i = 0; i < n && !err; i++) {
+            sparse->columns[done + i] = raw_u32_get(&bytes[4 * i]);
+            if (sparse->columns[done + i] >= ds)
+                err = u_error_set(U_ERROR_FORMAT, "Invalid sparse raw file column.");
+        }
+    }
+    /* The values of the nonzero elements */
+    for (done = 0; done < nnz && !err; done += n) {
+        n = nnz - done < chunk ? nnz - done : chunk;
+        err = raw_read(in, bytes, size, n);
+        if (!err)
+            raw_decode(bytes, &sparse->values[done], n, header);
+    }
+    free(bytes);
+    return err;
+}
+
+static int raw_output_header_get(const raw_header_t* in, cr_raw_layout_t layout, cr_raw_dtype_t dtype, size_t nvals, raw_header_t* out) {
+    /* Works out the format of the output file */
+    *out = *in;
+    out->sparse = 0;
+    out->nnz = 0;
+    if (dtype != CR_RAW_SAME_DTYPE)
+        out->dtype = dtype;
+    if (in->sparse && layout != CR_RAW_SAME_LAYOUT && layout != CR_RAW_CODEBOOK)
+        return u_error_set(U_ERROR_ARGUMENT, "Sparse raw files can only be reduced to a codebook.");
+    switch (layout) {
+    case CR_RAW_SAME_LAYOUT:
+        if (out->version == 1 && out->dtype != CR_RAW_F32)
+            out->version = 2; /* Version 1 files can only hold floats */
+        if (in->sparse)
+            out->codebook = 1;
+        break;
+    case CR_RAW_V1:
+        if (out->dtype != CR_RAW_F32)
+            return u_error_set(U_ERROR_ARGUMENT, "Version 1 raw files can only hold 32-bit floats.");
+        out->version = 1;
+        out->codebook = 0;
+        break;
+    case CR_RAW_V2:
+        out->version = 2;
+        out->codebook = 0;
+        break;
+    case CR_RAW_CODEBOOK:
+        out->version = 2;
+        out->codebook = 1;
+        break;
+    }
+    if (out->version == 1)
+        out->big_endian = raw_native_big_endian();
+    out->header_size = out->version == 1 ? RAW_V1_HEADER_SIZE : RAW_V2_HEADER_SIZE;
+    out->k = out->bits = 0;
+    if (out->codebook) {
+        out->k = nvals;
+        out->bits = 1;
+        while (out->bits < 32 && ((size_t)1 << out->bits) < nvals)
+            out->bits++;
+    }
+    return U_ERROR_SUCCESS;
+}
+
+static int raw_blocks_write(u_gzip_writer_t* out, const raw_header_t* out_header, const float* means, size_t nvals, size_t ndata, raw_remap_t* remap) {
+    /* Finds the closest mean to each piece of data a block at a time, then writes either the
+       means (which are converted to the output's type just once) or the packed labels */
+    size_t element_size = raw_dtype_size(out_header->dtype), row_size = out_header->data_size * element_size;
+    size_t nblock = (size_t)RAW_BLOCK_ROWS * u_threads_count_get(), n, i;
+    u_u1b_t* means_bytes = malloc(nvals * row_size);
+    u_u1b_t* block = malloc(nblock * (out_header->codebook ? sizeof(u_u4b_t) : row_size));
+    int err = U_ERROR_SUCCESS;
+    remap->labels = malloc(nblock * sizeof(*remap->labels));
+    if (!means_bytes || !block || !remap->labels) err = u_error_nomem();
+    if (!err) raw_encode(means, means_bytes, nvals * out_header->data_size, out_header);
+    if (!err && out_header->codebook)
+        err = u_gzip_write(out, means_bytes, nvals * row_size);
+    for (remap->first = 0; remap->first < ndata && !err; remap->first += n) {
+        size_t nbytes;
+        n = ndata - remap->first < nblock ? ndata - remap->first : nblock;
+        err = u_threads_for(n, RAW_BLOCK_ROWS, raw_label, remap);
+        if (err) break;
+        if (out_header->codebook) {
+            nbytes = raw_labels_pack(remap->labels, n, out_header->bits, block);
+        } else {
+            for (i = 0; i < n; i++)
+                memcpy(&block[i * row_size], &means_bytes[remap->labels[i] * row_size], row_size);
+            nbytes = n * row_size;
+        }
+        if (!err)
+            err = u_gzip_write(out, block, nbytes);
+    }
+    free(means_bytes);
+    free(block);
+    free(remap->labels);
+    remap->labels = NULL;
+    return err;
+}
+
+static FILE* raw_output_open(const char* filename, int gzip_level, u_gzip_writer_t* writer) {
+    /* Opens the output file (for reading too, so it can be mapped), and sets up writer to write to it
+       (gzipped if gzip_level isn't 0). Returns NULL on failure. */
+    FILE* out = fopen(filename, "w+b");
+    if (!out) {
+        u_error_fopen(filename, "writing");
+        return NULL;
+    }
+    if (u_gzip_writer_open(writer, out, gzip_level)) {
+        fclose(out);
+        return NULL;
+    }
+    return out;
+}
+
+static int raw_output_close(FILE* out, u_gzip_writer_t* writer, int err) {
+    /* Finishes writing the output file (if it was opened). Returns err, or an error code if that fails. */
+    if (!out) return err;
+    int close_err = u_gzip_writer_close(writer);
+    if (fclose(out) && !close_err)
+        close_err = u_error_set(U_ERROR_ACCESS, "File write failed.");
+    return err ? err : close_err;
+}
+
+static int raw_reduce_sparse(u_gzip_reader_t* in, const raw_header_t* header, const raw_header_t* out_header, const char* filename_out,
+                             size_t nvals, float take, float epsilon, size_t iterations, int gzip_level) {
+    /* Reduces a sparse file (whose header has been read) to a codebook, without ever making its data dense */
+    cr_sparse_t sparse;
+    cr_sparse_map_t sparse_map;
+    int has_map = 0;
+    float* means = NULL;
+    FILE* out = NULL;
+    u_gzip_writer_t writer;
+    int err = raw_sparse_read(in, header, &sparse);
+    if (!err) {
+        means = malloc(nvals * header->data_size * sizeof(*means));
+        if (!means) err = u_error_nomem();
+    }
+    if (!err) err = cr_sparse_kmeans_train(&sparse, nvals, take * sparse.ndata, epsilon, iterations, means);
+    if (!err) err = cr_sparse_map_init(&sparse_map, means, nvals, header->data_size);
+    if (!err) has_map = 1;
+    if (!err) {
+        out = raw_output_open(filename_out, gzip_level, &writer);
+        if (!out) err = u_error_code;
+    }
+    if (!err)
+        err = raw_header_write(&writer, out_header);
+    if (!err) {
+        raw_remap_t remap;
+        memset(&remap, 0, sizeof(remap));
+        remap.data_size = header->data_size;
+        remap.sparse = &sparse;
+        remap.sparse_map = &sparse_map;
+        err = raw_blocks_write(&writer, out_header, means, nvals, header->ndata, &remap);
+    }
+    err = raw_output_close(out, &writer, err);
+    if (has_map) cr_sparse_map_destroy(&sparse_map);
+    cr_sparse_free(&sparse);
+    free(means);
+    return err;
+}
+
+int cr_reduce_raw_file_format(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations, cr_raw_layout_t layout, cr_raw_dtype_t dtype, int collapse, int gzip_level) {
+    if (sizeof(float) != 4)
+        return u_error_set(U_ERROR_SYSTEM, "sizeof(float) must be 4 to read raw files.");
+    if (u_files_same(filename_in, filename_out))
+        return u_error_set(U_ERROR_ARGUMENT, "The output file is the input file, which would be overwritten before it was read.");
+
+    FILE* in = fopen(filename_in, "rb");
+    if (!in)
+        return u_error_fopen(filename_in, "reading");
+
+    /* A gzipped input is decompressed on another thread as it's read */
+    u_gzip_reader_t reader;
+    raw_header_t header, out_header;
+    int err = u_gzip_reader_open(&reader, in);
+    if (err) {
+        fclose(in);
+        return err;
+    }
+    err = raw_header_read(&reader, &header);
+    if (!err && !header.sparse && header.data_size && header.ndata > ((size_t)-1) / sizeof(float) / header.data_size)
+        err = u_error_set(U_ERROR_SYSTEM, "This raw file has too much data for this system.");
+    if (!err)
+        err = raw_output_header_get(&header, layout, dtype, nvals, &out_header);
+    if (!err && header.sparse)
+        err = raw_reduce_sparse(&reader, &header, &out_header, filename_out, nvals, take, epsilon, iterations, gzip_level);
+    if (err || header.sparse) {
+        u_gzip_reader_close(&reader);
+        fclose(in);
+        return err;
+    }
+    size_t ndata = header.ndata, data_size = header.data_size, nfloats = ndata * data_size;
+    u_bool_t native_floats = header.dtype == CR_RAW_F32 && !header.codebook && header.big_endian == raw_native_big_endian();
+
+    /* Native floats are mapped into memory if possible; otherwise the data is read (and converted) into a buffer */
+    size_t in_size = header.header_size + nfloats * sizeof(float);
+    void* in_map = native_floats && !u_gzip_reader_compressed(&reader) ? raw_map(in, in_size, 0) : NULL;
+    float* buffer = NULL;
+    const float* data = in_map ? (const float*)((const char*)in_map + header.header_size) : NULL;
+    if (!data) {
+        buffer = malloc(nfloats * sizeof(*buffer));
+        if (!buffer)
+            err = u_error_nomem();
+        else
+            err = raw_data_read(&reader, &header, buffer);
+        data = buffer;
+    }
+    u_gzip_reader_close(&reader);
+    fclose(in); /* (the mapping stays) */
+
+    float* means = NULL;
+    cr_kmeans_map_t map;
+    cr_duplicates_t dups;
+    size_t* unique_labels = NULL;
+    int has_map = 0, has_dups = 0;
+    if (!err) {
+        means = malloc(nvals * data_size * sizeof(*means));
+        if (!means) err = u_error_nomem();
+    }
+    if (!err && collapse) {
+        has_dups = 1;
+        err = cr_duplicates_collapse(&dups, data, ndata, data_size, ndata / 2);
+    }
+    if (!err && has_dups && dups.rows) {
+        /* k-means (and finding the closest means) only needs to be done for the unique rows */
+        err = cr_duplicates_train(&dups, nvals, take * dups.nunique, epsilon, iterations, means);
+        if (!err) err = cr_kmeans_map_init(&map, means, nvals, data_size);
+        if (!err) has_map = 1;
+        if (!err) {
+            unique_labels = malloc(dups.nunique * sizeof(*unique_labels));
+            if (!unique_labels) err = u_error_nomem();
+        }
+        if (!err) err = cr_duplicates_label(&dups, &map, unique_labels);
+    } else if (!err) {
+        err = cr_kmeans_train(data, ndata, data_size, nvals, take * ndata, epsilon, iterations, means);
+        if (!err) err = cr_kmeans_map_init(&map, means, nvals, data_size);
+        if (!err) has_map = 1;
+    }
+
+    FILE* out = NULL;
+    u_gzip_writer_t writer;
+    if (!err) {
+        out = raw_output_open(filename_out, gzip_level, &writer);
+        if (!out) err = u_error_code;
+    }
+    if (!err)
+        err = raw_header_write(&writer, &out_header);
+
+    raw_remap_t remap;
+    memset(&remap, 0, sizeof(remap));
+    remap.data = data;
+    remap.data_size = data_size;
+    remap.map = &map;
+    remap.dups = has_dups && dups.rows ? &dups : NULL;
+    remap.unique_labels = unique_labels;
+    void* out_map = NULL;
+    size_t out_size = out_header.header_size + nfloats * sizeof(float);
+    if (!err && nfloats && !gzip_level && out_header.dtype == CR_RAW_F32 && !out_header.codebook && out_header.big_endian == raw_native_big_endian())
+        out_map = raw_output_map(out, out_size);
+    if (!err && out_map) {
+        /* The reduced data is written straight into the output file's pages */
+        remap.out = (float*)((char*)out_map + out_header.header_size);
+        err = u_threads_for(ndata, RAW_BLOCK_ROWS, raw_remap, &remap);
+#ifdef RAW_MMAP
+        if (!err && msync(out_map, out_size, MS_ASYNC))
+            err = u_error_set(U_ERROR_ACCESS, "File write failed.");
+#endif
+    } else if (!err) {
+        err = raw_blocks_write(&writer, &out_header, means, nvals, ndata, &remap);
+    }
+
+    raw_unmap(out_map, out_size);
+    err = raw_output_close(out, &writer, err);
+    if (has_map) cr_kmeans_map_destroy(&map);
+    if (has_dups) cr_duplicates_free(&dups);
+    free(unique_labels);
+    raw_unmap(in_map, in_size);
+    free(buffer);
+    free(means);
+    return err;
+}
+
+int cr_reduce_raw_file(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations) {
+    return cr_reduce_raw_file_format(filename_in, filename_out, nvals, take, epsilon, iterations, CR_RAW_SAME_LAYOUT, CR_RAW_SAME_DTYPE, 0, 0);
+}
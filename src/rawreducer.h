@@ -57,6 +57,37 @@ ndata = 3   data_size=2
 
 In this example, k-means has selected the two means
 (5.5, 2.6) and (9.0, -1.0).
+
+That is version 1 of the format. Version 2 files start with a 32-byte header, whose
+numbers are all little-endian:
+
+Offset | Size | Contents
+-------|------|---------
+0      | 8    | The bytes `89 52 41 57 0d 0a 1a 0a` (`\x89RAW\r\n\x1a\n`)
+8      | 1    | The version (2)
+9      | 1    | The type of each element (see \ref cr_raw_dtype_t)
+10     | 1    | 1 if the elements are big-endian, 0 if they are little-endian
+11     | 1    | The layout: 0 if the file holds the data itself, 1 for a codebook and labels, 2 for sparse data (see below)
+12     | 4    | data_size
+16     | 8    | ndata
+24     | 4    | k, the number of entries in the codebook (0 without a codebook)
+28     | 1    | The number of bits in each label (0 without a codebook)
+29     | 3    | Zeros
+
+After that comes either the data (ndata*data_size elements), or the codebook
+(k*data_size elements) followed by the label of each piece of data (the index of its
+entry in the codebook), packed into bytes least significant bit first. Reduced data
+only has k different pieces of data in it, so a codebook file is much smaller (e.g.
+3 bits per piece of data, instead of 12 bytes of floats, for 3 floats reduced to 8 values).
+Version 1 files are still read (and written, if the input is one, unless another
+format is asked for).
+
+Sparse files (which can only be read) hold data which is mostly zeros in CSR form (see
+sparse.h). The header is followed by nnz, the number of nonzero elements (8 bytes), then
+ndata+1 row starts (8 bytes each, going from 0 up to nnz; the nonzero elements of piece of
+data i are row start i up to row start i+1), the column of each nonzero element (4 bytes
+each), and finally the nonzero elements themselves (in the header's type). Sparse files
+are reduced to a codebook, using memory and time which depend on nnz, not ndata*data_size.
 */
 
 #ifndef COLORREDUCER_RAWREDUCER_H
@@ -64,9 +95,30 @@ In this example, k-means has selected the two means
 
 #include <stddef.h>
 
+/** The type of the elements of a raw file (these are the values used in version 2 headers). */
+typedef enum {
+    CR_RAW_F32, /**< 32-bit floats (the only type version 1 files can have) */
+    CR_RAW_F16, /**< 16-bit (half-precision) floats */
+    CR_RAW_U16, /**< Unsigned 16-bit integers (reduced values are rounded) */
+    CR_RAW_U8, /**< Unsigned 8-bit integers, e.g. pixels (reduced values are rounded) */
+    CR_RAW_SAME_DTYPE /**< For output: the same type as the input */
+} cr_raw_dtype_t;
+
+/** How the output of \ref cr_reduce_raw_file_format is laid out. */
+typedef enum {
+    CR_RAW_SAME_LAYOUT, /**< The same as the input (but version 2 if the type can't be stored in version 1) */
+    CR_RAW_V1, /**< Version 1 */
+    CR_RAW_V2, /**< Version 2, with the data itself */
+    CR_RAW_CODEBOOK /**< Version 2, with a codebook and labels */
+} cr_raw_layout_t;
+
 /**
 Reduces the number of values in a raw file, as described in this file's description.
-Uses roughly 8 bytes per float in the file of memory.
+On POSIX systems, the input and output files are mapped into memory, so the data is
+read straight from the input file's pages, and the reduced data is written straight
+into the output file's pages (which takes hardly any memory of its own). Otherwise
+(or if the input isn't made of floats in the machine's byte order), this uses
+roughly 4 bytes of memory per element in the file.
 \param filename_in The name of the input file
 \param filename_out The name of the output file
 \param nvals The number of values to reduce it to
@@ -75,5 +127,18 @@ Uses roughly 8 bytes per float in the file of memory.
 \param take If this value is positive, it refers to the percentage of raw data to run k-means on. Otherwise, it will run on all the data.
  */
 int cr_reduce_raw_file(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations);
+/**
+Like \ref cr_reduce_raw_file, but the output can be in a different format from the input.
+\param layout The layout of the output file.
+\param dtype The type of the elements of the output file.
+\param collapse If this is nonzero, identical pieces of data are collapsed first (see duplicates.h),
+                so k-means only runs on the unique ones, and \p take is the percentage of those to use.
+                This is given up on if more than half of the pieces of data are unique (and isn't done for sparse files).
+\param gzip_level If this is nonzero, the output is gzipped with this compression level (1-9).
+
+A gzipped input file is detected automatically, and decompressed on a separate thread
+while it's read (see utils/filetypes/gzip.h); it can't be mapped into memory.
+ */
+int cr_reduce_raw_file_format(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations, cr_raw_layout_t layout, cr_raw_dtype_t dtype, int collapse, int gzip_level);
 
 #endif /* COLORREDUCER_RAWREDUCER_H */
@@ -0,0 +1,174 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of ColorReducer.
+
+    ColorReducer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ColorReducer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "sparse.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "utils/misc/error.h"
+#include "utils/misc/threads.h"
+#include "utils/math/rand.h"
+
+#define SPARSE_BLOCK_ROWS 1024 /* The number of pieces of data each thread labels at a time */
+
+typedef struct {
+    const cr_sparse_t* data;
+    const size_t* rows; /* The pieces of data k-means is run on */
+    size_t* labels; /* The closest mean to each of them */
+    const cr_sparse_map_t* map;
+} sparse_label_t;
+
+static void sparse_norms_compute(cr_sparse_map_t* map) {
+    size_t i, j, ds = map->data_size;
+    for (i = 0; i < map->k; i++) {
+        const float* mean = &map->means[i * ds];
+        float norm = 0;
+        for (j = 0; j < ds; j++)
+            norm += mean[j] * mean[j];
+        map->norms[i] = norm;
+    }
+}
+
+int cr_sparse_map_init(cr_sparse_map_t* map, const float* means, size_t k, size_t data_size) {
+    map->means = means;
+    map->k = k;
+    map->data_size = data_size;
+    map->norms = malloc((k ? k : 1) * sizeof(*map->norms));
+    if (!map->norms)
+        return u_error_nomem();
+    sparse_norms_compute(map);
+    return U_ERROR_SUCCESS;
+}
+
+size_t cr_sparse_map_nearest(const cr_sparse_map_t* map, const cr_sparse_t* data, size_t i) {
+    size_t start = data->row_starts[i], end = data->row_starts[i+1], best = 0, c, j;
+    float best_distance = FLT_MAX;
+    for (c = 0; c < map->k; c++) {
+        /* The squared distance, minus the squared length of the piece of data (which is the same for every mean) */
+        const float* mean = &map->means[c * map->data_size];
+        float dot = 0, distance;
+        for (j = start; j < end; j++)
+            dot += data->values[j] * mean[data->columns[j]];
+        distance = map->norms[c] - 2 * dot;
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = c;
+        }
+    }
+    return best;
+}
+
+void cr_sparse_map_destroy(cr_sparse_map_t* map) {
+    free(map->norms);
+    map->norms = NULL;
+}
+
+static int sparse_label(void* arg, size_t from, size_t to) {
+    /* Finds the closest means to training pieces of data from..to */
+    sparse_label_t* label = arg;
+    size_t i;
+    for (i = from; i < to; i++)
+        label->labels[i] = cr_sparse_map_nearest(label->map, label->data, label->rows[i]);
+    return U_ERROR_SUCCESS;
+}
+
+int cr_sparse_kmeans_train(const cr_sparse_t* data, size_t k, size_t take, float epsilon, size_t iterations, float* means) {
+    size_t ndata = data->ndata, ds = data->data_size, ntrain = take > 0 && take < ndata ? take : ndata;
+    size_t i, j, c, iteration;
+    if (ndata == 0 || ds == 0) return U_ERROR_ARGUMENT;
+    if (k > ntrain)
+        return u_error_set(U_ERROR_ARGUMENT, "k must be less than or equal to the number of pieces of data.");
+
+    size_t* rows = malloc(ntrain * sizeof(*rows));
+    size_t* labels = malloc(ntrain * sizeof(*labels));
+    size_t* counts = malloc(k * sizeof(*counts));
+    float* sums = malloc(k * ds * sizeof(*sums));
+    cr_sparse_map_t map;
+    map.norms = NULL;
+    int err = U_ERROR_SUCCESS;
+    if (!rows || !labels || !counts || !sums)
+        err = u_error_nomem();
+
+    if (!err) {
+        /* Pick ntrain pieces of data, then start the means at k of them (densified) */
+        size_t need = ntrain, left = ndata, n = 0;
+        for (i = 0; i < ndata && need; i++, left--) {
+            if (u_rand_size(0, left) < need) { /* (so once need == left, every row left is picked) */
+                rows[n++] = i;
+                need--;
+            }
+        }
+        err = u_rand_shuffle(rows, ntrain, sizeof(*rows));
+    }
+    if (!err) {
+        memset(means, 0, k * ds * sizeof(*means));
+        for (c = 0; c < k; c++)
+            for (j = data->row_starts[rows[c]]; j < data->row_starts[rows[c]+1]; j++)
+                means[c * ds + data->columns[j]] = data->values[j];
+        err = cr_sparse_map_init(&map, means, k, ds);
+    }
+
+    sparse_label_t label;
+    label.data = data;
+    label.rows = rows;
+    label.labels = labels;
+    label.map = &map;
+    float change = FLT_MAX;
+    for (iteration = 0; !err && change > epsilon && (iterations == 0 || iteration < iterations); iteration++) {
+        err = u_threads_for(ntrain, SPARSE_BLOCK_ROWS, sparse_label, &label);
+        if (err) break;
+        /* Add up the (nonzero elements of the) pieces of data belonging to each mean */
+        memset(sums, 0, k * ds * sizeof(*sums));
+        memset(counts, 0, k * sizeof(*counts));
+        for (i = 0; i < ntrain; i++) {
+            float* sum = &sums[labels[i] * ds];
+            for (j = data->row_starts[rows[i]]; j < data->row_starts[rows[i]+1]; j++)
+                sum[data->columns[j]] += data->values[j];
+            counts[labels[i]]++;
+        }
+        change = 0;
+        for (c = 0; c < k; c++) {
+            if (!counts[c]) continue; /* Nothing is closest to this mean, so leave it where it is */
+            for (j = 0; j < ds; j++) {
+                float mean = sums[c * ds + j] / counts[c];
+                change += fabs(means[c * ds + j] - mean);
+                means[c * ds + j] = mean;
+            }
+        }
+        change /= k * ds;
+        sparse_norms_compute(&map);
+    }
+
+    cr_sparse_map_destroy(&map);
+    free(rows);
+    free(labels);
+    free(counts);
+    free(sums);
+    return err;
+}
+
+void cr_sparse_free(cr_sparse_t* data) {
+    free(data->row_starts);
+    data->row_starts = NULL;
+    free(data->columns);
+    data->columns = NULL;
+    free(data->values);
+    data->values = NULL;
+}
@@ -0,0 +1,76 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of ColorReducer.
+
+    ColorReducer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ColorReducer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file sparse.h
+\brief k-means classification of sparse data
+
+For data which is mostly zeros (e.g. features with thousands of elements, only a
+few of which are nonzero), storing and comparing every element is a waste. Here,
+the data is stored in CSR (compressed sparse row) form: just the nonzero elements
+of each piece of data, with their columns. The means are stored normally.
+
+The distance from a piece of data \f$x\f$ to a mean \f$c\f$ is found using
+\f$|x-c|^2 = |x|^2 - 2x \cdot c + |c|^2\f$. \f$|x|^2\f$ is the same for every mean, and
+\f$|c|^2\f$ is worked out once per mean, so only \f$x \cdot c\f$ is needed, which takes
+time proportional to the number of nonzero elements of \f$x\f$. So finding the closest
+mean takes time `O(k*nnz)` rather than `O(k*data_size)` (a k-d tree doesn't help
+with so many dimensions), and the data takes memory `O(ndata+nnz)`.
+*/
+#ifndef COLORREDUCER_SPARSE_H
+#define COLORREDUCER_SPARSE_H
+
+#include <stddef.h>
+
+#include "utils/misc/types_exact.h"
+
+/** Data in CSR form. */
+typedef struct {
+    size_t ndata; /**< The number of pieces of data */
+    size_t data_size; /**< The size of each piece of data (including the zeros) */
+    size_t nnz; /**< The number of nonzero elements */
+    size_t* row_starts; /**< The nonzero elements of piece of data `i` are `row_starts[i]` to `row_starts[i+1]` (a `size_t[ndata+1]`) */
+    u_u4b_t* columns; /**< The column of each nonzero element */
+    float* values; /**< The value of each nonzero element */
+} cr_sparse_t;
+
+/** For finding the closest mean to a piece of sparse data. */
+typedef struct {
+    const float* means; /**< The means, as a `float[k*data_size]` */
+    float* norms; /**< The squared length of each mean */
+    size_t k; /**< The number of means */
+    size_t data_size; /**< The size of each mean */
+} cr_sparse_map_t;
+
+/**
+Runs k-means on \p data, putting the means in \p means (a `float[k*data_size]`).
+\param take If this value is positive, k-means will only run on that many pieces of data, randomly selected.
+\param epsilon k-means will stop once the difference between the means of successive iterations is less than it.
+\param iterations If this value is positive, k-means will stop after this many iterations.
+\returns An error code. */
+int    cr_sparse_kmeans_train(const cr_sparse_t* data, size_t k, size_t take, float epsilon, size_t iterations, float* means);
+/** Sets up \p map to find the closest of the \p k means in \p means (which is not copied).
+    \returns An error code. */
+int    cr_sparse_map_init(cr_sparse_map_t* map, const float* means, size_t k, size_t data_size);
+/** \returns The index of the closest mean to piece of data \p i of \p data. Doesn't modify
+    \p map, so this can be used by several threads at once. */
+size_t cr_sparse_map_nearest(const cr_sparse_map_t* map, const cr_sparse_t* data, size_t i);
+/** Frees the memory used by \p map (but not \p map itself, or its means). */
+void   cr_sparse_map_destroy(cr_sparse_map_t* map);
+/** Frees the arrays of \p data (but not \p data itself). */
+void   cr_sparse_free(cr_sparse_t* data);
+
+#endif /* COLORREDUCER_SPARSE_H */
@@ -15,53 +15,360 @@
     You should have received a copy of the GNU General Public License
     along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
 */
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200112L /* For fileno, mmap and posix_madvise */
+#define TEXT_MMAP
+#endif
+
 #include "textreducer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef TEXT_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
+#include "utils/filetypes/gzip.h"
 #include "utils/misc/error.h"
+#include "utils/misc/threads.h"
+#include "utils/math/floats.h"
 #include "kmeans.h"
+#include "duplicates.h"
+
+#define TEXT_CHUNK_SIZE ((size_t)1 << 20) /* The number of bytes of text each thread parses at a time */
+#define TEXT_BLOCK_SIZE ((size_t)1 << 20) /* The (approximate) number of bytes of text each thread writes at a time */
+#define TEXT_READ_SIZE ((size_t)1 << 20) /* How much more of a file is read at a time, if it can't be mapped */
+
+typedef struct {
+    const char* text;
+    const char* end;
+    size_t nchunks;
+    const char** chunk_starts; /* Chunk i is chunk_starts[i] to chunk_starts[i+1]; each starts at whitespace */
+    size_t* chunk_firsts; /* The number of values in each chunk, then (once they're added up) the index of each one's first value */
+    float* data;
+    size_t nvalues;
+} text_parse_t;
+
+typedef struct {
+    const float* data;
+    size_t data_size;
+    size_t ndata;
+    cr_kmeans_map_t* map;
+    const cr_duplicates_t* dups; /* The unique rows (NULL if they weren't collapsed) */
+    const size_t* unique_labels; /* The index of each unique row's mean */
+    const char* means_text; /* The text of each mean (one line each) */
+    const size_t* means_starts; /* Where each mean's line starts in means_text (with an extra one for the end) */
+    size_t block_rows; /* The number of pieces of data in each block */
+    size_t first_block; /* The first block of the batch */
+    char* buffers; /* The text of each block of the batch */
+    size_t buffer_size;
+    size_t* lengths; /* The length of the text of each block */
+} text_write_t;
+
+static int text_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static int text_count(void* arg, size_t from, size_t to) {
+    /* Counts the values in chunks from..to */
+    text_parse_t* parse = arg;
+    size_t i;
+    for (i = from; i < to; i++) {
+        const char* p, *end = parse->chunk_starts[i+1];
+        size_t count = 0;
+        int space = 1;
+        for (p = parse->chunk_starts[i]; p < end; p++) {
+            int is_space = text_space(*p);
+            count += space && !is_space;
+            space = is_space;
+        }
+        parse->chunk_firsts[i] = count;
+    }
+    return U_ERROR_SUCCESS;
+}
+
+static int text_parse(void* arg, size_t from, size_t to) {
+    /* Parses the values in chunks from..to into data */
+    text_parse_t* parse = arg;
+    size_t i;
+    for (i = from; i < to; i++) {
+        const char* p = parse->chunk_starts[i], *end = parse->chunk_starts[i+1];
+        size_t index = parse->chunk_firsts[i];
+        for (;;) {
+            while (p < end && text_space(*p)) p++;
+            if (p == end || index >= parse->nvalues) break;
+            p = u_float_parse(p, end, &parse->data[index++]);
+            if (!p) return u_error_set(U_ERROR_FORMAT, "Invalid text format.");
+        }
+    }
+    return U_ERROR_SUCCESS;
+}
+
+static int text_values_read(const char* text, const char* end, float* data, size_t nvalues) {
+    /* Splits the text into chunks at whitespace, counts the values in each chunk (so that it's
+       known where each chunk's values go), then parses them, with the chunks done in parallel. */
+    text_parse_t parse;
+    size_t nchunks = (end - text) / TEXT_CHUNK_SIZE + 1, i;
+    parse.text = text;
+    parse.end = end;
+    parse.nchunks = nchunks;
+    parse.data = data;
+    parse.nvalues = nvalues;
+    parse.chunk_starts = malloc((nchunks + 1) * sizeof(*parse.chunk_starts));
+    parse.chunk_firsts = malloc(nchunks * sizeof(*parse.chunk_firsts));
+    if (!parse.chunk_starts || !parse.chunk_firsts) {
+        free(parse.chunk_starts);
+        free(parse.chunk_firsts);
+        return u_error_nomem();
+    }
+    parse.chunk_starts[0] = text;
+    for (i = 1; i < nchunks; i++) {
+        const char* p = text + i * TEXT_CHUNK_SIZE;
+        if (p < parse.chunk_starts[i-1]) p = parse.chunk_starts[i-1];
+        while (p < end && !text_space(*p)) p++;
+        parse.chunk_starts[i] = p;
+    }
+    parse.chunk_starts[nchunks] = end;
+
+    int err = u_threads_for(nchunks, 1, text_count, &parse);
+    size_t total = 0;
+    for (i = 0; i < nchunks; i++) {
+        size_t count = parse.chunk_firsts[i];
+        parse.chunk_firsts[i] = total;
+        total += count;
+    }
+    if (!err && total < nvalues)
+        err = u_error_set(U_ERROR_FORMAT, "Invalid text format.");
+    if (!err)
+        err = u_threads_for(nchunks, 1, text_parse, &parse);
+    free(parse.chunk_starts);
+    free(parse.chunk_firsts);
+    return err;
+}
+
+static int text_blocks_write(void* arg, size_t from, size_t to) {
+    /* Writes the text of blocks from..to of the batch (each piece of data is replaced with the text of its mean) */
+    text_write_t* write = arg;
+    size_t b, i;
+    for (b = from; b < to; b++) {
+        size_t first = (write->first_block + b) * write->block_rows, last = first + write->block_rows;
+        char* out = &write->buffers[b * write->buffer_size];
+        if (last > write->ndata) last = write->ndata;
+        for (i = first; i < last; i++) {
+            const float* point = &write->data[i * write->data_size];
+            size_t mean = write->dups ? write->unique_labels[cr_duplicates_find(write->dups, point)]
+                                      : cr_kmeans_map_nearest(write->map, point);
+            size_t len = write->means_starts[mean+1] - write->means_starts[mean];
+            memcpy(out, &write->means_text[write->means_starts[mean]], len);
+            out += len;
+        }
+        write->lengths[b] = out - &write->buffers[b * write->buffer_size];
+    }
+    return U_ERROR_SUCCESS;
+}
 
-int cr_reduce_text_file(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations) {
-    FILE* in = fopen(filename_in, "r");
+static char* text_file_read(u_gzip_reader_t* reader, size_t* size, void** map) {
+    /* Maps the file into memory if possible (setting *map), otherwise reads (and decompresses, if
+       it's gzipped) it into a buffer. Returns NULL on failure. */
+#ifdef TEXT_MMAP
+    FILE* fp = reader->fp;
+    struct stat st;
+    if (!u_gzip_reader_compressed(reader) && !fstat(fileno(fp), &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (m != MAP_FAILED) {
+            posix_madvise(m, st.st_size, POSIX_MADV_SEQUENTIAL);
+            *map = m;
+            *size = st.st_size;
+            return m;
+        }
+    }
+#endif
+    char* text = NULL;
+    size_t capacity = 0, len = 0, n;
+    *map = NULL;
+    do {
+        if (len == capacity) {
+            char* new_text = realloc(text, capacity += TEXT_READ_SIZE);
+            if (!new_text) {
+                free(text);
+                u_error_nomem();
+                return NULL;
+            }
+            text = new_text;
+        }
+        n = u_gzip_read(reader, text + len, 1, capacity - len);
+        len += n;
+    } while (n);
+    if (u_gzip_reader_error(reader)) {
+        free(text);
+        return NULL;
+    }
+    *size = len;
+    return text;
+}
+
+static void text_file_free(char* text, size_t size, void* map) {
+#ifdef TEXT_MMAP
+    if (map) {
+        munmap(map, size);
+        return;
+    }
+#endif
+    (void)size; (void)map;
+    free(text);
+}
+
+static const char* text_number_read(const char* p, const char* end, unsigned long* n) {
+    /* Reads a whole number (after whitespace). Returns NULL on failure. */
+    while (p < end && text_space(*p)) p++;
+    if (p == end || *p < '0' || *p > '9') return NULL;
+    for (*n = 0; p < end && *p >= '0' && *p <= '9'; p++)
+        *n = 10 * *n + (*p - '0');
+    return p;
+}
+
+int cr_reduce_text_file(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations, int collapse, int gzip_level) {
+    FILE* in = fopen(filename_in, "rb");
     if (!in)
         return u_error_fopen(filename_in, "reading");
+    u_gzip_reader_t reader;
+    size_t size;
+    void* map;
+    char* text = NULL;
+    if (!u_gzip_reader_open(&reader, in)) {
+        text = text_file_read(&reader, &size, &map);
+        u_gzip_reader_close(&reader);
+    }
+    fclose(in);
+    if (!text)
+        return u_error_code;
+
     unsigned long data_size, ndata;
-    if (fscanf(in, "%lu%lu", &ndata, &data_size) != 2)
+    const char* p = text_number_read(text, text + size, &ndata);
+    if (p) p = text_number_read(p, text + size, &data_size);
+    if (!p || !data_size || data_size > ((size_t)-1) / sizeof(float) / (ndata ? ndata : 1)) {
+        text_file_free(text, size, map);
         return u_error_set(U_ERROR_FORMAT, "Invalid text format.");
-    unsigned long nvalues = data_size * ndata;
+    }
+    size_t nvalues = (size_t)data_size * ndata;
     float* data = malloc(nvalues * sizeof(*data));
-    if (!data) {
-        fclose(in);
-        return u_error_nomem();
+    float* means = malloc(nvals * data_size * sizeof(*means));
+    int err = U_ERROR_SUCCESS;
+    if (!data || !means)
+        err = u_error_nomem();
+    if (!err)
+        err = text_values_read(p, text + size, data, nvalues);
+    text_file_free(text, size, map);
+
+    /* Only the means need to be formatted; then each piece of data is written as the text of its mean */
+    cr_kmeans_map_t kmeans_map;
+    cr_duplicates_t dups;
+    size_t* unique_labels = NULL;
+    int has_map = 0, has_dups = 0;
+    if (!err && collapse) {
+        has_dups = 1;
+        err = cr_duplicates_collapse(&dups, data, ndata, data_size, ndata / 2);
     }
-    unsigned long i, j;
-    for (i = 0; i < nvalues; i++) {
-        if (fscanf(in, "%f", &data[i]) != 1) {
-            fclose(in);
-            free(data);
-            return u_error_set(U_ERROR_FORMAT, "Invalid text format.");
+    if (!err && has_dups && dups.rows) {
+        err = cr_duplicates_train(&dups, nvals, take * dups.nunique, epsilon, iterations, means);
+        if (!err) err = cr_kmeans_map_init(&kmeans_map, means, nvals, data_size);
+        if (!err) has_map = 1;
+        if (!err) {
+            unique_labels = malloc(dups.nunique * sizeof(*unique_labels));
+            if (!unique_labels) err = u_error_nomem();
         }
+        if (!err) err = cr_duplicates_label(&dups, &kmeans_map, unique_labels);
+    } else if (!err) {
+        err = cr_kmeans_train(data, ndata, data_size, nvals, take * ndata, epsilon, iterations, means);
+        if (!err) err = cr_kmeans_map_init(&kmeans_map, means, nvals, data_size);
+        if (!err) has_map = 1;
     }
-    fclose(in);
-
-    cr_kmeans_run(data, ndata, data_size, nvals, take * ndata, epsilon, iterations);
 
-    FILE* out = fopen(filename_out, "w");
-    if (!out) {
-        free(data);
-        return u_error_fopen(filename_out, "writing");
+    text_write_t write;
+    size_t line_max = (size_t)data_size * (U_FLOAT_STR_MAX + 1), i, j;
+    write.means_text = NULL;
+    write.means_starts = NULL;
+    write.buffers = NULL;
+    write.lengths = NULL;
+    char* means_text = NULL;
+    size_t* means_starts = NULL;
+    if (!err) {
+        means_text = malloc(nvals * line_max);
+        means_starts = malloc((nvals + 1) * sizeof(*means_starts));
+        if (!means_text || !means_starts) err = u_error_nomem();
+    }
+    if (!err) {
+        char* out = means_text;
+        for (i = 0; i < nvals; i++) {
+            means_starts[i] = out - means_text;
+            for (j = 0; j < data_size; j++) {
+                out += u_float_format(means[i*data_size+j], out);
+                *out++ = j == data_size - 1 ? '\n' : ' ';
+            }
+        }
+        means_starts[nvals] = out - means_text;
     }
-    fprintf(out, "%lu %lu\n", ndata, data_size);
 
-    for (i = 0; i < ndata; i++) {
-        for (j = 0; j < data_size; j++) {
-            fprintf(out, "%f ", data[i*data_size+j]);
+    FILE* out = NULL;
+    u_gzip_writer_t writer;
+    char header[64];
+    if (!err) {
+        out = fopen(filename_out, "wb");
+        if (!out) err = u_error_fopen(filename_out, "writing");
+    }
+    if (!err) {
+        err = u_gzip_writer_open(&writer, out, gzip_level);
+        if (err) {
+            fclose(out);
+            out = NULL;
         }
-        fprintf(out,"\n");
     }
+    if (!err) {
+        sprintf(header, "%lu %lu\n", ndata, data_size);
+        err = u_gzip_write(&writer, header, strlen(header));
+    }
+
+    size_t nblocks_batch = 4 * u_threads_count_get(), nblocks, b;
+    write.data = data;
+    write.data_size = data_size;
+    write.ndata = ndata;
+    write.map = &kmeans_map;
+    write.dups = has_dups && dups.rows ? &dups : NULL;
+    write.unique_labels = unique_labels;
+    write.means_text = means_text;
+    write.means_starts = means_starts;
+    write.block_rows = TEXT_BLOCK_SIZE / line_max + 1;
+    write.buffer_size = write.block_rows * line_max;
+    if (!err) {
+        write.buffers = malloc(nblocks_batch * write.buffer_size);
+        write.lengths = malloc(nblocks_batch * sizeof(*write.lengths));
+        if (!write.buffers || !write.lengths) err = u_error_nomem();
+    }
+    nblocks = (ndata + write.block_rows - 1) / write.block_rows;
+    for (write.first_block = 0; write.first_block < nblocks && !err; write.first_block += nblocks_batch) {
+        size_t n = nblocks - write.first_block < nblocks_batch ? nblocks - write.first_block : nblocks_batch;
+        err = u_threads_for(n, 1, text_blocks_write, &write);
+        for (b = 0; b < n && !err; b++)
+            err = u_gzip_write(&writer, &write.buffers[b * write.buffer_size], write.lengths[b]);
+    }
+
+    if (out) {
+        int close_err = u_gzip_writer_close(&writer);
+        if (fclose(out) && !close_err)
+            close_err = u_error_set(U_ERROR_ACCESS, "File write failed.");
+        if (!err) err = close_err;
+    }
+    if (has_map) cr_kmeans_map_destroy(&kmeans_map);
+    if (has_dups) cr_duplicates_free(&dups);
+    free(unique_labels);
+    free(write.buffers);
+    free(write.lengths);
+    free(means_text);
+    free(means_starts);
+    free(means);
     free(data);
-    fclose(out);
-    return U_ERROR_SUCCESS;
+    return err;
 }
@@ -31,13 +31,15 @@ The files should be in this format:
 If you run this function on it, you will get something like
 ```
 5 2
-0.033333 -0.466667
-0.033333 -0.466667
-4.800000 6.250000
-4.800000 6.250000
-0.033333 -0.466667
+0.033333335 -0.46666667
+0.033333335 -0.46666667
+4.8 6.25
+4.8 6.25
+0.033333335 -0.46666667
 ```
-Here, k-means has found the two means (0.033333, -0.466667) and (4.8, 6.25).
+Here, k-means has found the two means (0.033333335, -0.46666667) and (4.8, 6.25).
+The numbers are written with as few digits as possible for them to be read back
+as exactly the same `float`s (see utils/math/floats.h).
 
 
 If you are dealing with large data sets,
@@ -53,13 +55,21 @@ you don't want the full 4 bytes of precision).
 
 /**
 Reduces the number of values in a text file, as described in this file's description.
+The file is mapped into memory (on POSIX systems) and parsed by several threads
+at once (see utils/misc/threads.h), and the output is built in large blocks, also in
+parallel, so this is much faster than reading and writing numbers one at a time.
 \param filename_in The name of the input file
 \param filename_out The name of the output file
 \param nvals The number of values to reduce it to
 \param take If this number is between 0 and 1, it refers to the percentage of pieces of data in the file to use in k-means. Otherwise, it will use the whole file.
 \param epsilon See \ref cr_kmeans_run
 \param iterations See \ref cr_kmeans_run
+\param collapse If this is nonzero, identical pieces of data are collapsed first (see duplicates.h),
+                so k-means only runs on the unique ones, and \p take is the percentage of those to use.
+                This is given up on if more than half of the pieces of data are unique.
+\param gzip_level If this is nonzero, the output is gzipped with this compression level (1-9).
+                  A gzipped input file is detected (and decompressed) automatically.
  */
-int cr_reduce_text_file(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations);
+int cr_reduce_text_file(const char* filename_in, const char* filename_out, size_t nvals, float take, float epsilon, size_t iterations, int collapse, int gzip_level);
 
 #endif /* COLORREDUCER_TEXTREDUCER_H */
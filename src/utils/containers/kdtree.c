@@ -96,6 +96,101 @@ int u_kdtree_insert(u_kdtree_t* tree, const float* key, const void* value) {
     return 0;
 }
 
+static void kdtree_select(const float* keys, size_t k, size_t d, size_t* idxs, size_t n, size_t nth) {
+    /* Rearranges idxs so that idxs[nth] is the index of the key whose d-th
+    coordinate would be at position nth if they were sorted by that coordinate,
+    with smaller ones before it and larger ones after. */
+    size_t lo = 0, hi = n - 1;
+    while (lo < hi) {
+        float pivot = keys[idxs[lo + (hi - lo) / 2] * k + d];
+        size_t i = lo, j = hi;
+        while (i <= j) {
+            while (keys[idxs[i] * k + d] < pivot) i++;
+            while (keys[idxs[j] * k + d] > pivot) j--;
+            if (i <= j) {
+                size_t tmp = idxs[i];
+                idxs[i] = idxs[j];
+                idxs[j] = tmp;
+                i++;
+                if (j == 0) break;
+                j--;
+            }
+        }
+        if (nth <= j) {
+            hi = j;
+        } else if (nth >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+}
+
+static u_kdtree_node_t* u_kdtree_node_build(const u_kdtree_t* tree, const float* keys, const char* values, size_t* idxs, size_t n, size_t d, int* err) {
+    if (n == 0 || *err) return NULL;
+    size_t k = tree->k, i;
+    kdtree_select(keys, k, d, idxs, n, n / 2);
+    /* Everything with the same coordinate as the median has to go in the right subtree. */
+    float median = keys[idxs[n / 2] * k + d];
+    size_t nleft = 0;
+    for (i = 0; i < n / 2; i++) {
+        if (keys[idxs[i] * k + d] < median) {
+            size_t tmp = idxs[nleft];
+            idxs[nleft] = idxs[i];
+            idxs[i] = tmp;
+            nleft++;
+        }
+    }
+    /* idxs[nleft..n/2] all have the median coordinate; make idxs[nleft] this node */
+    size_t tmp = idxs[nleft];
+    idxs[nleft] = idxs[n / 2];
+    idxs[n / 2] = tmp;
+
+    u_kdtree_node_t* node = malloc(sizeof(*node));
+    if (!node) {
+        *err = u_error_nomem();
+        return NULL;
+    }
+    node->d = d;
+    node->key = malloc(k * sizeof(*node->key));
+    node->value = tree->vsize ? malloc(tree->vsize) : NULL;
+    node->left = node->right = NULL;
+    if (!node->key || (tree->vsize && !node->value)) {
+        free(node->key);
+        free(node->value);
+        free(node);
+        *err = u_error_nomem();
+        return NULL;
+    }
+    memcpy(node->key, &keys[idxs[nleft] * k], k * sizeof(*node->key));
+    if (tree->vsize)
+        memcpy(node->value, &values[idxs[nleft] * tree->vsize], tree->vsize);
+    node->left = u_kdtree_node_build(tree, keys, values, idxs, nleft, (d+1) % k, err);
+    node->right = u_kdtree_node_build(tree, keys, values, idxs + nleft + 1, n - nleft - 1, (d+1) % k, err);
+    return node;
+}
+
+int u_kdtree_build(u_kdtree_t* tree, const float* keys, const void* values, size_t n) {
+    u_kdtree_clear(tree);
+    if (n == 0) return 0;
+    size_t* idxs = malloc(n * sizeof(*idxs));
+    if (!idxs) {
+        u_error_nomem();
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < n; i++)
+        idxs[i] = i;
+    int err = 0;
+    tree->root = u_kdtree_node_build(tree, keys, values, idxs, n, 0, &err);
+    free(idxs);
+    if (err) {
+        u_kdtree_clear(tree);
+        return -1;
+    }
+    return 0;
+}
+
 static float distance(const float* a, const float* b, size_t k) {
     size_t i;
     float sum_squared_diff = 0;
@@ -141,7 +236,7 @@ static void u_kdtree_node_nearest(const u_kdtree_node_t* node, size_t k, size_t
         *best_val = node->value;
     }
     u_kdtree_node_nearest(first_subtree, k, vsize, key, best_distance, best_key, best_val);
-    if (*best_distance >= difference) {
+    if (*best_distance >= difference * difference) { /* best_distance is squared */
         /* We need to check the second subtree */
         u_kdtree_node_nearest(second_subtree, k, vsize, key, best_distance, best_key, best_val);
     }
@@ -157,6 +252,28 @@ const void* u_kdtree_nearest(u_kdtree_t* tree, const float* key, const float** n
     return best_val;
 }
 
+static void u_kdtree_node_within(const u_kdtree_node_t* node, size_t k, const float* key, float radius, float radius_squared,
+                                 void (*fn)(const float* key, const void* value, void* arg), void* arg) {
+    while (node) {
+        if (distance(node->key, key, k) <= radius_squared)
+            fn(node->key, node->value, arg);
+        float difference = node->key[node->d] - key[node->d];
+        if (difference > radius) {
+            node = node->left; /* Only the left subtree can be close enough */
+        } else if (-difference >= radius) {
+            node = node->right;
+        } else {
+            u_kdtree_node_within(node->left, k, key, radius, radius_squared, fn, arg);
+            node = node->right;
+        }
+    }
+}
+
+void u_kdtree_within(const u_kdtree_t* tree, const float* key, float radius,
+                     void (*fn)(const float* key, const void* value, void* arg), void* arg) {
+    u_kdtree_node_within(tree->root, tree->k, key, radius, radius * radius, fn, arg);
+}
+
 void u_kdtree_destroy(u_kdtree_t* tree) {
     u_kdtree_node_free(tree->root);
 }
@@ -25,7 +25,8 @@ than this? See https://en.wikipedia.org/wiki/Curse_of_dimensionality#Nearest_nei
 
 If you are inserting any data into a k-d tree **make sure it is randomized, or
 at least not sorted**. Inserting sorted data into a k-d tree will drastically
-reduce its performance.
+reduce its performance. If you have all of the data at once, use \ref u_kdtree_build
+instead, which doesn't have this problem.
 */
 #ifndef CUTILS_CONTAINERS_KDTREE_H
 #define CUTILS_CONTAINERS_KDTREE_H
@@ -55,6 +56,12 @@ void   u_kdtree_clear(u_kdtree_t* tree);
     \returns 0 on success, or non-zero if insertion failed (maybe you ran out of
      memory), and sets \ref u_error_message. */
 int    u_kdtree_insert(u_kdtree_t* tree, const float* key, const void* value);
+/** Removes everything in \p tree and puts \p n items in it, with `keys[i*k..(i+1)*k]`
+    as the key of the i-th item, and `values + i*vsize` as its value (\p values can be
+    NULL if vsize == 0). Unlike inserting the items one at a time, the items don't need
+    to be in a random order: the tree is split at the median, so it is always balanced.
+    \returns 0 on success, or non-zero on failure (and sets \ref u_error_message). */
+int    u_kdtree_build(u_kdtree_t* tree, const float* keys, const void* values, size_t n);
 /** \returns value associated with key, or NULL iff the key is not present.
     If vsize == 0 and the key is present, returns (const void*)1.
     Actual key can differ by up to epsilon. For this function to work properly,
@@ -64,6 +71,12 @@ const void* u_kdtree_get(const u_kdtree_t* tree, const float* key, float epsilon
         Returns NULL iff either `vsize` == 0 or the tree is empty.
         Puts the nearest key in \p nearest_key (can be NULL). */
 const void* u_kdtree_nearest(u_kdtree_t* tree, const float* key, const float** nearest_key);
+/** Calls \p fn for every item whose key is at most \p radius away from \p key
+    (using euclidean distance). \p fn is given the item's key and value, and \p arg.
+    Like \ref u_kdtree_nearest, this doesn't modify the tree, so several threads
+    can use it at once. */
+void   u_kdtree_within(const u_kdtree_t* tree, const float* key, float radius,
+                       void (*fn)(const float* key, const void* value, void* arg), void* arg);
 /** Frees memory in tree. Does not call `free` on \p tree itself. */
 void   u_kdtree_destroy(u_kdtree_t* tree);
 
@@ -15,12 +15,22 @@
     You should have received a copy of the GNU General Public License
     along with cutils.  If not, see <https://www.gnu.org/licenses/>.
 */
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200112L /* For fileno and mmap */
+#define AUDIO_MMAP
+#endif
+
 #include "audio.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef AUDIO_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "../misc/types_exact.h"
 #include "../misc/error.h"
 
@@ -35,9 +45,6 @@ struct u_audio {
 #error "Invalid value of CHAR_BIT."
 #endif
 
-u_byte_t a;
-
-
 typedef struct {
     char    chunk_id[4];
     u_u4b_t chunk_size;
@@ -52,135 +59,496 @@ typedef struct {
     u_u2b_t bits_per_sample;
 } wav_header_t;
 
-u_audio_t* u_audio_read(const char* filename) {
+#define WAV_RIFF_SIZE_OFFSET 4 /* Where the size of the RIFF chunk is in the file */
+#define WAV_DATA_SIZE_OFFSET (sizeof(wav_header_t) + 4) /* Where the size of the data chunk is in files we write */
+
+struct u_audio_reader {
+    FILE* fp;
+    u_bool_t stream; /* Whether fp is a stream (e.g. stdin) which belongs to the caller */
+    u_bool_t raw; /* Whether the stream is raw PCM (without a header) */
+    u_u1b_t pending[4]; /* Bytes which were read while checking for a header, but are actually samples */
+    size_t npending;
+    long data_start; /* The position of the first sample in the file */
+    u_u32_t sample_rate;
+    u_u16_t nchannels;
+    u_u16_t bits_per_sample;
+    u_u32_t nsamples; /* (U_AUDIO_UNKNOWN_LENGTH for streams which go until they end) */
+    u_u32_t position; /* The number of samples which have been read */
+    u_u1b_t* buffer; /* U_AUDIO_BLOCK_SIZE samples, as they are in the file */
+    const u_u1b_t* data; /* The data chunk, if the file is mapped into memory (otherwise NULL) */
+    void* map; /* The mapping of the whole file */
+    size_t map_size;
+#ifdef AUDIO_MMAP
+    dev_t map_dev; /* Which file is mapped, so writers can be kept from truncating it */
+    ino_t map_ino;
+    u_audio_reader_t* next_mapped;
+#endif
+};
+
+struct u_audio_writer {
+    FILE* fp;
+    u_bool_t stream; /* Whether fp is a stream which belongs to the caller */
+    long header_start; /* Where the header is in the file, so the sizes can be filled in (-1 if there's no header, or fp can't seek) */
+    u_u16_t nchannels;
+    u_u32_t nsamples; /* The number of samples which have been written */
+    u_i2b_t* buffer; /* U_AUDIO_BLOCK_SIZE samples, as they are in the file */
+};
+
+/* These loops are kept simple (no branches or aliasing) so that the compiler can vectorize them. */
+static void audio_convert_u8(const u_u1b_t* in, u_u16_t* out, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++)
+        out[i] = (u_u16_t)(in[i] << 8);
+}
+
+static void audio_convert_i16(const u_i2b_t* in, u_u16_t* out, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++)
+        out[i] = (u_u16_t)(in[i] + 32768);
+}
+
+static void audio_convert_f32(const float* in, u_u16_t* out, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        float x = in[i] * 32768.0f + 32768.0f;
+        x = x < 0 ? 0 : x > 65535 ? 65535 : x;
+        out[i] = (u_u16_t)x;
+    }
+}
+
+static void audio_convert_to_i16(const u_u16_t* in, u_i2b_t* out, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++)
+        out[i] = (u_i2b_t)(in[i] - 32768);
+}
+
+#ifdef AUDIO_MMAP
+/* Every reader with a mapped file. Truncating a mapped file would make reading it crash
+   (with SIGBUS), so writers refuse to open these files. */
+static u_audio_reader_t* audio_mapped_readers = NULL;
+#endif
+
+static void audio_reader_map(u_audio_reader_t* reader) {
+    /* Maps the file into memory, if possible, so that samples can be converted straight
+       from the page cache (if not, the reader just uses fread). */
+#ifdef AUDIO_MMAP
+    struct stat st;
+    size_t data_end = reader->data_start + (size_t)reader->nsamples * reader->nchannels * (reader->bits_per_sample / CHAR_BIT);
+    if (reader->data_start < 0 || fstat(fileno(reader->fp), &st) || !S_ISREG(st.st_mode) || (size_t)st.st_size < data_end || !data_end)
+        return;
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(reader->fp), 0);
+    if (map == MAP_FAILED)
+        return;
+    reader->map = map;
+    reader->map_size = st.st_size;
+    reader->data = (const u_u1b_t*)map + reader->data_start;
+    reader->map_dev = st.st_dev;
+    reader->map_ino = st.st_ino;
+    reader->next_mapped = audio_mapped_readers;
+    audio_mapped_readers = reader;
+#endif
+}
+
+static void audio_skip(FILE* fp, long n) {
+    /* Skips n bytes (streams like stdin can't seek, so they have to be read) */
+    if (n > 0 && fseek(fp, n, SEEK_CUR))
+        while (n-- && getc(fp) != EOF);
+}
+
+static u_audio_reader_t* audio_reader_new(FILE* fp, u_bool_t stream) {
+    u_audio_reader_t* reader = malloc(sizeof(*reader));
+    if (!reader) {
+        u_error_nomem();
+        return NULL;
+    }
+    reader->fp = fp;
+    reader->stream = stream;
+    reader->raw = 0;
+    reader->npending = 0;
+    reader->buffer = NULL;
+    reader->data = NULL;
+    reader->map = NULL;
+    reader->data_start = -1;
+    reader->position = 0;
+    return reader;
+}
+
+static int audio_reader_buffer_alloc(u_audio_reader_t* reader) {
+    reader->buffer = malloc((size_t)U_AUDIO_BLOCK_SIZE * reader->nchannels * (reader->bits_per_sample / CHAR_BIT));
+    if (!reader->buffer)
+        return u_error_nomem();
+    return U_ERROR_SUCCESS;
+}
+
+static int audio_reader_header_read(u_audio_reader_t* reader, const char chunk_id[4]) {
+    /* Reads the WAV header (the first 4 bytes of which have already been read into chunk_id),
+       up to the start of the data chunk */
+    wav_header_t header;
+    memcpy(header.chunk_id, chunk_id, 4);
+    if (fread((char*)&header + 4, sizeof(header) - 4, 1, reader->fp) != 1)
+        return u_error_set(U_ERROR_FORMAT, "Invalid .wav file.");
+    /* Check header properties */
+    if (strncmp(header.chunk_id, "RIFF", 4))
+        return u_error_set(U_ERROR_FORMAT, "Invalid .wav chunk ID.");
+    if (strncmp(header.format, "WAVE", 4))
+        return u_error_set(U_ERROR_FORMAT, "Invalid .wav format.");
+    if (header.bits_per_sample != CHAR_BIT &&
+        header.bits_per_sample != 2*CHAR_BIT &&
+        header.bits_per_sample != 4*CHAR_BIT)
+        return u_error_set(U_ERROR_FORMAT, "Invalid wav bits per sample (must be 1, 2, or 4 bytes).");
+    if (header.nchannels == 0)
+        return u_error_set(U_ERROR_FORMAT, "Invalid .wav file (no channels).");
+    reader->nchannels = header.nchannels;
+    reader->sample_rate = header.sample_rate;
+    reader->bits_per_sample = header.bits_per_sample;
+    if (header.subchunk1_size > 16)
+        audio_skip(reader->fp, header.subchunk1_size - 16); /* Extra format information */
+
+    /* Now we're done reading the header, but there might be other non-data chunks */
+    char id[4];
+    u_u4b_t chunk_size;
+    do {
+        if (fread(id, sizeof(id), 1, reader->fp) != 1
+         || fread(&chunk_size, sizeof(chunk_size), 1, reader->fp) != 1)
+            return u_error_set(U_ERROR_FORMAT, "Malformed wave file (missing data chunk).");
+        if (!strncmp(id, "data", 4))
+            break; /* We found the data chunk! */
+        audio_skip(reader->fp, chunk_size + (chunk_size & 1)); /* Chunks are padded to an even size */
+    } while (1);
+
+    if (!reader->stream)
+        reader->data_start = ftell(reader->fp);
+    if (reader->stream && (chunk_size == 0 || chunk_size == 0xFFFFFFFFUL))
+        reader->nsamples = U_AUDIO_UNKNOWN_LENGTH; /* The writer didn't know how long the stream would be */
+    else
+        reader->nsamples = chunk_size / reader->nchannels / (reader->bits_per_sample / CHAR_BIT);
+    return audio_reader_buffer_alloc(reader);
+}
+
+u_audio_reader_t* u_audio_reader_open(const char* filename) {
     FILE* fp = fopen(filename, "rb");
     if (!fp) {
-        char filename_short[256];
-        strncpy(filename_short, filename, 255);
-        sprintf(u_error_message,
-                "Could not read audio file: %s", filename);
-        u_error_code = U_ERROR_ACCESS;
+        u_error_fopen(filename, "reading");
         return NULL;
     }
-    u_audio_t* audio = malloc(sizeof(u_audio_t));
-    wav_header_t header;
-    if (fread(&header, sizeof(header), 1, fp) != 1) {
+    u_audio_reader_t* reader = audio_reader_new(fp, 0);
+    if (!reader) {
         fclose(fp);
-        free(audio);
-        u_error_set(U_ERROR_FORMAT, "Invalid .wav file.");
         return NULL;
     }
-    /* Check header properties */
-    if (strncmp(header.chunk_id, "RIFF", 4)) {
-        fclose(fp);
-        free(audio);
-        u_error_set(U_ERROR_FORMAT, "Invalid .wav chunk ID.");
+    char chunk_id[4];
+    if (fread(chunk_id, sizeof(chunk_id), 1, fp) != 1) {
+        u_audio_reader_close(reader);
+        u_error_set(U_ERROR_FORMAT, "Invalid .wav file.");
         return NULL;
     }
-    if (strncmp(header.format, "WAVE", 4)) {
-        fclose(fp);
-        free(audio);
-        u_error_set(U_ERROR_FORMAT, "Invalid .wav format.");
+    if (audio_reader_header_read(reader, chunk_id)) {
+        u_audio_reader_close(reader);
         return NULL;
     }
-    /* Get metadata */
+    audio_reader_map(reader);
+    return reader;
+}
 
-    if (header.bits_per_sample != CHAR_BIT &&
-        header.bits_per_sample != 2*CHAR_BIT &&
-        header.bits_per_sample != 4*CHAR_BIT) {
-        fclose(fp);
-        free(audio);
-        u_error_set(U_ERROR_FORMAT, "Invalid wav bits per sample (must be 1, 2, or 4 bytes).");
+u_audio_reader_t* u_audio_reader_stream_open(FILE* fp, u_u16_t nchannels, u_u32_t sample_rate) {
+    u_audio_reader_t* reader = audio_reader_new(fp, 1);
+    if (!reader)
+        return NULL;
+    reader->npending = fread(reader->pending, 1, sizeof(reader->pending), fp);
+    int err;
+    if (reader->npending == 4 && !memcmp(reader->pending, "RIFF", 4)) {
+        reader->npending = 0;
+        err = audio_reader_header_read(reader, "RIFF");
+    } else {
+        /* No header, so it's raw 16-bit PCM (and the bytes we've read are the first samples) */
+        reader->raw = 1;
+        reader->nchannels = nchannels;
+        reader->sample_rate = sample_rate;
+        reader->bits_per_sample = 16;
+        reader->nsamples = U_AUDIO_UNKNOWN_LENGTH;
+        err = nchannels ? audio_reader_buffer_alloc(reader) : u_error_set(U_ERROR_ARGUMENT, "Audio must have at least one channel.");
+    }
+    if (err) {
+        u_audio_reader_close(reader);
         return NULL;
     }
+    return reader;
+}
 
-    audio->nchannels = header.nchannels;
-    audio->sample_rate = header.sample_rate;
+u_bool_t u_audio_reader_raw(const u_audio_reader_t* reader) {
+    return reader->raw;
+}
 
-    /* Now we're done reading the header, but there might be other non-data chunks */
-    char chunk_id[4];
-    u_u4b_t chunk_size;
-    do {
-        if (fread(chunk_id, sizeof(chunk_id), 1, fp) != 1
-         || fread(&chunk_size, sizeof(chunk_size), 1, fp) != 1) {
-            fclose(fp);
-            free(audio);
-            u_error_set(U_ERROR_FORMAT, "Invalid .wav file.");
-            return NULL;
+u_u32_t u_audio_reader_sample_rate_get(const u_audio_reader_t* reader) {
+    return reader->sample_rate;
+}
+
+u_u16_t u_audio_reader_number_of_channels_get(const u_audio_reader_t* reader) {
+    return reader->nchannels;
+}
+
+u_u32_t u_audio_reader_number_of_samples_get(const u_audio_reader_t* reader) {
+    return reader->nsamples;
+}
+
+int u_audio_reader_read(u_audio_reader_t* reader, u_u16_t* samples, u_u32_t nsamples, u_u32_t* nread) {
+    u_u32_t total = 0;
+    if (nsamples > reader->nsamples - reader->position)
+        nsamples = reader->nsamples - reader->position;
+    while (total < nsamples) {
+        u_u32_t n = nsamples - total;
+        if (n > U_AUDIO_BLOCK_SIZE) n = U_AUDIO_BLOCK_SIZE;
+        size_t nvalues = (size_t)n * reader->nchannels, value_size = reader->bits_per_sample / CHAR_BIT;
+        const u_u1b_t* in = reader->buffer;
+        if (reader->data) {
+            in = &reader->data[(size_t)reader->position * reader->nchannels * value_size];
+            if ((size_t)in % value_size) {
+                /* Not aligned, so it can't be used as an array of samples */
+                memcpy(reader->buffer, in, nvalues * value_size);
+                in = reader->buffer;
+            }
+        } else {
+            size_t nbytes = nvalues * value_size, got = reader->npending;
+            memcpy(reader->buffer, reader->pending, reader->npending);
+            reader->npending = 0;
+            got += fread(&reader->buffer[got], 1, nbytes - got, reader->fp);
+            if (got < nbytes) {
+                if (!reader->stream) {
+                    if (nread) *nread = total;
+                    return u_error_set(U_ERROR_FORMAT, "Invalid .wav file (ended too early).");
+                }
+                /* The stream has ended (any partial sample at the end is dropped) */
+                n = got / value_size / reader->nchannels;
+                nvalues = (size_t)n * reader->nchannels;
+                reader->nsamples = reader->position + n;
+                nsamples = total + n;
+            }
         }
-        if (!strncmp(chunk_id, "data", 4))
-            break; /* We found the data chunk! */
-        fseek(fp, chunk_size, SEEK_CUR);
-        if (feof(fp)) {
-            /* Reached end of file */
-            u_error_set(U_ERROR_FORMAT, "Malformed wave file (missing data chunk).");
-            return NULL;
+        u_u16_t* out = &samples[(size_t)total * reader->nchannels];
+        switch (reader->bits_per_sample) {
+        case 8:
+            audio_convert_u8(in, out, nvalues);
+            break;
+        case 16:
+            audio_convert_i16((const u_i2b_t*)in, out, nvalues);
+            break;
+        case 32:
+            if (sizeof(float) != 4)
+                return u_error_set(U_ERROR_SYSTEM, "You can only use 32-bit wav files if your sizeof(float) is 4.");
+            audio_convert_f32((const float*)in, out, nvalues);
+            break;
         }
-    } while (1);
+        total += n;
+        reader->position += n;
+    }
+    if (nread) *nread = total;
+    return U_ERROR_SUCCESS;
+}
 
-    /* Read the actual data */
-    u_u32_t data_length = chunk_size;
-    u_u1b_t* data = malloc(data_length);
-    if (!data) {
-        fclose(fp);
-        free(audio);
+u_bool_t u_audio_reader_mapped(const u_audio_reader_t* reader) {
+    return reader->data != NULL;
+}
+
+u_u16_t u_audio_reader_value_get(const u_audio_reader_t* reader, size_t i) {
+    u_u16_t value;
+    switch (reader->bits_per_sample) {
+    case 8:
+        audio_convert_u8(&reader->data[i], &value, 1);
+        break;
+    case 16: {
+        u_i2b_t in;
+        memcpy(&in, &reader->data[2 * i], sizeof(in)); /* (it might not be aligned) */
+        audio_convert_i16(&in, &value, 1);
+    } break;
+    default: {
+        float in;
+        memcpy(&in, &reader->data[4 * i], sizeof(in));
+        audio_convert_f32(&in, &value, 1);
+    } break;
+    }
+    return value;
+}
+
+int u_audio_reader_rewind(u_audio_reader_t* reader) {
+    if (reader->stream)
+        return u_error_set(U_ERROR_ARGUMENT, "Can't go back to the start of an audio stream.");
+    if (!reader->data && fseek(reader->fp, reader->data_start, SEEK_SET))
+        return u_error_set(U_ERROR_ACCESS, "Failed to go back to the start of the audio.");
+    reader->position = 0;
+    return U_ERROR_SUCCESS;
+}
+
+void u_audio_reader_close(u_audio_reader_t* reader) {
+#ifdef AUDIO_MMAP
+    if (reader->map) {
+        u_audio_reader_t** r;
+        for (r = &audio_mapped_readers; *r != reader; r = &(*r)->next_mapped);
+        *r = reader->next_mapped;
+        munmap(reader->map, reader->map_size);
+    }
+#endif
+    if (!reader->stream)
+        fclose(reader->fp);
+    free(reader->buffer);
+    free(reader);
+}
+
+static u_audio_writer_t* audio_writer_new(FILE* fp, u_bool_t stream, u_u16_t nchannels) {
+    u_audio_writer_t* writer = malloc(sizeof(*writer));
+    u_i2b_t* buffer = malloc((size_t)U_AUDIO_BLOCK_SIZE * nchannels * sizeof(*buffer));
+    if (!writer || !buffer) {
+        free(writer);
+        free(buffer);
         u_error_nomem();
         return NULL;
     }
-    if (fread(data, 1, data_length, fp) != data_length) {
+    writer->fp = fp;
+    writer->stream = stream;
+    writer->buffer = buffer;
+    writer->nchannels = nchannels;
+    writer->nsamples = 0;
+    writer->header_start = -1;
+    return writer;
+}
+
+static int audio_writer_header_write(u_audio_writer_t* writer, u_u32_t sample_rate, u_u4b_t size) {
+    /* size is the size of the data chunk (the RIFF chunk is 36 bytes bigger) */
+    wav_header_t header;
+    memcpy(header.chunk_id, "RIFF", 4);
+    header.chunk_size = size == 0xFFFFFFFFUL ? size : 36 + size;
+    memcpy(header.format, "WAVE", 4);
+    memcpy(header.subchunk1_id, "fmt ", 4);
+    header.subchunk1_size = 16;
+    header.audio_format = 1;
+    header.nchannels = writer->nchannels;
+    header.sample_rate = sample_rate;
+    header.byte_rate = sample_rate * writer->nchannels * sizeof(u_i2b_t);
+    header.block_align = writer->nchannels * sizeof(u_i2b_t);
+    header.bits_per_sample = CHAR_BIT * sizeof(u_i2b_t);
+    if (fwrite(&header, sizeof(header), 1, writer->fp) != 1
+     || fwrite("data", 1, 4, writer->fp) != 4
+     || fwrite(&size, sizeof(size), 1, writer->fp) != 1)
+        return u_error_set(U_ERROR_ACCESS, "Failed to write audio file.");
+    return U_ERROR_SUCCESS;
+}
+
+u_audio_writer_t* u_audio_writer_open(const char* filename, u_u16_t nchannels, u_u32_t sample_rate) {
+#ifdef AUDIO_MMAP
+    struct stat st;
+    if (!stat(filename, &st)) {
+        const u_audio_reader_t* reader;
+        for (reader = audio_mapped_readers; reader; reader = reader->next_mapped) {
+            if (reader->map_dev == st.st_dev && reader->map_ino == st.st_ino) {
+                u_error_set(U_ERROR_ARGUMENT, "Can't write to an audio file which is being read.");
+                return NULL;
+            }
+        }
+    }
+#endif
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        u_error_fopen(filename, "writing");
+        return NULL;
+    }
+    u_audio_writer_t* writer = audio_writer_new(fp, 0, nchannels);
+    if (!writer) {
         fclose(fp);
-        free(audio);
-        u_error_set(U_ERROR_FORMAT, "Invalid .wav file");
         return NULL;
     }
-
-    u_u32_t nsamples = data_length / audio->nchannels / (header.bits_per_sample / CHAR_BIT);
-    u_u32_t nchannels = audio->nchannels;
-    u_u32_t nvalues = nsamples * nchannels;
-    u_u16_t* samples = malloc(nvalues * sizeof(*samples));
-    if (!samples) {
+    /* The sizes are filled in by u_audio_writer_close */
+    writer->header_start = 0;
+    if (audio_writer_header_write(writer, sample_rate, 0)) {
         fclose(fp);
-        free(audio);
-        free(data);
-        u_error_nomem();
+        free(writer->buffer);
+        free(writer);
         return NULL;
     }
-    u_u16_t* samples_out = samples;
-    u_u16_t* samples_end = samples_out + nvalues;
-    switch (header.bits_per_sample) {
-    case 8: {
-        u_u1b_t* samples_in = (u_u1b_t*)data;
-        while (samples_out != samples_end) {
-            *samples_out++ = (*samples_in++) << 8;
-        }
-        break;
+    return writer;
+}
+
+u_audio_writer_t* u_audio_writer_stream_open(FILE* fp, u_u16_t nchannels, u_u32_t sample_rate, u_bool_t raw) {
+    u_audio_writer_t* writer = audio_writer_new(fp, 1, nchannels);
+    if (!writer)
+        return NULL;
+    /* The length isn't known yet, so the sizes are left at their maximum (they are filled in
+       when the writer is closed, if the stream turns out to be a file) */
+    if (!raw)
+        writer->header_start = ftell(fp);
+    if (!raw && audio_writer_header_write(writer, sample_rate, 0xFFFFFFFFUL)) {
+        free(writer->buffer);
+        free(writer);
+        return NULL;
     }
-    case 16: {
-        u_i2b_t* samples_in = (u_i2b_t*)data;
-        while (samples_out != samples_end) {
-            *samples_out++ = (*samples_in++) + 32767;
-        }
-        break;
+    return writer;
+}
+
+int u_audio_writer_write(u_audio_writer_t* writer, const u_u16_t* samples, u_u32_t nsamples) {
+    u_u32_t done = 0;
+    while (done < nsamples) {
+        u_u32_t n = nsamples - done;
+        if (n > U_AUDIO_BLOCK_SIZE) n = U_AUDIO_BLOCK_SIZE;
+        size_t nvalues = (size_t)n * writer->nchannels;
+        audio_convert_to_i16(&samples[(size_t)done * writer->nchannels], writer->buffer, nvalues);
+        if (fwrite(writer->buffer, sizeof(*writer->buffer), nvalues, writer->fp) != nvalues)
+            return u_error_set(U_ERROR_ACCESS, "Failed to write audio file.");
+        done += n;
+        writer->nsamples += n;
     }
-    case 32: {
-        if (sizeof(float) != 4) {
-            u_error_set(U_ERROR_SYSTEM, "You can only use 32-bit wav files if your sizeof(float) is 4.");
-            fclose(fp);
-            free(audio);
-            free(data);
-            return NULL;
-        }
-        float* samples_in = (float*)data;
-        while (samples_out != samples_end) {
-            *samples_out++ = (*samples_in++) * 65535 - 32768;
+    if (writer->stream && fflush(writer->fp)) /* Pass the samples on straight away */
+        return u_error_set(U_ERROR_ACCESS, "Failed to write audio file.");
+    return U_ERROR_SUCCESS;
+}
+
+int u_audio_writer_close(u_audio_writer_t* writer) {
+    int err = U_ERROR_SUCCESS;
+    u_u4b_t data_size = writer->nsamples * writer->nchannels * sizeof(u_i2b_t);
+    u_u4b_t riff_size = 36 + data_size;
+    if (writer->header_start >= 0) {
+        long end = ftell(writer->fp);
+        if (fseek(writer->fp, writer->header_start + WAV_RIFF_SIZE_OFFSET, SEEK_SET)) {
+            if (!writer->stream) /* (streams which can't seek just keep their sizes at the maximum) */
+                err = u_error_set(U_ERROR_ACCESS, "Failed to write audio file.");
+        } else if (fwrite(&riff_size, sizeof(riff_size), 1, writer->fp) != 1
+                || fseek(writer->fp, writer->header_start + WAV_DATA_SIZE_OFFSET, SEEK_SET)
+                || fwrite(&data_size, sizeof(data_size), 1, writer->fp) != 1
+                || fseek(writer->fp, end, SEEK_SET)) {
+            err = u_error_set(U_ERROR_ACCESS, "Failed to write audio file.");
         }
-        break;
     }
+    if (writer->stream) {
+        if (fflush(writer->fp) && !err)
+            err = u_error_set(U_ERROR_ACCESS, "Failed to write audio file.");
+    } else if (fclose(writer->fp) && !err)
+        err = u_error_set(U_ERROR_ACCESS, "Failed to write audio file.");
+    free(writer->buffer);
+    free(writer);
+    return err;
+}
+
+u_audio_t* u_audio_read(const char* filename) {
+    u_audio_reader_t* reader = u_audio_reader_open(filename);
+    if (!reader)
+        return NULL;
+    u_audio_t* audio = malloc(sizeof(*audio));
+    u_u16_t* samples = malloc((size_t)reader->nsamples * reader->nchannels * sizeof(*samples));
+    if (!audio || !samples) {
+        free(audio);
+        free(samples);
+        u_audio_reader_close(reader);
+        u_error_nomem();
+        return NULL;
+    }
+    if (u_audio_reader_read(reader, samples, reader->nsamples, NULL)) {
+        free(audio);
+        free(samples);
+        u_audio_reader_close(reader);
+        return NULL;
     }
     audio->samples = samples;
-    audio->nsamples = nsamples;
-    fclose(fp);
-    free(data);
+    audio->nsamples = reader->nsamples;
+    audio->nchannels = reader->nchannels;
+    audio->sample_rate = reader->sample_rate;
+    u_audio_reader_close(reader);
     return audio;
 }
 
@@ -220,44 +588,12 @@ u_u16_t* u_audio_samples_get(u_audio_t* audio, u_u32_t* nsamples) {
 }
 
 int u_audio_write(const char* filename, const u_audio_t* audio) {
-    FILE* fp = fopen(filename, "w");
-    wav_header_t header;
-    strcpy(header.chunk_id, "RIFF");
-    u_u32_t data_size = audio->nchannels * audio->nsamples * sizeof(*audio->samples);
-    header.chunk_size = 36 + data_size;
-    strcpy(header.format, "WAVE");
-    strcpy(header.subchunk1_id, "fmt ");
-    header.subchunk1_size = 16;
-    header.audio_format = 1;
-    header.nchannels = audio->nchannels;
-    header.sample_rate = audio->sample_rate;
-    header.byte_rate = audio->sample_rate * audio->nchannels * sizeof(*audio->samples);
-    header.block_align = header.nchannels * sizeof(*audio->samples);
-    header.bits_per_sample = CHAR_BIT * sizeof(*audio->samples);
-    fwrite(&header, sizeof(header), 1, fp);
-    fwrite("data", 1, 4, fp);
-    u_u32_t nvalues = audio->nchannels * audio->nsamples;
-    u_u32_t chunk_size = nvalues * sizeof(*audio->samples);
-    fwrite(&chunk_size, sizeof(chunk_size), 1, fp);
-
-    /* Convert to signed */
-    const u_u16_t* samples_in = audio->samples;
-    u_i2b_t* samples =  malloc(nvalues * sizeof(*samples));
-    if (!samples) {
-        fclose(fp);
-        return u_error_nomem();
-    }
-
-    u_i2b_t* samples_out = samples;
-    u_i2b_t* samples_end = samples_out + nvalues;
-    while (samples_out != samples_end)
-        *samples_out++ = (*samples_in++) - 32768;
-
-    fwrite(samples, sizeof(*samples), nvalues, fp);
-
-    free(samples);
-    fclose(fp);
-    return U_ERROR_SUCCESS;
+    u_audio_writer_t* writer = u_audio_writer_open(filename, audio->nchannels, audio->sample_rate);
+    if (!writer)
+        return u_error_code;
+    int err = u_audio_writer_write(writer, audio->samples, audio->nsamples);
+    int close_err = u_audio_writer_close(writer);
+    return err ? err : close_err;
 }
 
 void u_audio_free(u_audio_t* audio) {
@@ -24,10 +24,16 @@ Currently only .wav is supported.
 #define CUTILS_FILETYPES_AUDIO_H
 
 #include <stddef.h>
+#include <stdio.h>
 
 #include "../misc/types.h"
 
 typedef struct u_audio u_audio_t;
+typedef struct u_audio_reader u_audio_reader_t; /**< For reading audio a block at a time. */
+typedef struct u_audio_writer u_audio_writer_t; /**< For writing audio a block at a time. */
+
+#define U_AUDIO_BLOCK_SIZE 4096 /**< The number of samples readers and writers convert at once. */
+#define U_AUDIO_UNKNOWN_LENGTH 0xFFFFFFFFUL /**< The number of samples in a stream whose length isn't known until it ends. */
 
 /** Reads an audio file.
 \param filename The file's name.
@@ -70,4 +76,64 @@ u_u16_t*   u_audio_samples_get(u_audio_t* audio, u_u32_t* nsamples);
 int        u_audio_write(const char* filename, const u_audio_t* audio);
 /** Frees a piece of audio. */
 void       u_audio_free(u_audio_t* audio);
+
+/** Starts reading an audio file a few samples at a time, so that it never has
+    to all be in memory. Samples are converted to unsigned 16-bit, like \ref u_audio_read.
+    \returns A reader, or NULL on failure and sets \ref u_error_message accordingly. */
+u_audio_reader_t* u_audio_reader_open(const char* filename);
+/** Starts reading audio from a stream which might not be seekable, e.g. `stdin`. If the
+    stream starts with a WAV header, it is used (a header whose data size is 0 or 0xFFFFFFFF,
+    as written by programs which don't know how long their output will be, means the audio
+    goes on until the stream ends). Otherwise, the stream is raw signed 16-bit PCM, in the
+    machine's byte order, with \p nchannels channels at \p sample_rate.
+    At the end of the stream, \ref u_audio_reader_read just reads fewer samples than it
+    was asked to. The stream can't be rewound, and isn't closed by \ref u_audio_reader_close.
+    \returns A reader, or NULL on failure and sets \ref u_error_message accordingly. */
+u_audio_reader_t* u_audio_reader_stream_open(FILE* fp, u_u16_t nchannels, u_u32_t sample_rate);
+/** \returns Whether the audio is raw PCM, without a header (see \ref u_audio_reader_stream_open). */
+u_bool_t   u_audio_reader_raw(const u_audio_reader_t* reader);
+/** \returns The sample rate of the audio being read. */
+u_u32_t    u_audio_reader_sample_rate_get(const u_audio_reader_t* reader);
+/** \returns The number of channels of the audio being read. */
+u_u16_t    u_audio_reader_number_of_channels_get(const u_audio_reader_t* reader);
+/** \returns The total number of samples in the audio being read (counting one multi-channel sample as one sample),
+    or \ref U_AUDIO_UNKNOWN_LENGTH for a stream which hasn't ended yet. */
+u_u32_t    u_audio_reader_number_of_samples_get(const u_audio_reader_t* reader);
+/** Reads the next \p nsamples (multi-channel) samples into \p samples, which should
+    have room for `nsamples * nchannels` values (see \ref u_audio_create for the layout).
+    \param nread If this is not `NULL`, it is set to the number of samples actually read,
+                 which is less than \p nsamples at the end of the audio.
+    \returns An error code. */
+int        u_audio_reader_read(u_audio_reader_t* reader, u_u16_t* samples, u_u32_t nsamples, u_u32_t* nread);
+/** \returns Whether the file is mapped into memory (so that \ref u_audio_reader_value_get
+    can be used). Readers map their files when they can (on POSIX systems), and then
+    reading just converts samples straight from the mapping, with no copying. */
+u_bool_t   u_audio_reader_mapped(const u_audio_reader_t* reader);
+/** \returns Value \p i of the audio (the `i`th element of the array \ref u_audio_reader_read
+    would read the whole audio into). This is cheap, and doesn't change the position of
+    \p reader, so it is good for taking random samples. Only use this if \ref u_audio_reader_mapped. */
+u_u16_t    u_audio_reader_value_get(const u_audio_reader_t* reader, size_t i);
+/** Goes back to the first sample. \returns An error code. */
+int        u_audio_reader_rewind(u_audio_reader_t* reader);
+/** Closes the file and frees \p reader. */
+void       u_audio_reader_close(u_audio_reader_t* reader);
+
+/** Starts writing a 16-bit WAV file a few samples at a time. This fails if \p filename is
+    mapped by an open reader, since overwriting it would pull the samples out from under it.
+    \returns A writer, or NULL on failure and sets \ref u_error_message accordingly. */
+u_audio_writer_t* u_audio_writer_open(const char* filename, u_u16_t nchannels, u_u32_t sample_rate);
+/** Starts writing 16-bit audio to a stream which might not be seekable, e.g. `stdout`.
+    Each call to \ref u_audio_writer_write is flushed straight away. The stream isn't closed
+    by \ref u_audio_writer_close.
+    \param raw If this is nonzero, just the samples are written (signed 16-bit PCM, in the
+               machine's byte order); otherwise, they are preceded by a WAV header, with
+               the sizes set to 0xFFFFFFFF, since they aren't known (if \p fp can seek,
+               they are filled in by \ref u_audio_writer_close).
+    \returns A writer, or NULL on failure and sets \ref u_error_message accordingly. */
+u_audio_writer_t* u_audio_writer_stream_open(FILE* fp, u_u16_t nchannels, u_u32_t sample_rate, u_bool_t raw);
+/** Writes the next \p nsamples (multi-channel) samples. \returns An error code. */
+int        u_audio_writer_write(u_audio_writer_t* writer, const u_u16_t* samples, u_u32_t nsamples);
+/** Fills in the sizes in the header, closes the file, and frees \p writer.
+    \returns An error code. */
+int        u_audio_writer_close(u_audio_writer_t* writer);
 #endif /* CUTILS_FILETYPES_AUDIO_H */
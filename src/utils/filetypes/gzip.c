@@ -0,0 +1,290 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _POSIX_C_SOURCE 200112L
+#include "gzip.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "../misc/error.h"
+
+#define GZIP_WINDOW_BITS (15 + 16) /* A 32K window, with a gzip header and trailer */
+
+struct u_gzip_inflater {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t readable; /* Signalled when there's more data in the buffer (or decompression has finished) */
+    pthread_cond_t writable; /* Signalled when there's more space in the buffer (or reading has stopped) */
+    unsigned char* buffer; /* A ring buffer of U_GZIP_BUFFER_SIZE bytes of decompressed data */
+    size_t start, len;
+    int done; /* Whether decompression has finished */
+    int stop; /* Whether the reader has been closed (so decompression should stop) */
+    int err; /* An error code from decompression (set from the thread, so the message is set later, by u_gzip_reader_error) */
+    FILE* fp;
+    z_stream z;
+    unsigned char in[U_GZIP_CHUNK_SIZE];
+    unsigned char out[U_GZIP_CHUNK_SIZE];
+};
+
+struct u_gzip_deflater {
+    z_stream z;
+    unsigned char out[U_GZIP_CHUNK_SIZE];
+};
+
+static int gzip_put(struct u_gzip_inflater* g, const unsigned char* data, size_t n) {
+    /* Adds n bytes to the buffer, waiting for space when it's full. Returns nonzero if reading has stopped. */
+    pthread_mutex_lock(&g->mutex);
+    while (n && !g->stop) {
+        while (g->len == U_GZIP_BUFFER_SIZE && !g->stop)
+            pthread_cond_wait(&g->writable, &g->mutex);
+        if (g->stop) break;
+        size_t end = (g->start + g->len) % U_GZIP_BUFFER_SIZE;
+        size_t count = U_GZIP_BUFFER_SIZE - g->len;
+        if (count > U_GZIP_BUFFER_SIZE - end) count = U_GZIP_BUFFER_SIZE - end;
+        if (count > n) count = n;
+        memcpy(&g->buffer[end], data, count);
+        g->len += count;
+        data += count;
+        n -= count;
+        pthread_cond_signal(&g->readable);
+    }
+    int stop = g->stop;
+    pthread_mutex_unlock(&g->mutex);
+    return stop;
+}
+
+static void* gzip_inflate_thread(void* arg) {
+    struct u_gzip_inflater* g = arg;
+    int err = U_ERROR_SUCCESS, ret = Z_OK;
+    for (;;) {
+        if (g->z.avail_in == 0) {
+            size_t n = fread(g->in, 1, sizeof(g->in), g->fp);
+            if (n == 0) {
+                if (ferror(g->fp))
+                    err = U_ERROR_ACCESS;
+                else if (ret != Z_STREAM_END)
+                    err = U_ERROR_FORMAT; /* The file ended in the middle of the compressed data */
+                break;
+            }
+            g->z.next_in = g->in;
+            g->z.avail_in = n;
+        }
+        if (ret == Z_STREAM_END && inflateReset(&g->z) != Z_OK) { /* Another gzip member follows */
+            err = U_ERROR_FORMAT;
+            break;
+        }
+        g->z.next_out = g->out;
+        g->z.avail_out = sizeof(g->out);
+        ret = inflate(&g->z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            err = ret == Z_MEM_ERROR ? U_ERROR_NOMEM : U_ERROR_FORMAT;
+            break;
+        }
+        if (gzip_put(g, g->out, sizeof(g->out) - g->z.avail_out))
+            break;
+    }
+    pthread_mutex_lock(&g->mutex);
+    g->done = 1;
+    g->err = err;
+    pthread_cond_signal(&g->readable);
+    pthread_mutex_unlock(&g->mutex);
+    return NULL;
+}
+
+int u_gzip_reader_open(u_gzip_reader_t* reader, FILE* fp) {
+    reader->fp = fp;
+    reader->inflater = NULL;
+    reader->npeek = fread(reader->peek, 1, sizeof(reader->peek), fp);
+    if (reader->npeek < 2 || reader->peek[0] != 0x1f || reader->peek[1] != 0x8b)
+        return U_ERROR_SUCCESS; /* Not gzipped */
+
+    struct u_gzip_inflater* g = malloc(sizeof(*g));
+    if (!g)
+        return u_error_nomem();
+    g->buffer = malloc(U_GZIP_BUFFER_SIZE);
+    if (!g->buffer) {
+        free(g);
+        return u_error_nomem();
+    }
+    memset(&g->z, 0, sizeof(g->z));
+    memcpy(g->in, reader->peek, reader->npeek);
+    g->z.next_in = g->in;
+    g->z.avail_in = reader->npeek;
+    if (inflateInit2(&g->z, GZIP_WINDOW_BITS) != Z_OK) {
+        free(g->buffer);
+        free(g);
+        return u_error_set(U_ERROR_OTHER, "Failed to start decompressing file.");
+    }
+    reader->npeek = 0;
+    g->start = g->len = 0;
+    g->done = g->stop = 0;
+    g->err = U_ERROR_SUCCESS;
+    g->fp = fp;
+    pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init(&g->readable, NULL);
+    pthread_cond_init(&g->writable, NULL);
+    if (pthread_create(&g->thread, NULL, gzip_inflate_thread, g)) {
+        pthread_cond_destroy(&g->writable);
+        pthread_cond_destroy(&g->readable);
+        pthread_mutex_destroy(&g->mutex);
+        inflateEnd(&g->z);
+        free(g->buffer);
+        free(g);
+        return u_error_set(U_ERROR_SYSTEM, "Failed to start decompression thread.");
+    }
+    reader->inflater = g;
+    return U_ERROR_SUCCESS;
+}
+
+int u_gzip_reader_compressed(const u_gzip_reader_t* reader) {
+    return reader->inflater != NULL;
+}
+
+size_t u_gzip_read(u_gzip_reader_t* reader, void* ptr, size_t size, size_t n) {
+    unsigned char* out = ptr;
+    size_t want = size * n, got = 0;
+    struct u_gzip_inflater* g = reader->inflater;
+    if (!size) return 0;
+    if (!g) {
+        /* Not gzipped, so just read it (after the bytes which were peeked at) */
+        size_t from_peek = reader->npeek < want ? reader->npeek : want;
+        memcpy(out, reader->peek, from_peek);
+        reader->npeek -= from_peek;
+        memmove(reader->peek, reader->peek + from_peek, reader->npeek);
+        got = from_peek + fread(out + from_peek, 1, want - from_peek, reader->fp);
+        return got / size;
+    }
+    pthread_mutex_lock(&g->mutex);
+    while (got < want) {
+        while (!g->len && !g->done)
+            pthread_cond_wait(&g->readable, &g->mutex);
+        if (!g->len) break; /* The end */
+        size_t count = g->len;
+        if (count > U_GZIP_BUFFER_SIZE - g->start) count = U_GZIP_BUFFER_SIZE - g->start;
+        if (count > want - got) count = want - got;
+        memcpy(out + got, &g->buffer[g->start], count);
+        g->start = (g->start + count) % U_GZIP_BUFFER_SIZE;
+        g->len -= count;
+        got += count;
+        pthread_cond_signal(&g->writable);
+    }
+    pthread_mutex_unlock(&g->mutex);
+    return got / size;
+}
+
+int u_gzip_reader_error(u_gzip_reader_t* reader) {
+    struct u_gzip_inflater* g = reader->inflater;
+    int err;
+    if (!g)
+        return ferror(reader->fp) ? u_error_set(U_ERROR_ACCESS, "Failed to read file.") : U_ERROR_SUCCESS;
+    pthread_mutex_lock(&g->mutex);
+    err = g->err;
+    pthread_mutex_unlock(&g->mutex);
+    switch (err) {
+    case U_ERROR_SUCCESS: return U_ERROR_SUCCESS;
+    case U_ERROR_NOMEM: return u_error_nomem();
+    case U_ERROR_ACCESS: return u_error_set(U_ERROR_ACCESS, "Failed to read file.");
+    default: return u_error_set(err, "Invalid or incomplete gzip data.");
+    }
+}
+
+void u_gzip_reader_close(u_gzip_reader_t* reader) {
+    struct u_gzip_inflater* g = reader->inflater;
+    if (!g) return;
+    pthread_mutex_lock(&g->mutex);
+    g->stop = 1;
+    pthread_cond_signal(&g->writable);
+    pthread_mutex_unlock(&g->mutex);
+    pthread_join(g->thread, NULL);
+    pthread_cond_destroy(&g->writable);
+    pthread_cond_destroy(&g->readable);
+    pthread_mutex_destroy(&g->mutex);
+    inflateEnd(&g->z);
+    free(g->buffer);
+    free(g);
+    reader->inflater = NULL;
+}
+
+int u_gzip_writer_open(u_gzip_writer_t* writer, FILE* fp, int level) {
+    writer->fp = fp;
+    writer->deflater = NULL;
+    if (level <= 0)
+        return U_ERROR_SUCCESS;
+    if (level > 9)
+        return u_error_set(U_ERROR_ARGUMENT, "The gzip compression level must be from 0 to 9.");
+    struct u_gzip_deflater* d = malloc(sizeof(*d));
+    if (!d)
+        return u_error_nomem();
+    memset(&d->z, 0, sizeof(d->z));
+    if (deflateInit2(&d->z, level, Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(d);
+        return u_error_set(U_ERROR_OTHER, "Failed to start compressing file.");
+    }
+    writer->deflater = d;
+    return U_ERROR_SUCCESS;
+}
+
+static int gzip_deflate(u_gzip_writer_t* writer, const void* ptr, size_t n, int flush) {
+    /* Compresses n bytes (with the given zlib flush mode), and writes out whatever comes out */
+    struct u_gzip_deflater* d = writer->deflater;
+    int ret;
+    d->z.next_in = (unsigned char*)ptr; /* (not modified) */
+    d->z.avail_in = n;
+    do {
+        d->z.next_out = d->out;
+        d->z.avail_out = sizeof(d->out);
+        ret = deflate(&d->z, flush);
+        if (ret == Z_STREAM_ERROR)
+            return u_error_set(U_ERROR_OTHER, "Failed to compress file.");
+        size_t nout = sizeof(d->out) - d->z.avail_out;
+        if (fwrite(d->out, 1, nout, writer->fp) != nout)
+            return u_error_set(U_ERROR_ACCESS, "File write failed.");
+    } while (d->z.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    return U_ERROR_SUCCESS;
+}
+
+int u_gzip_write(u_gzip_writer_t* writer, const void* ptr, size_t n) {
+    const unsigned char* p = ptr;
+    if (!writer->deflater) {
+        if (fwrite(ptr, 1, n, writer->fp) != n)
+            return u_error_set(U_ERROR_ACCESS, "File write failed.");
+        return U_ERROR_SUCCESS;
+    }
+    while (n) {
+        /* (avail_in is an unsigned int) */
+        size_t count = n < ((size_t)1 << 30) ? n : ((size_t)1 << 30);
+        int err = gzip_deflate(writer, p, count, Z_NO_FLUSH);
+        if (err) return err;
+        p += count;
+        n -= count;
+    }
+    return U_ERROR_SUCCESS;
+}
+
+int u_gzip_writer_close(u_gzip_writer_t* writer) {
+    struct u_gzip_deflater* d = writer->deflater;
+    int err = U_ERROR_SUCCESS;
+    if (!d) return U_ERROR_SUCCESS;
+    err = gzip_deflate(writer, NULL, 0, Z_FINISH);
+    deflateEnd(&d->z);
+    free(d);
+    writer->deflater = NULL;
+    return err;
+}
@@ -0,0 +1,81 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file gzip.h
+\brief Transparently gzipped files
+
+Reading files which may or may not be gzipped, and writing files which may or may
+not be gzipped, with zlib. A \ref u_gzip_reader_t checks for the gzip magic bytes
+(`1f 8b`); if they're there, the file is decompressed on a separate thread, into a
+buffer of at most \ref U_GZIP_BUFFER_SIZE bytes which \ref u_gzip_read takes the
+data out of, so decompression happens at the same time as whatever is done with
+the data. Otherwise, the file is just read as it is. Files made of several gzip
+members (e.g. from `cat a.gz b.gz`) are read as one.
+
+Bare zlib streams (without a gzip header) aren't detected, since their two-byte
+header could also be the start of an uncompressed file.
+*/
+#ifndef CUTILS_FILETYPES_GZIP_H
+#define CUTILS_FILETYPES_GZIP_H
+
+#include <stdio.h>
+
+#define U_GZIP_BUFFER_SIZE ((size_t)1 << 22) /**< The most decompressed data waiting to be read */
+#define U_GZIP_CHUNK_SIZE ((size_t)1 << 16) /**< How much of the file is read or written at a time */
+
+struct u_gzip_inflater;
+struct u_gzip_deflater;
+
+/** A file being read, which is decompressed if it's gzipped. */
+typedef struct {
+    FILE* fp; /**< The file */
+    unsigned char peek[2]; /**< The first bytes of the file (which have been read, to check if it's gzipped) */
+    size_t npeek; /**< The number of bytes in peek which haven't been read by \ref u_gzip_read yet */
+    struct u_gzip_inflater* inflater; /**< The decompression thread and its buffer (NULL if the file isn't gzipped) */
+} u_gzip_reader_t;
+
+/** A file being written, which may be gzipped. */
+typedef struct {
+    FILE* fp; /**< The file */
+    struct u_gzip_deflater* deflater; /**< The compression state (NULL if the file isn't being compressed) */
+} u_gzip_writer_t;
+
+/** Sets up \p reader to read \p fp (which should be at the start of the file), starting a
+    decompression thread if it's gzipped. \returns An error code. */
+int    u_gzip_reader_open(u_gzip_reader_t* reader, FILE* fp);
+/** \returns Whether the file being read is gzipped. */
+int    u_gzip_reader_compressed(const u_gzip_reader_t* reader);
+/** Reads (up to) \p n elements of \p size bytes each into \p ptr, like `fread`. Waits for them
+    to be decompressed if necessary. \returns The number of elements read. */
+size_t u_gzip_read(u_gzip_reader_t* reader, void* ptr, size_t size, size_t n);
+/** If reading has failed (because the file couldn't be read, or the compressed data is invalid or
+    ends too early), sets the error message. \returns An error code (\ref U_ERROR_SUCCESS if
+    nothing has gone wrong, e.g. if \ref u_gzip_read just got to the end of the file). */
+int    u_gzip_reader_error(u_gzip_reader_t* reader);
+/** Stops the decompression thread and frees the memory used by \p reader (but doesn't close its file). */
+void   u_gzip_reader_close(u_gzip_reader_t* reader);
+
+/** Sets up \p writer to write to \p fp, compressing with the given zlib \p level (1-9), or
+    without compression if \p level is 0. \returns An error code. */
+int    u_gzip_writer_open(u_gzip_writer_t* writer, FILE* fp, int level);
+/** Writes \p n bytes from \p ptr (compressed if need be). \returns An error code. */
+int    u_gzip_write(u_gzip_writer_t* writer, const void* ptr, size_t n);
+/** Finishes the compressed data and frees the memory used by \p writer (but doesn't close its
+    file). \returns An error code. */
+int    u_gzip_writer_close(u_gzip_writer_t* writer);
+
+#endif /* CUTILS_FILETYPES_GZIP_H */
@@ -19,20 +19,92 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <png.h>
+#include <zlib.h>
 
 #include "../misc/error.h"
+#include "../misc/threads.h"
+#include "pnm.h"
+#include "qoi.h"
 
 struct u_image {
-    u_color_t** pixels;
-    png_infop info;
+    u_color_t* data; /* All of the pixels, one row after another. Aligned to U_IMAGE_ALIGNMENT bytes. */
+    void* data_alloc; /* What was actually malloc'd for data */
+    u_color_t** pixels; /* Pointers to the start of each row in data */
+    size_t stride; /* Pixels from the start of one row to the start of the next */
+    int width;
+    int height;
+};
+
+struct u_image_reader {
+    u_image_format_t format;
     png_structp png;
+    png_infop info;
+    u_pnm_t pnm;
+    u_qoi_t qoi;
+    FILE* fp;
     int width;
     int height;
-    png_byte color_type;
-    u_bool_t read; /* was png created with png_create_read_struct or png_create_write_struct? = U_FALSE for write, U_TRUE for read */
 };
 
+typedef struct {
+    /* A block of rows which one thread filters and deflates */
+    const u_u8_t* rows; /* The first row (the rest follow it) */
+    const u_u8_t* prev; /* The row before the block, or NULL at the top of the image */
+    int nrows;
+    u_bool_t last; /* Is this the end of the image? */
+    u_u8_t* filtered; /* The filtered rows (each with its filter type byte) */
+    size_t filtered_capacity;
+    u_u8_t* scratch; /* One row, for trying out filters */
+    u_u8_t* out; /* The deflated data */
+    size_t out_capacity;
+    size_t out_len;
+    uLong adler; /* The Adler-32 of filtered */
+} image_block_t;
+
+struct u_image_writer {
+    u_image_format_t format;
+    png_structp png;
+    png_infop info;
+    u_pnm_t pnm;
+    u_qoi_t qoi;
+    FILE* fp;
+    u_bool_t indexed; /* Are the rows palette indices (rather than RGBA)? */
+    u_color_t palette[U_IMAGE_MAX_PALETTE]; /* For turning indices back into colors, for formats without palettes */
+    u_color_t* expanded; /* A row of indices turned back into colors */
+    int width;
+    int bit_depth;
+    size_t row_bytes; /* The size of a (packed) row in the file */
+    size_t bpp; /* Bytes per pixel, rounded up to 1 (for filtering) */
+    int filters; /* Bit i is set if filter type i can be used (IMAGE_FILTER_*) */
+    int level; /* zlib compression level */
+    int strategy; /* zlib compression strategy */
+    u_u8_t* raw; /* The last row of the previous batch, then the pending rows */
+    u_u8_t* zeros; /* A row of zeros (the "row above" the first row) */
+    int block_rows; /* The number of rows in a block */
+    int nblocks; /* The number of blocks in a batch */
+    int nrows_pending; /* The number of rows in raw waiting to be compressed */
+    int nrows_written; /* The number of rows which have already been compressed */
+    image_block_t* blocks;
+    uLong adler; /* The Adler-32 of all of the filtered data so far */
+};
+
+#define U_IMAGE_ALIGNMENT 64
+#define U_IMAGE_BLOCK_BYTES (256 * 1024) /* About how much raw image data each thread deflates at a time */
+
+#define IMAGE_FILTER_NONE  0x01
+#define IMAGE_FILTER_SUB   0x02
+#define IMAGE_FILTER_UP    0x04
+#define IMAGE_FILTER_AVG   0x08
+#define IMAGE_FILTER_PAETH 0x10
+#define IMAGE_FILTER_ALL   0x1F
+
+static u_image_png_speed_t image_png_speed = U_IMAGE_PNG_DEFAULT;
+
+/* libpng reads and writes straight from the pixel buffer, so a u_color_t has to be 4 bytes of RGBA. */
+typedef char u_image_color_is_rgba[sizeof(u_color_t) == 4 ? 1 : -1];
+
 #if defined(_WIN32) || defined(__MINGW32__)
 #define WINDOWS /* Using an older version of libpng on windows, so it doesn't have png_jmpbuf. */
 #endif
@@ -41,6 +113,106 @@ void user_error_fn(png_structp png_ptr, png_const_charp error_msg) {
     printf("%s\n",error_msg);
 }
 
+static int image_pixels_alloc(u_image_t* image) {
+    /* Allocates image->data and image->pixels for image->width and image->height. Returns an error code. */
+    image->stride = image->width;
+    image->pixels = malloc(image->height * sizeof(*image->pixels));
+    image->data_alloc = malloc((size_t)image->height * image->stride * sizeof(*image->data) + U_IMAGE_ALIGNMENT);
+    if (!image->pixels || !image->data_alloc) {
+        free(image->pixels);
+        free(image->data_alloc);
+        image->pixels = NULL;
+        image->data_alloc = NULL;
+        return u_error_nomem();
+    }
+    size_t misalignment = (size_t)image->data_alloc % U_IMAGE_ALIGNMENT;
+    image->data = (u_color_t*)((char*)image->data_alloc + (U_IMAGE_ALIGNMENT - misalignment));
+    int y;
+    for (y = 0; y < image->height; y++)
+        image->pixels[y] = &image->data[y * image->stride];
+    return U_ERROR_SUCCESS;
+}
+
+static int image_read_transforms_set(png_structp png, png_infop info) {
+    /* Has libpng turn whatever is in the file into 8-bit RGBA.
+    Returns the number of passes needed to read the image (1 unless it's interlaced). */
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte bit_depth = png_get_bit_depth(png, info);
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png);
+    if (bit_depth == 16)
+        png_set_strip_16(png);
+    png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+    int passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    return passes;
+}
+
+static void image_pixels_free(u_image_t* image) {
+    free(image->pixels);
+    free(image->data_alloc);
+}
+
+static u_image_t* image_read_rows(const char* filename) {
+    /* Reads an image with a u_image_reader */
+    u_image_reader_t* reader = u_image_reader_open(filename);
+    if (!reader)
+        return NULL;
+    u_image_t* image = u_image_new(reader->width, reader->height, u_color_from_rgba(0, 0, 0, 0));
+    if (!image) {
+        u_image_reader_close(reader);
+        return NULL;
+    }
+    int err = u_image_reader_rows_read(reader, image->pixels, image->height);
+    u_image_reader_close(reader);
+    if (err) {
+        u_image_free(image);
+        return NULL;
+    }
+    return image;
+}
+
+u_image_format_t u_image_format_from_filename(const char* filename) {
+    const char* extension = strrchr(filename, '.');
+    if (extension) {
+        if (!strcmp(extension, ".ppm") || !strcmp(extension, ".pnm"))
+            return U_IMAGE_PPM;
+        if (!strcmp(extension, ".pgm"))
+            return U_IMAGE_PGM;
+        if (!strcmp(extension, ".pam"))
+            return U_IMAGE_PAM;
+        if (!strcmp(extension, ".qoi"))
+            return U_IMAGE_QOI;
+    }
+    return U_IMAGE_PNG;
+}
+
+static int image_format_detect(FILE* fp, u_image_format_t* format) {
+    /* Figures out the format of an image from its first few bytes, then goes back to the start of the file */
+    unsigned char header[8];
+    size_t n = fread(header, 1, sizeof(header), fp);
+    if (fseek(fp, 0, SEEK_SET))
+        return u_error_set(U_ERROR_ACCESS, "Failed to read image.");
+    if (n == 8 && !png_sig_cmp(header, 0, 8)) {
+        *format = U_IMAGE_PNG;
+    } else if (n >= 4 && !memcmp(header, "qoif", 4)) {
+        *format = U_IMAGE_QOI;
+    } else if (n >= 3 && header[0] == 'P' && header[1] == '7' && header[2] == '\n') {
+        *format = U_IMAGE_PAM;
+    } else if (n >= 3 && header[0] == 'P' && (header[1] == '5' || header[1] == '6') && isspace(header[2])) {
+        *format = U_IMAGE_PPM;
+    } else {
+        return u_error_set(U_ERROR_FORMAT, "Failed to open image: Must be a PNG, PPM, PAM or QOI file.");
+    }
+    return U_ERROR_SUCCESS;
+}
+
 u_image_t* u_image_read(const char* filename) {
     u_image_t* image = malloc(sizeof(*image));
     if (!image) {
@@ -49,37 +221,34 @@ u_image_t* u_image_read(const char* filename) {
     }
     FILE* fp = fopen(filename, "rb");
     if (!fp) {
+        free(image);
         u_error_set(U_ERROR_ACCESS, "Image file not found.");
         return NULL;
     }
     unsigned char header[8];
-    fread(header, 1, 8, fp);
-    if (png_sig_cmp(header, 0, 8)) { /* Check header */
+    if (fread(header, 1, 8, fp) != 8 || png_sig_cmp(header, 0, 8)) { /* Check header */
         free(image);
         fclose(fp);
-        u_error_set(U_ERROR_FORMAT, "Failed to open image: Must be a PNG file.");
-        return NULL;
+        return image_read_rows(filename); /* Not a PNG; maybe one of the other formats */
     }
 
-    image->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, user_error_fn, NULL);
-    image->read = U_TRUE;
-    if (!image->png) {
+    /* (libpng is only needed while reading, so it's cleaned up straight away) */
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, user_error_fn, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    image->pixels = NULL;
+    image->data_alloc = NULL;
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
         free(image);
         fclose(fp);
         u_error_set(U_ERROR_OTHER, "Failed to create PNG struct.");
         return NULL;
     }
 
-    image->info = png_create_info_struct(image->png);
-    if (!image->info) {
-        free(image);
-        fclose(fp);
-        u_error_set(U_ERROR_OTHER, "Failed to create PNG info struct.");
-        return NULL;
-    }
-
     #ifndef WINDOWS
-    if (setjmp(png_jmpbuf(image->png))) {
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        image_pixels_free(image);
         free(image);
         fclose(fp);
         u_error_set(U_ERROR_OTHER, "Failed to read image.");
@@ -87,96 +256,24 @@ u_image_t* u_image_read(const char* filename) {
     }
     #endif
 
-    png_init_io(image->png, fp);
-    png_set_sig_bytes(image->png, 8);
-    png_read_info(image->png, image->info);
+    png_init_io(png, fp);
+    png_set_sig_bytes(png, 8);
+    png_read_info(png, info);
 
-    image->width = png_get_image_width(image->png, image->info);
-    image->height = png_get_image_height(image->png, image->info);
-    image->color_type = png_get_color_type(image->png, image->info);
-    png_byte bit_depth = png_get_bit_depth(image->png, image->info);
-    if (bit_depth != 8) {
-        free(image);
-        fclose(fp);
-        u_error_set(U_ERROR_FORMAT, "Invalid image bit depth. Must be an 8-bit RGB/RGBA PNG.");
-        return NULL;
-    }
-
-    #ifndef WINDOWS
-    if (setjmp(png_jmpbuf(image->png))) {
-        free(image);
-        fclose(fp);
-        u_error_set(U_ERROR_OTHER, "Failed to read image.");
-        return NULL;
-    }
-    #endif
+    image->width = png_get_image_width(png, info);
+    image->height = png_get_image_height(png, info);
+    image_read_transforms_set(png, info);
 
-    png_bytepp rows;
-    rows = malloc(image->height * sizeof(*rows));
-    image->pixels = malloc(image->height * sizeof(*image->pixels));
-    if (!rows || !image->pixels) {
-        free(image);
-        fclose(fp);
-        u_error_nomem();
-        return NULL;
-    }
-    int i;
-    for (i = 0; i < image->height; i++) {
-        rows[i] = malloc(png_get_rowbytes(image->png, image->info));
-        image->pixels[i] = malloc(image->width * sizeof(*image->pixels[i]));
-        if (!rows[i] || !image->pixels[i]) {
-            int j;
-            for (j = 0; j < i; j++) {
-                free(rows[j]);
-                free(image->pixels[j]);
-            }
-            free(image->pixels);
-            free(rows);
-            free(image);
-            fclose(fp);
-            u_error_nomem();
-            return NULL;
-        }
-    }
-    png_read_image(image->png, rows);
-    int has_alpha = 0;
-    switch (png_get_color_type(image->png, image->info)) {
-    case PNG_COLOR_TYPE_RGB:
-        has_alpha = 0;
-        break;
-    case PNG_COLOR_TYPE_RGBA:
-        has_alpha = 1;
-        break;
-    default:
-        for (i = 0; i < image->height; i++) {
-            free(rows[i]);
-            free(image->pixels[i]);
-        }
-        free(image->pixels);
-        free(rows);
+    if (image_pixels_alloc(image)) {
+        png_destroy_read_struct(&png, &info, NULL);
         free(image);
         fclose(fp);
-        u_error_set(U_ERROR_FORMAT, "Invalid PNG color type (must be RGB or RGBA).");
         return NULL;
     }
-    int x, y;
-    for (y = 0; y < image->height; y++) {
-        png_bytep row = rows[y];
-        for (x = 0; x < image->width; x++) {
-            if (has_alpha) {
-                image->pixels[y][x]
-                    = u_color_from_rgba(row[4*x], row[4*x+1], row[4*x+2],
-                                        row[4*x+3]);
-            } else {
-                image->pixels[y][x]
-                    = u_color_from_rgb(row[3*x], row[3*x+1], row[3*x+2]);
-            }
-        }
-    }
+    /* Read the rows straight into the pixel buffer */
+    png_read_image(png, (png_bytepp)image->pixels);
+    png_destroy_read_struct(&png, &info, NULL);
 
-    for (i = 0; i < image->height; i++)
-        free(rows[i]);
-    free(rows);
     fclose(fp);
     return image;
 }
@@ -187,181 +284,642 @@ u_image_t* u_image_new(int width, int height, u_color_t color) {
         u_error_nomem();
         return NULL;
     }
-    image->color_type = PNG_COLOR_TYPE_RGBA;
     image->width = width;
     image->height = height;
-    image->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-    if (!image->png) {
+    if (image_pixels_alloc(image)) {
         free(image);
-        u_error_set(U_ERROR_OTHER, "Failed to create PNG struct.");
         return NULL;
     }
+    size_t i, npixels = (size_t)height * image->stride;
+    for (i = 0; i < npixels; i++)
+        image->data[i] = color;
+    return image;
+}
 
-    image->info = png_create_info_struct(image->png);
-    if (!image->info) {
-        free(image);
-        u_error_set(U_ERROR_OTHER, "Failed to create PNG info struct.");
-        return NULL;
+int u_image_write(const char* filename, u_image_t* image) {
+    u_image_writer_t* writer = u_image_writer_open(filename, image->width, image->height);
+    if (!writer)
+        return u_error_code;
+    int err = u_image_writer_rows_write(writer, image->pixels, image->height);
+    int close_err = u_image_writer_close(writer);
+    return err ? err : close_err;
+}
+
+int u_image_width_get(const u_image_t* image) {
+    return image->width;
+}
+
+int u_image_height_get(const u_image_t* image) {
+    return image->height;
+}
+
+u_color_t u_image_pixel_get(const u_image_t* image, int x, int y) {
+    return image->data[y * image->stride + x];
+}
+
+void u_image_pixel_set(u_image_t* image, int x, int y, u_color_t color) {
+    image->data[y * image->stride + x] = color;
+}
+
+u_color_t** u_image_pixels_get(u_image_t* image) {
+    return image->pixels;
+}
+
+u_color_t* u_image_data_get(u_image_t* image, size_t* stride) {
+    if (stride)
+        *stride = image->stride;
+    return image->data;
+}
+
+void u_image_free(u_image_t* image) {
+    image_pixels_free(image);
+    free(image);
+}
+
+static int image_palette_bit_depth(size_t npalette) {
+    /* The smallest bit depth which can hold npalette different indices */
+    if (npalette <= 2) return 1;
+    if (npalette <= 4) return 2;
+    if (npalette <= 16) return 4;
+    return 8;
+}
+
+static u_u8_t* image_writer_row(u_image_writer_t* writer, int i) {
+    /* Row i of the raw buffer (row 0 is the last row of the previous batch) */
+    return &writer->raw[i * writer->row_bytes];
+}
+
+static void image_filter_apply(int type, const u_u8_t* row, const u_u8_t* prev, size_t n, size_t bpp, u_u8_t* out) {
+    /* Applies PNG filter type (0-4) to row (prev is the row above) */
+    size_t i;
+    switch (type) {
+    case 0:
+        memcpy(out, row, n);
+        break;
+    case 1:
+        for (i = 0; i < bpp; i++) out[i] = row[i];
+        for (; i < n; i++) out[i] = row[i] - row[i-bpp];
+        break;
+    case 2:
+        for (i = 0; i < n; i++) out[i] = row[i] - prev[i];
+        break;
+    case 3:
+        for (i = 0; i < bpp; i++) out[i] = row[i] - (prev[i] >> 1);
+        for (; i < n; i++) out[i] = row[i] - ((row[i-bpp] + prev[i]) >> 1);
+        break;
+    case 4:
+        for (i = 0; i < bpp; i++) out[i] = row[i] - prev[i];
+        for (; i < n; i++) {
+            int a = row[i-bpp], b = prev[i], c = prev[i-bpp];
+            int p = a + b - c;
+            int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+            out[i] = row[i] - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+        }
+        break;
     }
-    #ifndef WINDOWS
-    if (setjmp(png_jmpbuf(image->png))) {
-        free(image);
-        u_error_set(U_ERROR_OTHER, "Failed to create PNG info struct.");
-        return NULL;
+}
+
+static void image_filter_row(const u_image_writer_t* writer, const u_u8_t* row, const u_u8_t* prev, u_u8_t* scratch, u_u8_t* out) {
+    /* Writes the filter type and the filtered row to out. If more than one filter can be used, this
+       picks the one with the smallest sum of absolute differences (like libpng does). */
+    size_t n = writer->row_bytes, i;
+    int type;
+    if (!prev) prev = writer->zeros;
+    if (!(writer->filters & (writer->filters - 1))) {
+        /* Only one filter */
+        for (type = 0; !(writer->filters & (1 << type)); type++);
+        out[0] = type;
+        image_filter_apply(type, row, prev, n, writer->bpp, out + 1);
+        return;
     }
-    #endif
-    image->read = U_FALSE;
-    image->pixels = malloc(height * sizeof(*image->pixels));
-    if (!image->pixels) {
-        png_destroy_write_struct(&image->png, &image->info);
-        free(image);
+    unsigned long best_sum = (unsigned long)-1;
+    for (type = 0; type < 5; type++) {
+        unsigned long sum = 0;
+        if (!(writer->filters & (1 << type))) continue;
+        image_filter_apply(type, row, prev, n, writer->bpp, scratch);
+        for (i = 0; i < n; i++)
+            sum += scratch[i] < 128 ? scratch[i] : 256 - scratch[i];
+        if (sum < best_sum) {
+            best_sum = sum;
+            out[0] = type;
+            memcpy(out + 1, scratch, n);
+        }
     }
-    int i;
-    for (i = 0; i < height; i++) {
-        image->pixels[i] = malloc(width * sizeof(*image->pixels[i]));
-        int j;
-        if (!image->pixels[i]) {
-            for (j = 0; j < i; j++)
-                free(image->pixels[j]);
-            free(image->pixels);
-            free(image);
-            u_error_nomem();
-            return NULL;
+}
+
+static int image_block_compress(const u_image_writer_t* writer, image_block_t* block) {
+    /* Filters and deflates one block of rows, as a raw deflate stream ending in a full
+       flush (or the end of the stream, for the last block), so that blocks can be
+       concatenated. */
+    size_t line = writer->row_bytes + 1, nfiltered = block->nrows * line;
+    if (block->filtered_capacity < nfiltered) {
+        u_u8_t* filtered = realloc(block->filtered, nfiltered);
+        u_u8_t* scratch = realloc(block->scratch, writer->row_bytes);
+        if (filtered) block->filtered = filtered;
+        if (scratch) block->scratch = scratch;
+        if (!filtered || !scratch)
+            return u_error_nomem();
+        block->filtered_capacity = nfiltered;
+    }
+    int y;
+    for (y = 0; y < block->nrows; y++) {
+        const u_u8_t* row = &block->rows[y * writer->row_bytes];
+        const u_u8_t* prev = y ? row - writer->row_bytes : block->prev;
+        image_filter_row(writer, row, prev, block->scratch, &block->filtered[y * line]);
+    }
+    block->adler = adler32(adler32(0L, Z_NULL, 0), block->filtered, nfiltered);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, writer->level, Z_DEFLATED, -15 /* raw, 32K window */, 8, writer->strategy) != Z_OK)
+        return u_error_set(U_ERROR_OTHER, "Failed to start compressing image.");
+    size_t bound = deflateBound(&stream, nfiltered) + 16;
+    if (block->out_capacity < bound) {
+        u_u8_t* out = realloc(block->out, bound);
+        if (!out) {
+            deflateEnd(&stream);
+            return u_error_nomem();
         }
-        for (j = 0; j < width; j++) {
-            image->pixels[i][j] = color;
+        block->out = out;
+        block->out_capacity = bound;
+    }
+    stream.next_in = block->filtered;
+    stream.avail_in = nfiltered;
+    stream.next_out = block->out;
+    stream.avail_out = block->out_capacity;
+    for (;;) {
+        int ret = deflate(&stream, block->last ? Z_FINISH : Z_FULL_FLUSH);
+        if (ret == Z_STREAM_ERROR) {
+            deflateEnd(&stream);
+            return u_error_set(U_ERROR_OTHER, "Failed to compress image.");
         }
+        if (block->last ? ret == Z_STREAM_END : stream.avail_in == 0 && stream.avail_out != 0)
+            break;
+        /* Ran out of room (deflateBound should stop this from happening) */
+        u_u8_t* out = realloc(block->out, 2 * block->out_capacity);
+        if (!out) {
+            deflateEnd(&stream);
+            return u_error_nomem();
+        }
+        block->out = out;
+        stream.next_out = block->out + stream.total_out;
+        stream.avail_out = 2 * block->out_capacity - stream.total_out;
+        block->out_capacity *= 2;
     }
-    return image;
+    block->out_len = stream.total_out;
+    deflateEnd(&stream);
+    return U_ERROR_SUCCESS;
 }
 
-int u_image_write(const char* filename, u_image_t* image) {
-    if (image->read) {
-        png_destroy_read_struct(&image->png, &image->info, NULL);
-        image->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+static int image_blocks_compress(void* arg, size_t from, size_t to) {
+    u_image_writer_t* writer = arg;
+    size_t b;
+    for (b = from; b < to; b++) {
+        int err = image_block_compress(writer, &writer->blocks[b]);
+        if (err) return err;
+    }
+    return U_ERROR_SUCCESS;
+}
 
-        if (!image->png) {
-            return u_error_set(U_ERROR_OTHER, "Failed to create PNG struct.");
+static int image_writer_flush(u_image_writer_t* writer, u_bool_t last) {
+    /* Compresses the pending rows (one block per thread), and writes them as IDAT chunks.
+       Must be called after setjmp. */
+    int nrows = writer->nrows_pending;
+    int nblocks = (nrows + writer->block_rows - 1) / writer->block_rows;
+    int b;
+    for (b = 0; b < nblocks; b++) {
+        image_block_t* block = &writer->blocks[b];
+        int first_row = 1 + b * writer->block_rows;
+        block->rows = image_writer_row(writer, first_row);
+        block->prev = writer->nrows_written || b ? image_writer_row(writer, first_row - 1) : NULL;
+        block->nrows = b == nblocks - 1 ? nrows - b * writer->block_rows : writer->block_rows;
+        block->last = last && b == nblocks - 1;
+    }
+    int err = u_threads_for(nblocks, 1, image_blocks_compress, writer);
+    if (err) return err;
+
+    for (b = 0; b < nblocks; b++) {
+        image_block_t* block = &writer->blocks[b];
+        png_byte header[2], adler[4];
+        png_uint_32 length = block->out_len;
+        u_bool_t first = !writer->nrows_written && b == 0;
+        if (first) length += sizeof(header);
+        if (block->last) length += sizeof(adler);
+        png_write_chunk_start(writer->png, (png_const_bytep)"IDAT", length);
+        if (first) {
+            /* The zlib header: a deflate stream with a 32K window */
+            header[0] = 0x78;
+            header[1] = (writer->level <= 1 ? 0 : writer->level <= 5 ? 1 : writer->level == 6 ? 2 : 3) << 6;
+            header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+            png_write_chunk_data(writer->png, header, sizeof(header));
+            writer->adler = adler32(0L, Z_NULL, 0);
         }
-
-        image->info = png_create_info_struct(image->png);
-        if (!image->info) {
-            return u_error_set(U_ERROR_OTHER, "Failed to create PNG info struct.");
+        png_write_chunk_data(writer->png, block->out, block->out_len);
+        writer->adler = adler32_combine(writer->adler, block->adler, block->nrows * (writer->row_bytes + 1));
+        if (block->last) {
+            adler[0] = (writer->adler >> 24) & 0xFF;
+            adler[1] = (writer->adler >> 16) & 0xFF;
+            adler[2] = (writer->adler >> 8) & 0xFF;
+            adler[3] = writer->adler & 0xFF;
+            png_write_chunk_data(writer->png, adler, sizeof(adler));
         }
-        #ifndef WINDOWS
-        if (setjmp(png_jmpbuf(image->png))) {
-            return u_error_set(U_ERROR_OTHER, "Failed to create PNG info struct.");
+        png_write_chunk_end(writer->png);
+    }
+    /* The last row is needed to filter the first row of the next batch */
+    memcpy(image_writer_row(writer, 0), image_writer_row(writer, nrows), writer->row_bytes);
+    writer->nrows_written += nrows;
+    writer->nrows_pending = 0;
+    return U_ERROR_SUCCESS;
+}
+
+static u_u8_t* image_writer_row_next(u_image_writer_t* writer, int* err) {
+    /* Where the next row should be put. Compresses the pending rows first if there's
+       no room (not before, so that the last batch is never empty). Must be called after setjmp. */
+    if (writer->nrows_pending == writer->block_rows * writer->nblocks) {
+        *err = image_writer_flush(writer, U_FALSE);
+        if (*err) return NULL;
+    }
+    return image_writer_row(writer, 1 + writer->nrows_pending++);
+}
+
+static void image_writer_free(u_image_writer_t* writer) {
+    int b;
+    if (writer->blocks) {
+        for (b = 0; b < writer->nblocks; b++) {
+            free(writer->blocks[b].filtered);
+            free(writer->blocks[b].scratch);
+            free(writer->blocks[b].out);
         }
-        #endif
-        image->read = U_FALSE;
+    }
+    free(writer->blocks);
+    free(writer->raw);
+    free(writer->zeros);
+    free(writer->expanded);
+    free(writer);
+}
 
+static u_image_writer_t* image_writer_open_other(const char* filename, u_image_format_t format, int width, int height, const u_color_t* palette, size_t npalette) {
+    /* Opens a writer for a format other than PNG. Palettes are just used to turn indices into colors. */
+    u_image_writer_t* writer = calloc(1, sizeof(*writer));
+    if (!writer) {
+        u_error_nomem();
+        return NULL;
     }
+    writer->format = format;
+    writer->width = width;
+    writer->indexed = palette != NULL;
+    if (palette) {
+        memcpy(writer->palette, palette, npalette * sizeof(*palette));
+        writer->expanded = malloc(width * sizeof(*writer->expanded));
+        if (!writer->expanded) {
+            image_writer_free(writer);
+            u_error_nomem();
+            return NULL;
+        }
+    }
+    writer->fp = fopen(filename, "wb");
+    if (!writer->fp) {
+        image_writer_free(writer);
+        u_error_fopen(filename, "writing");
+        return NULL;
+    }
+    int err = format == U_IMAGE_QOI ? u_qoi_write_start(&writer->qoi, writer->fp, width, height)
+            : u_pnm_write_start(&writer->pnm, writer->fp, width, height,
+                                format == U_IMAGE_PAM ? 4 : format == U_IMAGE_PGM ? 1 : 3);
+    if (err) {
+        if (format == U_IMAGE_QOI) u_qoi_end(&writer->qoi);
+        else u_pnm_end(&writer->pnm);
+        fclose(writer->fp);
+        image_writer_free(writer);
+        return NULL;
+    }
+    return writer;
+}
 
+static int image_writer_other_rows_write(u_image_writer_t* writer, u_color_t** rows, int nrows) {
+    if (writer->format == U_IMAGE_QOI)
+        return u_qoi_rows_write(&writer->qoi, rows, nrows);
+    return u_pnm_rows_write(&writer->pnm, rows, nrows);
+}
 
-    FILE* fp = fopen(filename, "wb");
-    if (!fp)
-        return U_ERROR_ACCESS;
+void u_image_png_speed_set(u_image_png_speed_t speed) {
+    image_png_speed = speed;
+}
 
+static void image_writer_speed_apply(u_image_writer_t* writer, u_bool_t indexed) {
+    /* Picks the zlib settings and filters for the current PNG speed. Filtering rarely helps
+       palette images (their indices aren't smooth), so like libpng, they are never filtered;
+       they are mostly runs of the same index, so Z_RLE is nearly as good as a full search. */
+    switch (image_png_speed) {
+    case U_IMAGE_PNG_FAST:
+        writer->level = 1;
+        writer->strategy = indexed ? Z_RLE : Z_DEFAULT_STRATEGY;
+        writer->filters = indexed ? IMAGE_FILTER_NONE : IMAGE_FILTER_UP;
+        break;
+    case U_IMAGE_PNG_DEFAULT:
+        writer->level = 6;
+        writer->strategy = Z_DEFAULT_STRATEGY;
+        writer->filters = indexed ? IMAGE_FILTER_NONE : IMAGE_FILTER_ALL;
+        break;
+    case U_IMAGE_PNG_SMALL:
+        writer->level = 9;
+        writer->strategy = indexed ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+        writer->filters = indexed ? IMAGE_FILTER_NONE : IMAGE_FILTER_ALL;
+        break;
+    }
+}
+
+static u_image_writer_t* image_writer_open(const char* filename, int width, int height, const u_color_t* palette, size_t npalette) {
+    /* palette = NULL for an RGBA image */
+    u_image_format_t format = u_image_format_from_filename(filename);
+    if (width <= 0 || height <= 0) {
+        u_error_set(U_ERROR_ARGUMENT, "Images must be at least 1 pixel wide and 1 pixel high.");
+        return NULL;
+    }
+    if (format != U_IMAGE_PNG)
+        return image_writer_open_other(filename, format, width, height, palette, npalette);
+    u_image_writer_t* writer = calloc(1, sizeof(*writer));
+    if (!writer) {
+        u_error_nomem();
+        return NULL;
+    }
+    writer->indexed = palette != NULL;
+    writer->width = width;
+    writer->bit_depth = palette ? image_palette_bit_depth(npalette) : 8;
+    writer->row_bytes = palette ? ((size_t)width * writer->bit_depth + 7) / 8 : 4 * (size_t)width;
+    writer->bpp = palette ? 1 : 4;
+    image_writer_speed_apply(writer, palette != NULL);
+    writer->block_rows = U_IMAGE_BLOCK_BYTES / writer->row_bytes;
+    if (writer->block_rows < 1) writer->block_rows = 1;
+    writer->nblocks = 4 * u_threads_count_get();
+    if ((size_t)writer->block_rows * writer->nblocks > (size_t)height) {
+        /* Not that many rows; just split them evenly */
+        writer->block_rows = (height + writer->nblocks - 1) / writer->nblocks;
+        writer->nblocks = (height + writer->block_rows - 1) / writer->block_rows;
+    }
+    writer->raw = malloc((1 + (size_t)writer->block_rows * writer->nblocks) * writer->row_bytes);
+    writer->zeros = calloc(writer->row_bytes, 1);
+    writer->blocks = calloc(writer->nblocks, sizeof(*writer->blocks));
+    if (!writer->raw || !writer->zeros || !writer->blocks) {
+        image_writer_free(writer);
+        u_error_nomem();
+        return NULL;
+    }
 
-    png_init_io(image->png, fp);
+    writer->fp = fopen(filename, "wb");
+    if (!writer->fp) {
+        image_writer_free(writer);
+        u_error_fopen(filename, "writing");
+        return NULL;
+    }
+    writer->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    writer->info = writer->png ? png_create_info_struct(writer->png) : NULL;
+    if (!writer->info) {
+        png_destroy_write_struct(&writer->png, NULL);
+        fclose(writer->fp);
+        image_writer_free(writer);
+        u_error_set(U_ERROR_OTHER, "Failed to create PNG struct.");
+        return NULL;
+    }
     #ifndef WINDOWS
-    if (setjmp(png_jmpbuf(image->png))) {
-        fclose(fp);
-        return u_error_set(U_ERROR_OTHER, "Failed to write image to file.");
+    if (setjmp(png_jmpbuf(writer->png))) {
+        png_destroy_write_struct(&writer->png, &writer->info);
+        fclose(writer->fp);
+        image_writer_free(writer);
+        u_error_set(U_ERROR_OTHER, "Failed to write image to file.");
+        return NULL;
     }
     #endif
-    png_set_IHDR(image->png, image->info, image->width, image->height,
-                 8 /* Bit depth */, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-    png_write_info(image->png, image->info);
+    png_init_io(writer->png, writer->fp);
+    if (palette) {
+        png_color colors[U_IMAGE_MAX_PALETTE];
+        png_byte alphas[U_IMAGE_MAX_PALETTE];
+        int i, nalphas = 0;
+        for (i = 0; i < (int)npalette; i++) {
+            colors[i].red = palette[i].r;
+            colors[i].green = palette[i].g;
+            colors[i].blue = palette[i].b;
+            alphas[i] = palette[i].a;
+            if (palette[i].a != 255)
+                nalphas = i + 1; /* tRNS only needs to go up to the last transparent entry */
+        }
+        png_set_IHDR(writer->png, writer->info, width, height,
+                     writer->bit_depth, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+        png_set_PLTE(writer->png, writer->info, colors, npalette);
+        if (nalphas)
+            png_set_tRNS(writer->png, writer->info, alphas, nalphas, NULL);
+    } else {
+        png_set_IHDR(writer->png, writer->info, width, height,
+                     8 /* Bit depth */, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    }
+    /* Only the header chunks come from libpng; the image data is compressed by image_writer_flush */
+    png_write_info(writer->png, writer->info);
+    return writer;
+}
 
+u_image_writer_t* u_image_writer_open(const char* filename, int width, int height) {
+    return image_writer_open(filename, width, height, NULL, 0);
+}
 
-    png_bytepp rows = malloc(image->height * sizeof(*rows));
-    if (!rows) {
-        fclose(fp);
-        u_error_nomem();
-        return U_ERROR_NOMEM;
-    }
-    int i, j;
-    for (i = 0; i < image->height; i++) {
-        rows[i] = malloc(4 * image->width * sizeof(*rows[i]));
-        if (!rows[i]) {
-            for (j = 0; j < i; j++)
-                free(rows[j]);
-            free(rows);
-            fclose(fp);
-            u_error_nomem();
-            return U_ERROR_NOMEM;
-        }
-        for (j = 0; j < image->width; j++) {
-            rows[i][4*j+0] = image->pixels[i][j].r;
-            rows[i][4*j+1] = image->pixels[i][j].g;
-            rows[i][4*j+2] = image->pixels[i][j].b;
-            rows[i][4*j+3] = image->pixels[i][j].a;
-        }
+u_image_writer_t* u_image_writer_palette_open(const char* filename, int width, int height, const u_color_t* palette, size_t npalette) {
+    if (npalette < 1 || npalette > U_IMAGE_MAX_PALETTE) {
+        u_error_set(U_ERROR_FORMAT, "PNG palettes must have between 1 and 256 colors.");
+        return NULL;
     }
+    return image_writer_open(filename, width, height, palette, npalette);
+}
 
+int u_image_writer_rows_write(u_image_writer_t* writer, u_color_t** rows, int nrows) {
+    if (writer->format != U_IMAGE_PNG) {
+        if (writer->indexed)
+            return u_error_set(U_ERROR_OTHER, "Can't write RGBA rows to a palette image.");
+        return image_writer_other_rows_write(writer, rows, nrows);
+    }
     #ifndef WINDOWS
-    if (setjmp(png_jmpbuf(image->png))) {
-        for (i = 0; i < image->height; i++)
-            free(rows[i]);
-        free(rows);
-        fclose(fp);
+    if (setjmp(png_jmpbuf(writer->png))) {
         return u_error_set(U_ERROR_OTHER, "Failed to write image to file.");
     }
     #endif
+    if (writer->indexed)
+        return u_error_set(U_ERROR_OTHER, "Can't write RGBA rows to a palette image.");
+    int i, err = U_ERROR_SUCCESS;
+    for (i = 0; i < nrows; i++) {
+        u_u8_t* row = image_writer_row_next(writer, &err);
+        if (!row) return err;
+        memcpy(row, rows[i], writer->row_bytes);
+    }
+    return U_ERROR_SUCCESS;
+}
 
-    png_write_image(image->png, rows);
-
+int u_image_writer_indices_write(u_image_writer_t* writer, u_u8_t** rows, int nrows) {
+    int i, x, err = U_ERROR_SUCCESS, depth = writer->bit_depth;
+    if (writer->format != U_IMAGE_PNG) {
+        if (!writer->indexed)
+            return u_error_set(U_ERROR_OTHER, "Can't write palette indices to an RGBA image.");
+        for (i = 0; i < nrows && !err; i++) {
+            for (x = 0; x < writer->width; x++)
+                writer->expanded[x] = writer->palette[rows[i][x]];
+            err = image_writer_other_rows_write(writer, &writer->expanded, 1);
+        }
+        return err;
+    }
     #ifndef WINDOWS
-    if (setjmp(png_jmpbuf(image->png))) {
-        for (i = 0; i < image->height; i++)
-            free(rows[i]);
-        free(rows);
-        fclose(fp);
+    if (setjmp(png_jmpbuf(writer->png))) {
         return u_error_set(U_ERROR_OTHER, "Failed to write image to file.");
     }
     #endif
-    png_write_end(image->png, NULL);
-    for (i = 0; i < image->height; i++)
-        free(rows[i]);
-    free(rows);
-    fclose(fp);
+    if (!writer->indexed)
+        return u_error_set(U_ERROR_OTHER, "Can't write palette indices to an RGBA image.");
+    for (i = 0; i < nrows; i++) {
+        u_u8_t* row = image_writer_row_next(writer, &err);
+        if (!row) return err;
+        if (depth == 8) {
+            memcpy(row, rows[i], writer->width);
+            continue;
+        }
+        /* Pack the indices, leftmost pixel in the high bits */
+        memset(row, 0, writer->row_bytes);
+        for (x = 0; x < writer->width; x++) {
+            int bit = x * depth;
+            row[bit >> 3] |= rows[i][x] << (8 - depth - (bit & 7));
+        }
+    }
     return U_ERROR_SUCCESS;
 }
 
-int u_image_width_get(const u_image_t* image) {
-    return image->width;
-}
-
-int u_image_height_get(const u_image_t* image) {
-    return image->height;
+int u_image_writer_close(u_image_writer_t* writer) {
+    if (writer->format != U_IMAGE_PNG) {
+        int err = U_ERROR_SUCCESS;
+        if (writer->format == U_IMAGE_QOI) {
+            err = u_qoi_write_finish(&writer->qoi);
+            u_qoi_end(&writer->qoi);
+        } else {
+            u_pnm_end(&writer->pnm);
+        }
+        if (fclose(writer->fp) && !err)
+            err = u_error_set(U_ERROR_ACCESS, "Failed to write image to file.");
+        image_writer_free(writer);
+        return err;
+    }
+    #ifndef WINDOWS
+    if (setjmp(png_jmpbuf(writer->png))) {
+        png_destroy_write_struct(&writer->png, &writer->info);
+        fclose(writer->fp);
+        image_writer_free(writer);
+        return u_error_set(U_ERROR_OTHER, "Failed to write image to file.");
+    }
+    #endif
+    int err = image_writer_flush(writer, U_TRUE);
+    if (!err)
+        png_write_chunk(writer->png, (png_const_bytep)"IEND", NULL, 0);
+    png_destroy_write_struct(&writer->png, &writer->info);
+    if (fclose(writer->fp) && !err)
+        err = u_error_set(U_ERROR_ACCESS, "Failed to write image to file.");
+    image_writer_free(writer);
+    return err;
 }
 
-u_color_t u_image_pixel_get(const u_image_t* image, int x, int y) {
-    return image->pixels[y][x];
+u_image_reader_t* u_image_reader_open(const char* filename) {
+    u_image_reader_t* reader = malloc(sizeof(*reader));
+    if (!reader) {
+        u_error_nomem();
+        return NULL;
+    }
+    reader->fp = fopen(filename, "rb");
+    if (!reader->fp) {
+        free(reader);
+        u_error_set(U_ERROR_ACCESS, "Image file not found.");
+        return NULL;
+    }
+    if (image_format_detect(reader->fp, &reader->format)) {
+        fclose(reader->fp);
+        free(reader);
+        return NULL;
+    }
+    if (reader->format != U_IMAGE_PNG) {
+        int err;
+        if (reader->format == U_IMAGE_QOI) {
+            err = u_qoi_read_start(&reader->qoi, reader->fp);
+            reader->width = reader->qoi.width;
+            reader->height = reader->qoi.height;
+        } else {
+            err = u_pnm_read_start(&reader->pnm, reader->fp);
+            reader->width = reader->pnm.width;
+            reader->height = reader->pnm.height;
+        }
+        if (err) {
+            u_image_reader_close(reader);
+            return NULL;
+        }
+        return reader;
+    }
+    fseek(reader->fp, 8, SEEK_SET); /* Skip the signature */
+    reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, user_error_fn, NULL);
+    reader->info = reader->png ? png_create_info_struct(reader->png) : NULL;
+    if (!reader->info) {
+        png_destroy_read_struct(&reader->png, NULL, NULL);
+        fclose(reader->fp);
+        free(reader);
+        u_error_set(U_ERROR_OTHER, "Failed to create PNG struct.");
+        return NULL;
+    }
+    #ifndef WINDOWS
+    if (setjmp(png_jmpbuf(reader->png))) {
+        png_destroy_read_struct(&reader->png, &reader->info, NULL);
+        fclose(reader->fp);
+        free(reader);
+        u_error_set(U_ERROR_OTHER, "Failed to read image.");
+        return NULL;
+    }
+    #endif
+    png_init_io(reader->png, reader->fp);
+    png_set_sig_bytes(reader->png, 8);
+    png_read_info(reader->png, reader->info);
+    reader->width = png_get_image_width(reader->png, reader->info);
+    reader->height = png_get_image_height(reader->png, reader->info);
+    if (image_read_transforms_set(reader->png, reader->info) != 1) {
+        png_destroy_read_struct(&reader->png, &reader->info, NULL);
+        fclose(reader->fp);
+        free(reader);
+        u_error_set(U_ERROR_FORMAT, "Interlaced PNGs can't be read row by row.");
+        return NULL;
+    }
+    return reader;
 }
 
-void u_image_pixel_set(u_image_t* image, int x, int y, u_color_t color) {
-    image->pixels[y][x] = color;
+int u_image_reader_width_get(const u_image_reader_t* reader) {
+    return reader->width;
 }
 
-u_color_t** u_image_pixels_get(u_image_t* image) {
-    return image->pixels;
+int u_image_reader_height_get(const u_image_reader_t* reader) {
+    return reader->height;
 }
 
-void u_image_free(u_image_t* image) {
-    if (image->read) {
-        png_destroy_read_struct(&image->png, &image->info, NULL);
-    } else {
-        png_destroy_write_struct(&image->png, &image->info);
+int u_image_reader_rows_read(u_image_reader_t* reader, u_color_t** rows, int nrows) {
+    if (reader->format == U_IMAGE_QOI)
+        return u_qoi_rows_read(&reader->qoi, rows, nrows);
+    if (reader->format != U_IMAGE_PNG)
+        return u_pnm_rows_read(&reader->pnm, rows, nrows);
+    #ifndef WINDOWS
+    if (setjmp(png_jmpbuf(reader->png))) {
+        return u_error_set(U_ERROR_OTHER, "Failed to read image.");
     }
+    #endif
     int i;
-    for (i = 0; i < image->height; i++) {
-        free(image->pixels[i]);
-    }
-    free(image->pixels);
-    free(image);
+    for (i = 0; i < nrows; i++)
+        png_read_row(reader->png, (png_bytep)rows[i], NULL);
+    return U_ERROR_SUCCESS;
+}
+
+void u_image_reader_close(u_image_reader_t* reader) {
+    if (reader->format == U_IMAGE_QOI)
+        u_qoi_end(&reader->qoi);
+    else if (reader->format != U_IMAGE_PNG)
+        u_pnm_end(&reader->pnm);
+    else
+        png_destroy_read_struct(&reader->png, &reader->info, NULL);
+    fclose(reader->fp);
+    free(reader);
 }
@@ -18,14 +18,47 @@
 /** \file image.h
 \brief Image I/O
 
-Reading and writing images. Currently only supports 8-bit RGB/RGBA PNG.
+Reading and writing images. Supports PNG, binary PPM/PGM/PAM (see pnm.h) and
+QOI (see qoi.h). The format of a file being read is worked out from its first
+few bytes, and the format of a file being written from its extension (PNG
+unless it is .ppm, .pnm, .pgm, .pam or .qoi). Images are always stored as 8-bit RGBA
+(whatever is in the file), in one contiguous buffer.
 */
 #ifndef CUTILS_FILETYPES_IMAGE_H
 #define CUTILS_FILETYPES_IMAGE_H
 
+#include <stddef.h>
+
 #include "../misc/color.h"
 
 typedef struct u_image u_image_t; /**< The struct for an image. */
+typedef struct u_image_reader u_image_reader_t; /**< For reading an image a few rows at a time. */
+typedef struct u_image_writer u_image_writer_t; /**< For writing an image a few rows at a time. */
+
+#define U_IMAGE_MAX_PALETTE 256 /**< The most colors a palette image can have. */
+
+/** Image file formats. */
+typedef enum {
+    U_IMAGE_PNG, /**< PNG */
+    U_IMAGE_PPM, /**< Binary PPM (or PGM, for reading) */
+    U_IMAGE_PAM, /**< PAM */
+    U_IMAGE_QOI, /**< QOI */
+    U_IMAGE_PGM  /**< Binary PGM (grayscale; only used for writing) */
+} u_image_format_t;
+
+/** How PNG files are compressed: faster, or smaller. */
+typedef enum {
+    U_IMAGE_PNG_FAST, /**< Compress quickly (e.g. for intermediate files) */
+    U_IMAGE_PNG_DEFAULT, /**< About as fast and small as libpng's defaults */
+    U_IMAGE_PNG_SMALL /**< Compress as much as possible */
+} u_image_png_speed_t;
+
+/** Sets how every PNG file written from now on is compressed. The default is
+    \ref U_IMAGE_PNG_DEFAULT. */
+void u_image_png_speed_set(u_image_png_speed_t speed);
+
+/** \returns The format an image called \p filename would be written in. */
+u_image_format_t u_image_format_from_filename(const char* filename);
 
 /** Opens an image file for reading.
 \returns An image, or NULL on failure and sets \ref u_error_message accordingly. */
@@ -45,9 +78,51 @@ u_color_t   u_image_pixel_get(const u_image_t* image, int x, int y);
 /** Sets the color of the pixel at (\p x,\p y) to \p color */
 void        u_image_pixel_set(u_image_t* image, int x, int y, u_color_t color);
 /** \returns An array containing the pixels in the image.
-    To access a pixel, simply use `pixels[y][x]`. */
+    To access a pixel, simply use `pixels[y][x]`. The rows all point into the
+    buffer returned by \ref u_image_data_get. */
 u_color_t** u_image_pixels_get(u_image_t* image);
+/** \returns All of the pixels in the image, one row after another. The pixel at
+    (x, y) is `data[y * stride + x]`.
+    \param stride If this is not `NULL`, it is set to the number of pixels from the
+    start of one row to the start of the next (at least the width). */
+u_color_t*  u_image_data_get(u_image_t* image, size_t* stride);
 /** Frees the memory used by an image. */
 void        u_image_free(u_image_t* image);
 
+
+/** Starts reading an image file row by row, so that the whole image never has to
+    be in memory. Interlaced PNGs aren't supported.
+    \returns A reader, or NULL on failure and sets \ref u_error_message accordingly. */
+u_image_reader_t* u_image_reader_open(const char* filename);
+/** \returns The width in pixels of the image being read. */
+int         u_image_reader_width_get(const u_image_reader_t* reader);
+/** \returns The height in pixels of the image being read. */
+int         u_image_reader_height_get(const u_image_reader_t* reader);
+/** Reads the next \p nrows rows of the image, as RGBA, into `rows[0]` ... `rows[nrows-1]`,
+    each of which should have room for a row of pixels. \returns An error code. */
+int         u_image_reader_rows_read(u_image_reader_t* reader, u_color_t** rows, int nrows);
+/** Closes the file and frees \p reader. */
+void        u_image_reader_close(u_image_reader_t* reader);
+
+/** Starts writing an RGBA image file row by row, so that the whole image never
+    has to be in memory.
+    \returns A writer, or NULL on failure and sets \ref u_error_message accordingly. */
+u_image_writer_t* u_image_writer_open(const char* filename, int width, int height);
+/** Starts writing a palette PNG file row by row. The PNG uses the smallest bit depth
+    (1, 2, 4, or 8) which fits \p npalette colors, and has a tRNS chunk if any of them
+    aren't opaque. Other formats don't have palettes, so for them, the indices are
+    turned back into colors. \p npalette must be at most \ref U_IMAGE_MAX_PALETTE.
+    \returns A writer, or NULL on failure and sets \ref u_error_message accordingly. */
+u_image_writer_t* u_image_writer_palette_open(const char* filename, int width, int height, const u_color_t* palette, size_t npalette);
+/** Writes the next \p nrows rows of the image. `rows[i][x]` is pixel x of the i-th row.
+    \returns An error code. */
+int         u_image_writer_rows_write(u_image_writer_t* writer, u_color_t** rows, int nrows);
+/** Writes the next \p nrows rows of a palette image. `rows[i][x]` is the index in the
+    palette of pixel x of the i-th row (one byte per pixel, whatever the bit depth).
+    \returns An error code. */
+int         u_image_writer_indices_write(u_image_writer_t* writer, u_u8_t** rows, int nrows);
+/** Finishes writing the image (all of its rows should have been written), closes
+    the file, and frees \p writer. \returns An error code. */
+int         u_image_writer_close(u_image_writer_t* writer);
+
 #endif /* CUTILS_FILETYPES_IMAGE_H */
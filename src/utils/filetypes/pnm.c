@@ -0,0 +1,196 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "pnm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "../misc/error.h"
+
+/* Rows of RGBA pixels are read and written straight from u_color_t arrays */
+typedef char u_pnm_color_is_rgba[sizeof(u_color_t) == 4 ? 1 : -1];
+
+static int pnm_space_skip(FILE* fp) {
+    /* Skips whitespace and comments. Returns the next character (which is not consumed). */
+    int c = getc(fp);
+    for (;;) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF)
+                c = getc(fp);
+        } else if (!isspace(c)) {
+            break;
+        }
+        c = getc(fp);
+    }
+    if (c != EOF)
+        ungetc(c, fp);
+    return c;
+}
+
+static long pnm_number_read(FILE* fp) {
+    /* Reads a non-negative decimal number (after skipping whitespace). Returns -1 on failure. */
+    long n = 0;
+    int c;
+    if (!isdigit(pnm_space_skip(fp)))
+        return -1;
+    while (isdigit(c = getc(fp)) && n < 1000000000L)
+        n = 10 * n + (c - '0');
+    if (c != EOF)
+        ungetc(c, fp);
+    return n;
+}
+
+static int pnm_pam_header_read(u_pnm_t* pnm, FILE* fp, long* maxval) {
+    /* Reads the lines of a PAM header, up to and including ENDHDR */
+    char line[256];
+    long width = -1, height = -1, depth = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        char* value = line;
+        while (*value && !isspace((unsigned char)*value)) value++;
+        if (!strncmp(line, "ENDHDR", 6)) {
+            if (width <= 0 || height <= 0 || depth < 1 || depth > 4)
+                return u_error_set(U_ERROR_FORMAT, "Invalid PAM header.");
+            pnm->width = width;
+            pnm->height = height;
+            pnm->depth = depth;
+            return U_ERROR_SUCCESS;
+        } else if (!strncmp(line, "WIDTH", 5)) {
+            width = atol(value);
+        } else if (!strncmp(line, "HEIGHT", 6)) {
+            height = atol(value);
+        } else if (!strncmp(line, "DEPTH", 5)) {
+            depth = atol(value);
+        } else if (!strncmp(line, "MAXVAL", 6)) {
+            *maxval = atol(value);
+        } /* Otherwise, it's a TUPLTYPE or a comment; the depth is all that matters. */
+    }
+    return u_error_set(U_ERROR_FORMAT, "Invalid PAM header.");
+}
+
+int u_pnm_read_start(u_pnm_t* pnm, FILE* fp) {
+    char magic[2];
+    long maxval = -1;
+    pnm->fp = fp;
+    pnm->row = NULL;
+    if (fread(magic, 1, 2, fp) != 2 || magic[0] != 'P')
+        return u_error_set(U_ERROR_FORMAT, "Not a PNM file.");
+    if (magic[1] == '7') {
+        int err = pnm_pam_header_read(pnm, fp, &maxval);
+        if (err) return err;
+    } else if (magic[1] == '5' || magic[1] == '6') {
+        long width = pnm_number_read(fp), height = pnm_number_read(fp);
+        maxval = pnm_number_read(fp);
+        if (width <= 0 || height <= 0 || !isspace(getc(fp))) /* Exactly one whitespace character before the pixels */
+            return u_error_set(U_ERROR_FORMAT, "Invalid PNM header.");
+        pnm->width = width;
+        pnm->height = height;
+        pnm->depth = magic[1] == '5' ? 1 : 3;
+    } else {
+        return u_error_set(U_ERROR_FORMAT, "Only binary PGM, PPM and PAM files are supported.");
+    }
+    if (maxval != 255)
+        return u_error_set(U_ERROR_FORMAT, "Only 8-bit PNM files are supported.");
+    if (pnm->depth != 4) {
+        pnm->row = malloc((size_t)pnm->width * pnm->depth);
+        if (!pnm->row)
+            return u_error_nomem();
+    }
+    return U_ERROR_SUCCESS;
+}
+
+int u_pnm_rows_read(u_pnm_t* pnm, u_color_t** rows, int nrows) {
+    int i, x;
+    for (i = 0; i < nrows; i++) {
+        u_color_t* row = rows[i];
+        if (pnm->depth == 4) {
+            if (fread(row, sizeof(*row), pnm->width, pnm->fp) != (size_t)pnm->width)
+                return u_error_set(U_ERROR_FORMAT, "PNM file ended too early.");
+            continue;
+        }
+        if (fread(pnm->row, pnm->depth, pnm->width, pnm->fp) != (size_t)pnm->width)
+            return u_error_set(U_ERROR_FORMAT, "PNM file ended too early.");
+        const u_u8_t* in = pnm->row;
+        switch (pnm->depth) {
+        case 1:
+            for (x = 0; x < pnm->width; x++, in++)
+                row[x] = u_color_from_rgba(in[0], in[0], in[0], 255);
+            break;
+        case 2:
+            for (x = 0; x < pnm->width; x++, in += 2)
+                row[x] = u_color_from_rgba(in[0], in[0], in[0], in[1]);
+            break;
+        case 3:
+            for (x = 0; x < pnm->width; x++, in += 3)
+                row[x] = u_color_from_rgba(in[0], in[1], in[2], 255);
+            break;
+        }
+    }
+    return U_ERROR_SUCCESS;
+}
+
+int u_pnm_write_start(u_pnm_t* pnm, FILE* fp, int width, int height, int depth) {
+    pnm->fp = fp;
+    pnm->width = width;
+    pnm->height = height;
+    pnm->depth = depth == 1 || depth == 4 ? depth : 3;
+    pnm->row = NULL;
+    if (pnm->depth == 4) {
+        fprintf(fp, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+    } else {
+        fprintf(fp, "P%c\n%d %d\n255\n", pnm->depth == 1 ? '5' : '6', width, height);
+        pnm->row = malloc(pnm->depth * (size_t)width);
+        if (!pnm->row)
+            return u_error_nomem();
+    }
+    if (ferror(fp))
+        return u_error_set(U_ERROR_ACCESS, "Failed to write image to file.");
+    return U_ERROR_SUCCESS;
+}
+
+int u_pnm_rows_write(u_pnm_t* pnm, u_color_t** rows, int nrows) {
+    int i, x;
+    for (i = 0; i < nrows; i++) {
+        const u_color_t* row = rows[i];
+        size_t written;
+        if (pnm->depth == 4) {
+            written = fwrite(row, sizeof(*row), pnm->width, pnm->fp);
+        } else if (pnm->depth == 1) {
+            u_u8_t* out = pnm->row;
+            for (x = 0; x < pnm->width; x++) /* (the luma, for colors which aren't gray) */
+                out[x] = (u_u8_t)((299 * row[x].r + 587 * row[x].g + 114 * row[x].b + 500) / 1000);
+            written = fwrite(pnm->row, 1, pnm->width, pnm->fp);
+        } else {
+            u_u8_t* out = pnm->row;
+            for (x = 0; x < pnm->width; x++, out += 3) {
+                out[0] = row[x].r;
+                out[1] = row[x].g;
+                out[2] = row[x].b;
+            }
+            written = fwrite(pnm->row, 3, pnm->width, pnm->fp);
+        }
+        if (written != (size_t)pnm->width)
+            return u_error_set(U_ERROR_ACCESS, "Failed to write image to file.");
+    }
+    return U_ERROR_SUCCESS;
+}
+
+void u_pnm_end(u_pnm_t* pnm) {
+    free(pnm->row);
+    pnm->row = NULL;
+}
@@ -0,0 +1,57 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file pnm.h
+\brief Binary PPM/PGM/PAM images
+
+Reading and writing the binary (P5, P6 and P7) netpbm formats, one row at a time.
+Only 8-bit samples (a maxval of 255) are supported. Rows are converted to and from
+RGBA; PAM files with a depth of 4 are read and written without any conversion.
+You probably want to use image.h, which uses this for files in these formats.
+*/
+#ifndef CUTILS_FILETYPES_PNM_H
+#define CUTILS_FILETYPES_PNM_H
+
+#include <stdio.h>
+
+#include "../misc/color.h"
+
+/** A PNM file being read or written. */
+typedef struct {
+    FILE* fp; /**< The file */
+    int width; /**< The width of the image */
+    int height; /**< The height of the image */
+    int depth; /**< The number of samples per pixel (1 = gray, 2 = gray+alpha, 3 = RGB, 4 = RGBA) */
+    u_u8_t* row; /**< A buffer for converting rows (NULL if depth is 4) */
+} u_pnm_t;
+
+/** Reads the header of a PNM file from \p fp (which should be at the start of
+    the file), and sets up \p pnm to read its rows. \returns An error code. */
+int  u_pnm_read_start(u_pnm_t* pnm, FILE* fp);
+/** Reads the next \p nrows rows of the image, as RGBA, into `rows[0]` ... `rows[nrows-1]`.
+    \returns An error code. */
+int  u_pnm_rows_read(u_pnm_t* pnm, u_color_t** rows, int nrows);
+/** Writes the header of a PNM file to \p fp and sets up \p pnm to write its rows.
+    \param depth 4 writes an RGBA PAM file, 1 writes a grayscale PGM file, and anything
+                 else writes a PPM file (without alpha). \returns An error code. */
+int  u_pnm_write_start(u_pnm_t* pnm, FILE* fp, int width, int height, int depth);
+/** Writes the next \p nrows rows of the image. \returns An error code. */
+int  u_pnm_rows_write(u_pnm_t* pnm, u_color_t** rows, int nrows);
+/** Frees the memory used by \p pnm (but doesn't close its file). */
+void u_pnm_end(u_pnm_t* pnm);
+
+#endif /* CUTILS_FILETYPES_PNM_H */
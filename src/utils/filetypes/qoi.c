@@ -0,0 +1,258 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "qoi.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../misc/error.h"
+
+#define QOI_OP_INDEX 0x00 /* 00xxxxxx */
+#define QOI_OP_DIFF  0x40 /* 01xxxxxx */
+#define QOI_OP_LUMA  0x80 /* 10xxxxxx */
+#define QOI_OP_RUN   0xC0 /* 11xxxxxx */
+#define QOI_OP_RGB   0xFE
+#define QOI_OP_RGBA  0xFF
+#define QOI_MASK     0xC0
+#define QOI_HEADER_SIZE 14
+#define QOI_MAX_RUN 62
+#define QOI_MAX_CHUNK 5 /* The most bytes one pixel can take */
+#define QOI_MAX_PIXELS 400000000UL /* The limit in the reference implementation */
+
+static const u_u8_t qoi_padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+static int qoi_hash(u_color_t c) {
+    return (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) % 64;
+}
+
+static int qoi_color_equal(u_color_t a, u_color_t b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static void qoi_init(u_qoi_t* qoi, FILE* fp, int width, int height) {
+    qoi->fp = fp;
+    qoi->width = width;
+    qoi->height = height;
+    memset(qoi->index, 0, sizeof(qoi->index));
+    qoi->previous = u_color_from_rgba(0, 0, 0, 255);
+    qoi->run = 0;
+    qoi->pixels_left = (size_t)width * height;
+    qoi->buffer_pos = 0;
+    qoi->buffer_len = 0;
+}
+
+static u_u32_t qoi_u32_read(const u_u8_t* p) {
+    return ((u_u32_t)p[0] << 24) | ((u_u32_t)p[1] << 16) | ((u_u32_t)p[2] << 8) | p[3];
+}
+
+static void qoi_u32_write(u_u8_t* p, u_u32_t x) {
+    p[0] = (x >> 24) & 0xFF;
+    p[1] = (x >> 16) & 0xFF;
+    p[2] = (x >> 8) & 0xFF;
+    p[3] = x & 0xFF;
+}
+
+int u_qoi_read_start(u_qoi_t* qoi, FILE* fp) {
+    u_u8_t header[QOI_HEADER_SIZE];
+    qoi->buffer = NULL;
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, "qoif", 4))
+        return u_error_set(U_ERROR_FORMAT, "Not a QOI file.");
+    u_u32_t width = qoi_u32_read(&header[4]), height = qoi_u32_read(&header[8]);
+    if (!width || !height || width > 0x7FFFFFFF || height > QOI_MAX_PIXELS / width)
+        return u_error_set(U_ERROR_FORMAT, "Invalid QOI image size.");
+    qoi_init(qoi, fp, width, height);
+    qoi->buffer = malloc(U_QOI_BUFFER_SIZE);
+    if (!qoi->buffer)
+        return u_error_nomem();
+    return U_ERROR_SUCCESS;
+}
+
+static int qoi_fill(u_qoi_t* qoi) {
+    /* Makes sure there are at least QOI_MAX_CHUNK bytes in the buffer (unless the file ends first).
+       Returns the number of bytes available. */
+    size_t available = qoi->buffer_len - qoi->buffer_pos;
+    if (available >= QOI_MAX_CHUNK)
+        return available;
+    memmove(qoi->buffer, &qoi->buffer[qoi->buffer_pos], available);
+    qoi->buffer_pos = 0;
+    qoi->buffer_len = available + fread(&qoi->buffer[available], 1, U_QOI_BUFFER_SIZE - available, qoi->fp);
+    return qoi->buffer_len;
+}
+
+int u_qoi_rows_read(u_qoi_t* qoi, u_color_t** rows, int nrows) {
+    int i, x;
+    if ((size_t)nrows * qoi->width > qoi->pixels_left)
+        return u_error_set(U_ERROR_BOUNDS, "Tried to read past the end of a QOI image.");
+    qoi->pixels_left -= (size_t)nrows * qoi->width;
+    u_color_t px = qoi->previous;
+    for (i = 0; i < nrows; i++) {
+        u_color_t* row = rows[i];
+        for (x = 0; x < qoi->width; x++) {
+            if (qoi->run > 0) {
+                qoi->run--;
+                row[x] = px;
+                continue;
+            }
+            int available = qoi_fill(qoi);
+            const u_u8_t* in = &qoi->buffer[qoi->buffer_pos];
+            int op = available ? in[0] : -1;
+            int size = op == QOI_OP_RGBA ? 5 : op == QOI_OP_RGB ? 4 : (op & QOI_MASK) == QOI_OP_LUMA ? 2 : 1;
+            if (op < 0 || size > available)
+                return u_error_set(U_ERROR_FORMAT, "QOI file ended too early.");
+            qoi->buffer_pos += size;
+            if (op == QOI_OP_RGB) {
+                px.r = in[1];
+                px.g = in[2];
+                px.b = in[3];
+            } else if (op == QOI_OP_RGBA) {
+                px.r = in[1];
+                px.g = in[2];
+                px.b = in[3];
+                px.a = in[4];
+            } else if ((op & QOI_MASK) == QOI_OP_INDEX) {
+                px = qoi->index[op];
+            } else if ((op & QOI_MASK) == QOI_OP_DIFF) {
+                px.r += ((op >> 4) & 3) - 2;
+                px.g += ((op >> 2) & 3) - 2;
+                px.b += (op & 3) - 2;
+            } else if ((op & QOI_MASK) == QOI_OP_LUMA) {
+                int dg = (op & 0x3F) - 32;
+                px.r += dg - 8 + ((in[1] >> 4) & 0xF);
+                px.g += dg;
+                px.b += dg - 8 + (in[1] & 0xF);
+            } else {
+                qoi->run = op & 0x3F; /* The run includes this pixel */
+            }
+            qoi->index[qoi_hash(px)] = px;
+            row[x] = px;
+        }
+    }
+    qoi->previous = px;
+    return U_ERROR_SUCCESS;
+}
+
+static int qoi_flush(u_qoi_t* qoi) {
+    if (qoi->buffer_pos && fwrite(qoi->buffer, 1, qoi->buffer_pos, qoi->fp) != qoi->buffer_pos)
+        return u_error_set(U_ERROR_ACCESS, "Failed to write image to file.");
+    qoi->buffer_pos = 0;
+    return U_ERROR_SUCCESS;
+}
+
+int u_qoi_write_start(u_qoi_t* qoi, FILE* fp, int width, int height) {
+    qoi->buffer = NULL;
+    if (width <= 0 || height <= 0 || (u_u32_t)height > QOI_MAX_PIXELS / (u_u32_t)width)
+        return u_error_set(U_ERROR_ARGUMENT, "Image is too big to be a QOI file.");
+    qoi_init(qoi, fp, width, height);
+    qoi->buffer = malloc(U_QOI_BUFFER_SIZE);
+    if (!qoi->buffer)
+        return u_error_nomem();
+    u_u8_t* header = qoi->buffer;
+    memcpy(header, "qoif", 4);
+    qoi_u32_write(&header[4], width);
+    qoi_u32_write(&header[8], height);
+    header[12] = 4; /* Channels (RGBA) */
+    header[13] = 0; /* Colorspace (sRGB with linear alpha) */
+    qoi->buffer_pos = QOI_HEADER_SIZE;
+    return U_ERROR_SUCCESS;
+}
+
+int u_qoi_rows_write(u_qoi_t* qoi, u_color_t** rows, int nrows) {
+    int i, x;
+    if ((size_t)nrows * qoi->width > qoi->pixels_left)
+        return u_error_set(U_ERROR_BOUNDS, "Tried to write past the end of a QOI image.");
+    qoi->pixels_left -= (size_t)nrows * qoi->width;
+    u_color_t prev = qoi->previous;
+    for (i = 0; i < nrows; i++) {
+        const u_color_t* row = rows[i];
+        for (x = 0; x < qoi->width; x++) {
+            u_color_t px = row[x];
+            if (qoi->buffer_pos > U_QOI_BUFFER_SIZE - 2 * QOI_MAX_CHUNK) {
+                int err = qoi_flush(qoi);
+                if (err) return err;
+            }
+            u_u8_t* out = &qoi->buffer[qoi->buffer_pos];
+            if (qoi_color_equal(px, prev)) {
+                if (++qoi->run == QOI_MAX_RUN) {
+                    *out = QOI_OP_RUN | (qoi->run - 1);
+                    qoi->buffer_pos++;
+                    qoi->run = 0;
+                }
+                continue;
+            }
+            if (qoi->run) {
+                *out++ = QOI_OP_RUN | (qoi->run - 1);
+                qoi->buffer_pos++;
+                qoi->run = 0;
+            }
+            int hash = qoi_hash(px);
+            if (qoi_color_equal(qoi->index[hash], px)) {
+                out[0] = QOI_OP_INDEX | hash;
+                qoi->buffer_pos += 1;
+            } else {
+                qoi->index[hash] = px;
+                if (px.a == prev.a) {
+                    int dr = (signed char)(px.r - prev.r),
+                        dg = (signed char)(px.g - prev.g),
+                        db = (signed char)(px.b - prev.b);
+                    int dr_dg = dr - dg, db_dg = db - dg;
+                    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                        out[0] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                        qoi->buffer_pos += 1;
+                    } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                        out[0] = QOI_OP_LUMA | (dg + 32);
+                        out[1] = (dr_dg + 8) << 4 | (db_dg + 8);
+                        qoi->buffer_pos += 2;
+                    } else {
+                        out[0] = QOI_OP_RGB;
+                        out[1] = px.r;
+                        out[2] = px.g;
+                        out[3] = px.b;
+                        qoi->buffer_pos += 4;
+                    }
+                } else {
+                    out[0] = QOI_OP_RGBA;
+                    out[1] = px.r;
+                    out[2] = px.g;
+                    out[3] = px.b;
+                    out[4] = px.a;
+                    qoi->buffer_pos += 5;
+                }
+            }
+            prev = px;
+        }
+    }
+    qoi->previous = prev;
+    return U_ERROR_SUCCESS;
+}
+
+int u_qoi_write_finish(u_qoi_t* qoi) {
+    if (qoi->pixels_left)
+        return u_error_set(U_ERROR_ARGUMENT, "Not all of the QOI image was written.");
+    int err = qoi_flush(qoi);
+    if (err) return err;
+    if (qoi->run)
+        qoi->buffer[qoi->buffer_pos++] = QOI_OP_RUN | (qoi->run - 1);
+    memcpy(&qoi->buffer[qoi->buffer_pos], qoi_padding, sizeof(qoi_padding));
+    qoi->buffer_pos += sizeof(qoi_padding);
+    return qoi_flush(qoi);
+}
+
+void u_qoi_end(u_qoi_t* qoi) {
+    free(qoi->buffer);
+    qoi->buffer = NULL;
+}
@@ -0,0 +1,65 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file qoi.h
+\brief QOI images
+
+Reading and writing [QOI](https://qoiformat.org) ("Quite OK Image") files, one row
+at a time. QOI is lossless, and much faster to encode and decode than PNG.
+You probably want to use image.h, which uses this for .qoi files.
+*/
+#ifndef CUTILS_FILETYPES_QOI_H
+#define CUTILS_FILETYPES_QOI_H
+
+#include <stdio.h>
+
+#include "../misc/color.h"
+
+#define U_QOI_BUFFER_SIZE 65536 /**< The size of the buffer used for reading and writing. */
+
+/** A QOI file being read or written. */
+typedef struct {
+    FILE* fp; /**< The file */
+    int width; /**< The width of the image */
+    int height; /**< The height of the image */
+    u_color_t index[64]; /**< Recently seen pixels, by hash */
+    u_color_t previous; /**< The previous pixel */
+    int run; /**< How many more times the previous pixel is repeated (reading), or has been repeated (writing) */
+    size_t pixels_left; /**< The number of pixels which haven't been read/written yet */
+    u_u8_t* buffer; /**< Buffered bytes of the file */
+    size_t buffer_pos; /**< The position of the next byte in buffer */
+    size_t buffer_len; /**< The number of bytes in buffer (when reading) */
+} u_qoi_t;
+
+/** Reads the header of a QOI file from \p fp (which should be at the start of
+    the file), and sets up \p qoi to read its rows. \returns An error code. */
+int u_qoi_read_start(u_qoi_t* qoi, FILE* fp);
+/** Reads the next \p nrows rows of the image into `rows[0]` ... `rows[nrows-1]`.
+    \returns An error code. */
+int u_qoi_rows_read(u_qoi_t* qoi, u_color_t** rows, int nrows);
+/** Writes the header of a QOI file (with an alpha channel) to \p fp, and sets up
+    \p qoi to write its rows. \returns An error code. */
+int u_qoi_write_start(u_qoi_t* qoi, FILE* fp, int width, int height);
+/** Writes the next \p nrows rows of the image. \returns An error code. */
+int u_qoi_rows_write(u_qoi_t* qoi, u_color_t** rows, int nrows);
+/** Writes the end of the QOI file (all of its rows should have been written).
+    Call \ref u_qoi_end afterwards. \returns An error code. */
+int u_qoi_write_finish(u_qoi_t* qoi);
+/** Frees the memory used by \p qoi (but doesn't close its file). */
+void u_qoi_end(u_qoi_t* qoi);
+
+#endif /* CUTILS_FILETYPES_QOI_H */
@@ -0,0 +1,186 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "y4m.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../misc/error.h"
+
+#define Y4M_MAGIC "YUV4MPEG2"
+#define Y4M_FRAME "FRAME"
+
+static int y4m_line_read(FILE* fp, char* line, size_t size, u_bool_t* end) {
+    /* Reads a header line (without the newline). Sets *end if the file ends before the line starts. */
+    size_t len = 0;
+    int c;
+    *end = U_FALSE;
+    while ((c = getc(fp)) != '\n') {
+        if (c == EOF) {
+            if (ferror(fp))
+                return u_error_set(U_ERROR_ACCESS, "Failed to read Y4M file.");
+            if (len == 0) {
+                *end = U_TRUE;
+                return U_ERROR_SUCCESS;
+            }
+            return u_error_set(U_ERROR_FORMAT, "Y4M file ends in the middle of a header.");
+        }
+        if (len == size - 1)
+            return u_error_set(U_ERROR_FORMAT, "Y4M header too long.");
+        line[len++] = c;
+    }
+    line[len] = 0;
+    return U_ERROR_SUCCESS;
+}
+
+static int y4m_token_is(const char* token, size_t len, const char* s) {
+    return strlen(s) == len && !strncmp(token, s, len);
+}
+
+static int y4m_chroma_set(u_y4m_t* y4m, const char* c) {
+    /* Sets the chroma subsampling from the value of a C parameter */
+    size_t len = strcspn(c, " ");
+    y4m->mono = 0;
+    if (y4m_token_is(c, len, "420") || y4m_token_is(c, len, "420jpeg")
+        || y4m_token_is(c, len, "420paldv") || y4m_token_is(c, len, "420mpeg2")) {
+        y4m->chroma_shift_x = y4m->chroma_shift_y = 1;
+    } else if (y4m_token_is(c, len, "422")) {
+        y4m->chroma_shift_x = 1;
+        y4m->chroma_shift_y = 0;
+    } else if (y4m_token_is(c, len, "444")) {
+        y4m->chroma_shift_x = y4m->chroma_shift_y = 0;
+    } else if (y4m_token_is(c, len, "mono")) {
+        y4m->chroma_shift_x = y4m->chroma_shift_y = 0;
+        y4m->mono = 1;
+    } else {
+        return u_error_set(U_ERROR_FORMAT, "Unsupported Y4M colorspace (only 8-bit 4:2:0, 4:2:2, 4:4:4 and mono are supported).");
+    }
+    return U_ERROR_SUCCESS;
+}
+
+static void y4m_sizes_set(u_y4m_t* y4m) {
+    size_t w = y4m->width, h = y4m->height;
+    if (y4m->mono) {
+        y4m->chroma_width = y4m->chroma_height = 0;
+    } else {
+        y4m->chroma_width = (w + (1 << y4m->chroma_shift_x) - 1) >> y4m->chroma_shift_x;
+        y4m->chroma_height = (h + (1 << y4m->chroma_shift_y) - 1) >> y4m->chroma_shift_y;
+    }
+    y4m->frame_size = w * h + 2 * y4m->chroma_width * y4m->chroma_height;
+}
+
+int u_y4m_read_start(u_y4m_t* y4m, FILE* fp) {
+    char line[U_Y4M_HEADER_MAX];
+    const char* p;
+    u_bool_t end;
+    long width = -1, height = -1;
+    int err = y4m_line_read(fp, line, sizeof(line), &end);
+    if (err) return err;
+    if (end || strncmp(line, Y4M_MAGIC " ", sizeof(Y4M_MAGIC)))
+        return u_error_set(U_ERROR_FORMAT, "Not a Y4M file.");
+    y4m->fp = fp;
+    y4m->params[0] = 0;
+    /* With no C parameter, the chroma is 4:2:0 */
+    y4m->chroma_shift_x = y4m->chroma_shift_y = 1;
+    y4m->mono = 0;
+    for (p = line + sizeof(Y4M_MAGIC); *p; ) {
+        size_t len = strcspn(p, " ");
+        switch (*p) {
+        case 'W':
+            width = atol(p + 1);
+            break;
+        case 'H':
+            height = atol(p + 1);
+            break;
+        case 'C':
+            err = y4m_chroma_set(y4m, p + 1);
+            if (err) return err;
+            /* fallthrough */
+        default:
+            if (len) {
+                /* Keep it (with a space before it) for u_y4m_write_start */
+                size_t params_len = strlen(y4m->params);
+                y4m->params[params_len] = ' ';
+                memcpy(&y4m->params[params_len + 1], p, len);
+                y4m->params[params_len + 1 + len] = 0;
+            }
+            break;
+        }
+        p += len;
+        while (*p == ' ') p++;
+    }
+    if (width <= 0 || height <= 0 || width > 1000000L || height > 1000000L)
+        return u_error_set(U_ERROR_FORMAT, "Invalid Y4M frame size.");
+    y4m->width = width;
+    y4m->height = height;
+    y4m_sizes_set(y4m);
+    return U_ERROR_SUCCESS;
+}
+
+static int y4m_frame_header_read(u_y4m_t* y4m, u_bool_t* end) {
+    char line[U_Y4M_HEADER_MAX];
+    int err = y4m_line_read(y4m->fp, line, sizeof(line), end);
+    if (err || *end) return err;
+    if (strncmp(line, Y4M_FRAME, sizeof(Y4M_FRAME) - 1) || (line[sizeof(Y4M_FRAME) - 1] && line[sizeof(Y4M_FRAME) - 1] != ' '))
+        return u_error_set(U_ERROR_FORMAT, "Invalid Y4M frame header.");
+    return U_ERROR_SUCCESS;
+}
+
+int u_y4m_frame_read(u_y4m_t* y4m, u_u8_t* frame, u_bool_t* end) {
+    int err = y4m_frame_header_read(y4m, end);
+    if (err || *end) return err;
+    if (fread(frame, 1, y4m->frame_size, y4m->fp) != y4m->frame_size)
+        return u_error_set(ferror(y4m->fp) ? U_ERROR_ACCESS : U_ERROR_FORMAT, "Y4M file ends in the middle of a frame.");
+    return U_ERROR_SUCCESS;
+}
+
+int u_y4m_frame_skip(u_y4m_t* y4m, u_bool_t* end) {
+    int err = y4m_frame_header_read(y4m, end);
+    if (err || *end) return err;
+    if (y4m->frame_size <= 2147483647L && !fseek(y4m->fp, (long)y4m->frame_size, SEEK_CUR))
+        return U_ERROR_SUCCESS;
+    /* Not seekable, so read it and throw it away */
+    {
+        u_u8_t buffer[4096];
+        size_t left = y4m->frame_size;
+        while (left) {
+            size_t n = left < sizeof(buffer) ? left : sizeof(buffer);
+            if (fread(buffer, 1, n, y4m->fp) != n)
+                return u_error_set(ferror(y4m->fp) ? U_ERROR_ACCESS : U_ERROR_FORMAT, "Y4M file ends in the middle of a frame.");
+            left -= n;
+        }
+    }
+    return U_ERROR_SUCCESS;
+}
+
+int u_y4m_write_start(u_y4m_t* y4m, FILE* fp, const u_y4m_t* like) {
+    if (y4m != like)
+        *y4m = *like;
+    y4m->fp = fp;
+    if (fprintf(fp, Y4M_MAGIC " W%d H%d%s\n", y4m->width, y4m->height, y4m->params) < 0)
+        return u_error_set(U_ERROR_ACCESS, "Failed to write Y4M file.");
+    return U_ERROR_SUCCESS;
+}
+
+int u_y4m_frame_write(u_y4m_t* y4m, const u_u8_t* frame) {
+    if (fputs(Y4M_FRAME "\n", y4m->fp) == EOF
+        || fwrite(frame, 1, y4m->frame_size, y4m->fp) != y4m->frame_size
+        || fflush(y4m->fp))
+        return u_error_set(U_ERROR_ACCESS, "Failed to write Y4M file.");
+    return U_ERROR_SUCCESS;
+}
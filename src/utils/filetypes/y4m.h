@@ -0,0 +1,67 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file y4m.h
+\brief YUV4MPEG2 video
+
+Reading and writing YUV4MPEG2 (Y4M) video, one frame at a time. Y4M is a very simple
+uncompressed format which can be piped to and from other programs, e.g. with
+`ffmpeg -i in.mp4 -f yuv4mpegpipe -`. Only 8-bit video is supported, with 4:2:0, 4:2:2
+or 4:4:4 chroma, or just luma (`Cmono`).
+
+Each frame is stored as it is in the file: the Y plane (`width*height` bytes), then
+the Cb and Cr planes (`chroma_width*chroma_height` bytes each).
+*/
+#ifndef CUTILS_FILETYPES_Y4M_H
+#define CUTILS_FILETYPES_Y4M_H
+
+#include <stdio.h>
+
+#include "../misc/types.h"
+
+#define U_Y4M_HEADER_MAX 1024 /**< The longest stream or frame header which can be read */
+
+/** A Y4M stream being read or written. */
+typedef struct {
+    FILE* fp; /**< The file */
+    int width; /**< The width of each frame */
+    int height; /**< The height of each frame */
+    int chroma_shift_x; /**< How many bits each x coordinate is shifted right by to get its chroma sample */
+    int chroma_shift_y; /**< How many bits each y coordinate is shifted right by to get its chroma sample */
+    int mono; /**< Whether there is only a Y plane */
+    size_t chroma_width; /**< The width of each chroma plane */
+    size_t chroma_height; /**< The height of each chroma plane */
+    size_t frame_size; /**< The number of bytes in each frame */
+    char params[U_Y4M_HEADER_MAX]; /**< The stream's parameters, other than its size (frame rate, colorspace, etc.), so they can be copied to another stream */
+} u_y4m_t;
+
+/** Reads the header of a Y4M stream from \p fp, and sets up \p y4m to read its frames.
+    \returns An error code. */
+int u_y4m_read_start(u_y4m_t* y4m, FILE* fp);
+/** Reads the next frame into \p frame (a `u_u8_t[y4m->frame_size]`). If there are no more
+    frames, sets `*end` to \ref U_TRUE and doesn't read anything. \returns An error code. */
+int u_y4m_frame_read(u_y4m_t* y4m, u_u8_t* frame, u_bool_t* end);
+/** Like \ref u_y4m_frame_read, but skips over the frame (seeking past it if possible). */
+int u_y4m_frame_skip(u_y4m_t* y4m, u_bool_t* end);
+/** Writes the header of a Y4M stream to \p fp, with the same size and parameters as
+    \p like, and sets up \p y4m to write its frames. \returns An error code. */
+int u_y4m_write_start(u_y4m_t* y4m, FILE* fp, const u_y4m_t* like);
+/** Writes a frame (and flushes the stream, so whatever is reading it gets it right away).
+    \returns An error code. */
+int u_y4m_frame_write(u_y4m_t* y4m, const u_u8_t* frame);
+
+#endif /* CUTILS_FILETYPES_Y4M_H */
@@ -0,0 +1,255 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _POSIX_C_SOURCE 200112L /* For strtof */
+#include "floats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+
+#include "../misc/types_exact.h"
+
+#define FLOATS_MAX_EXACT_DIGITS 15 /* A double can hold any integer with this many digits exactly */
+#define FLOATS_MAX_EXACT_POWER 22 /* A double can hold 10^n exactly, for n up to this */
+#define FLOATS_MAX_DIGITS 9 /* Enough significant digits for any float to be read back exactly */
+#define FLOATS_TOKEN_MAX 256
+
+static const double floats_powers[FLOATS_MAX_EXACT_POWER + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int floats_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static const char* floats_parse_slow(const char* str, const char* end, float* value) {
+    /* Uses strtof on the token at str (which has to be copied, since it might not be null-terminated) */
+    char small[FLOATS_TOKEN_MAX];
+    const char* token_end = str;
+    while (token_end < end && !floats_space(*token_end)) token_end++;
+    size_t len = token_end - str;
+    if (!len) return NULL;
+    char* token = len < sizeof(small) ? small : malloc(len + 1);
+    if (!token) return NULL;
+    memcpy(token, str, len);
+    token[len] = 0;
+    char* parse_end;
+    *value = strtof(token, &parse_end);
+    const char* ret = parse_end == token + len ? token_end : NULL;
+    if (token != small) free(token);
+    return ret;
+}
+
+static int floats_is_midpoint(double d) {
+    /* Whether d is exactly halfway between two floats, in which case converting it to a float
+       might round the wrong way (it has already been rounded once, to a double) */
+    int exponent;
+    double scaled = ldexp(frexp(d, &exponent), FLT_MANT_DIG + 1);
+    return scaled == floor(scaled) && fmod(scaled, 2) != 0;
+}
+
+const char* u_float_parse(const char* str, const char* end, float* value) {
+    /* The digits are read into a double while that's exact, then it's scaled by an exact power of 10
+       (that's one correctly rounded operation: Clinger's fast path). Anything else (lots of digits,
+       big exponents, inf, nan, hex, ...) goes to strtof. */
+    const char* p = str;
+    int negative = 0, point = 0, any = 0, ndigits = 0, nzeros = 0, exponent = 0;
+    double mantissa = 0, d;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    for (; p < end; p++) {
+        if (*p == '.' && !point) {
+            point = 1;
+            continue;
+        }
+        if (*p < '0' || *p > '9') break;
+        any = 1;
+        if (point) exponent--;
+        if (*p == '0') {
+            if (ndigits) nzeros++; /* (zeros are only multiplied in if another digit comes after them) */
+            continue;
+        }
+        if (ndigits + nzeros + 1 > FLOATS_MAX_EXACT_DIGITS)
+            return floats_parse_slow(str, end, value);
+        mantissa = mantissa * floats_powers[nzeros + 1] + (*p - '0');
+        ndigits += nzeros + 1;
+        nzeros = 0;
+    }
+    exponent += nzeros;
+    if (!any)
+        return floats_parse_slow(str, end, value);
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int exponent_negative = 0, e = 0, exponent_any = 0;
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) exponent_negative = *p++ == '-';
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            exponent_any = 1;
+            if (e < 10000) e = 10 * e + (*p - '0');
+        }
+        if (!exponent_any) return NULL;
+        exponent += exponent_negative ? -e : e;
+    }
+    if (p < end && !floats_space(*p))
+        return floats_parse_slow(str, end, value);
+    if (mantissa == 0) {
+        d = 0;
+    } else {
+        if (exponent < -FLOATS_MAX_EXACT_POWER || exponent > FLOATS_MAX_EXACT_POWER)
+            return floats_parse_slow(str, end, value);
+        d = exponent < 0 ? mantissa / floats_powers[-exponent] : mantissa * floats_powers[exponent];
+        if (d < FLT_MIN || d > FLT_MAX || floats_is_midpoint(d))
+            return floats_parse_slow(str, end, value);
+    }
+    *value = (float)(negative ? -d : d);
+    return p;
+}
+
+static size_t floats_write(unsigned long digits, int ndigits, int exponent, char* str) {
+    /* Writes the number d.ddd x 10^exponent, where the d's are the ndigits digits of digits */
+    char buf[FLOATS_MAX_DIGITS];
+    char* out = str;
+    int i;
+    while (ndigits > 1 && digits % 10 == 0) {
+        digits /= 10;
+        ndigits--;
+    }
+    for (i = ndigits - 1; i >= 0; i--) {
+        buf[i] = '0' + digits % 10;
+        digits /= 10;
+    }
+    if (exponent >= 0 && exponent < FLOATS_MAX_DIGITS) {
+        /* ddd.ddd or ddd000 */
+        for (i = 0; i < ndigits || i <= exponent; i++) {
+            if (i == exponent + 1) *out++ = '.';
+            *out++ = i < ndigits ? buf[i] : '0';
+        }
+    } else if (exponent < 0 && exponent >= -5) {
+        /* 0.000ddd */
+        *out++ = '0';
+        *out++ = '.';
+        for (i = -1; i > exponent; i--) *out++ = '0';
+        memcpy(out, buf, ndigits);
+        out += ndigits;
+    } else {
+        /* d.ddde+XX */
+        *out++ = buf[0];
+        if (ndigits > 1) {
+            *out++ = '.';
+            memcpy(out, &buf[1], ndigits - 1);
+            out += ndigits - 1;
+        }
+        *out++ = 'e';
+        *out++ = exponent < 0 ? '-' : '+';
+        if (exponent < 0) exponent = -exponent;
+        *out++ = '0' + exponent / 10;
+        *out++ = '0' + exponent % 10;
+    }
+    return out - str;
+}
+
+static size_t floats_write_rounded(double d, int ndigits, int exponent, char* str) {
+    /* Writes d (which is positive, with its first digit at 10^exponent), rounded to ndigits significant digits */
+    double scaled = floor(d * pow(10, ndigits - 1 - exponent) + 0.5);
+    if (scaled >= floats_powers[ndigits]) {
+        /* It rounded up to the next power of 10 */
+        scaled /= 10;
+        exponent++;
+    }
+    return floats_write((unsigned long)scaled, ndigits, exponent, str);
+}
+
+size_t u_float_format(float value, char* str) {
+    /* The closest number with n significant digits reads back as value for all n above some
+       minimum, so a binary search finds the shortest one (and 9 digits are always enough). */
+    char* out = str;
+    double d = value;
+    if (d != d) {
+        memcpy(str, "nan", 3);
+        return 3;
+    }
+    if (d < 0 || (d == 0 && 1 / d < 0)) {
+        *out++ = '-';
+        d = -d;
+    }
+    if (d == 0) {
+        *out++ = '0';
+        return out - str;
+    }
+    if (d > FLT_MAX) {
+        memcpy(out, "inf", 3);
+        return out + 3 - str;
+    }
+    int exponent = floor(log10(d)), lo = 1, hi = FLOATS_MAX_DIGITS;
+    if (pow(10, exponent) > d) exponent--;
+    else if (pow(10, exponent + 1) <= d) exponent++;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        char candidate[U_FLOAT_STR_MAX];
+        size_t len = floats_write_rounded(d, mid, exponent, candidate);
+        float back;
+        if (u_float_parse(candidate, candidate + len, &back) && back == (float)d)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return out - str + floats_write_rounded(d, lo, exponent, out);
+}
+
+unsigned u_float_to_half(float value) {
+    u_u4b_t bits, abs;
+    memcpy(&bits, &value, sizeof(bits));
+    unsigned sign = (bits >> 16) & 0x8000;
+    abs = bits & 0x7FFFFFFFUL;
+    if (abs >= 0x7F800000UL) /* Infinity or NaN */
+        return sign | (abs > 0x7F800000UL ? 0x7E00 : 0x7C00);
+    if (abs >= 0x477FF000UL) /* 65520 and up round to infinity */
+        return sign | 0x7C00;
+    if (abs < 0x38800000UL) {
+        /* Smaller than the smallest normal half, so it becomes a subnormal (or 0) */
+        if (abs <= 0x33000000UL) /* 2^-25 and below round to 0 */
+            return sign;
+        int shift = 126 - (int)(abs >> 23);
+        u_u4b_t mantissa = (abs & 0x7FFFFFUL) | 0x800000UL;
+        u_u4b_t half = mantissa >> shift, rest = mantissa & ((1UL << shift) - 1), halfway = 1UL << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | half;
+    }
+    u_u4b_t half = (abs >> 13) - ((u_u4b_t)(127 - 15) << 10), rest = abs & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++; /* (this carries into the exponent if the mantissa overflows, which is right) */
+    return sign | half;
+}
+
+float u_float_from_half(unsigned half) {
+    unsigned exponent = (half >> 10) & 0x1F, mantissa = half & 0x3FF;
+    u_u4b_t bits = (u_u4b_t)(half & 0x8000) << 16;
+    float value;
+    if (exponent == 0) {
+        value = ldexp(mantissa, -24);
+        return half & 0x8000 ? -value : value;
+    }
+    if (exponent == 31)
+        bits |= 0x7F800000UL | ((u_u4b_t)mantissa << 13);
+    else
+        bits |= ((u_u4b_t)(exponent + 127 - 15) << 23) | ((u_u4b_t)mantissa << 13);
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
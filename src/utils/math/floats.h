@@ -0,0 +1,54 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file floats.h
+\brief Fast conversion between floats and text (and half-precision floats)
+
+\ref u_float_parse and \ref u_float_format convert between `float`s and decimal text
+much faster than `scanf` and `printf`, without losing anything: a float which is
+formatted and then parsed comes back exactly the same, and formatting uses as few
+digits as possible for that (e.g. 0.1f is written as `0.1`, not `0.100000001`).
+Neither depends on the locale.
+
+\ref u_float_to_half and \ref u_float_from_half convert to and from the bits of
+IEEE 754 half-precision (16-bit) floats, for file formats which store them.
+*/
+#ifndef CUTILS_MATH_FLOATS_H
+#define CUTILS_MATH_FLOATS_H
+
+#include <stddef.h>
+
+#define U_FLOAT_STR_MAX 16 /**< The most characters \ref u_float_format writes. */
+
+/** Parses the number at \p str, which must be followed by whitespace or \p end (the
+    text doesn't have to be null-terminated). Anything `strtof` understands is accepted,
+    and the result is correctly rounded (most numbers are done without `strtof`, though).
+    \returns A pointer to the character after the number, or `NULL` if \p str doesn't
+    start with a number. */
+const char* u_float_parse(const char* str, const char* end, float* value);
+/** Writes the shortest decimal text which \ref u_float_parse turns back into \p value
+    to \p str, which must have room for \ref U_FLOAT_STR_MAX characters (it isn't
+    null-terminated). Very large and very small values are written in scientific notation.
+    \returns The number of characters written. */
+size_t      u_float_format(float value, char* str);
+/** \returns The bits of the half-precision float closest to \p value (rounding
+    halfway cases to even, and values which are too big to infinity). */
+unsigned    u_float_to_half(float value);
+/** \returns The value of the half-precision float whose bits are \p half. */
+float       u_float_from_half(unsigned half);
+
+#endif /* CUTILS_MATH_FLOATS_H */
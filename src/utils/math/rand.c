@@ -18,8 +18,9 @@
 #include "rand.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
-#include "../misc/arrays.h"
 #include "../misc/error.h"
 
 u_bool_t u_rand_bool(void) {
@@ -87,11 +88,49 @@ double u_rand_double(void) {
 }
 
 int u_rand_shuffle(void* array, size_t nmemb, size_t size) {
+    /* Not using u_arrays_swap, so that we only need to allocate tmp once */
+    char* tmp = malloc(size);
+    if (!tmp)
+        return u_error_nomem();
+    char* a = array;
     size_t i;
     for (i = 1; i < nmemb; i++) {
-        size_t j = u_rand_size(0, i);
-        int err = u_arrays_swap(array, size, i, j);
-        if (err) return err;
+        size_t j = u_rand_size(0, i+1);
+        memcpy(tmp, &a[i * size], size);
+        memcpy(&a[i * size], &a[j * size], size);
+        memcpy(&a[j * size], tmp, size);
     }
+    free(tmp);
     return U_ERROR_SUCCESS;
 }
+
+static double rand_open_double(void) {
+    /* A random number strictly between 0 and 1 */
+    return (rand() + 1.0) / (RAND_MAX + 2.0);
+}
+
+static size_t rand_reservoir_skip(const u_rand_reservoir_t* reservoir) {
+    /* How many items to skip before the next one which goes in the sample (geometrically distributed) */
+    double skip = floor(log(rand_open_double()) / log(1 - reservoir->w));
+    return skip < (double)((size_t)-1 / 2) ? (size_t)skip : (size_t)-1 / 2;
+}
+
+void u_rand_reservoir_init(u_rand_reservoir_t* reservoir, size_t capacity) {
+    reservoir->capacity = capacity;
+    reservoir->seen = 0;
+    reservoir->w = capacity ? exp(log(rand_open_double()) / capacity) : 0;
+    /* The first item after the sample fills up isn't always taken: skip ahead to the first one which is */
+    reservoir->next = capacity ? capacity + rand_reservoir_skip(reservoir) : (size_t)-1;
+}
+
+size_t u_rand_reservoir_next(u_rand_reservoir_t* reservoir) {
+    size_t i = reservoir->seen++;
+    if (i < reservoir->capacity)
+        return i; /* Still filling up the sample */
+    if (i != reservoir->next)
+        return (size_t)-1;
+    /* Skip ahead a geometrically distributed number of items (using the updated state, as Algorithm L does) */
+    reservoir->w *= exp(log(rand_open_double()) / reservoir->capacity);
+    reservoir->next += rand_reservoir_skip(reservoir) + 1;
+    return u_rand_size(0, reservoir->capacity);
+}
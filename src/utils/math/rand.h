@@ -44,4 +44,23 @@ double   u_rand_double(void);
     \returns An error code (and sets \ref u_error_message). */
 int      u_rand_shuffle(void* array, size_t nmemb, size_t size);
 
+
+/** For picking a uniformly random sample of a fixed size from a stream of items
+    whose length isn't known in advance, in one pass ("reservoir sampling"). This
+    uses Li's "Algorithm L", which only needs random numbers for the items which
+    end up in the sample. */
+typedef struct {
+    size_t capacity; /**< The size of the sample */
+    size_t seen; /**< The number of items seen so far */
+    size_t next; /**< The index of the next item which goes in the sample */
+    double w; /**< The state of Algorithm L */
+} u_rand_reservoir_t;
+
+/** Sets up \p reservoir to pick a sample of \p capacity items. */
+void     u_rand_reservoir_init(u_rand_reservoir_t* reservoir, size_t capacity);
+/** Call this for each item in the stream.
+    \returns The index in the sample where the item should be put (replacing what was
+    there), or `(size_t)-1` if it isn't part of the sample. */
+size_t   u_rand_reservoir_next(u_rand_reservoir_t* reservoir);
+
 #endif /* CUTILS_MATH_RAND_H */
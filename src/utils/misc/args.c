@@ -28,7 +28,7 @@ static char** argv;
 
 static int is_sd(const char* str) {
     if (!str[0]) return 0;
-    return str[0] == '-' && str[1] != '-';
+    return str[0] == '-' && str[1] && str[1] != '-'; /* (- on its own is a lone argument) */
 }
 
 static int is_dd(const char* str) {
@@ -202,7 +202,7 @@ char** u_args_lone_get(char** from) {
             return NULL;
         }
         char* arg = argv[index];
-        if (arg[0] == '-') {
+        if (is_sd(arg) || is_dd(arg)) {
             index++;
             continue;
         }
@@ -0,0 +1,68 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200112L /* For getpid */
+#define FILES_POSIX
+#endif
+#include "files.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef FILES_POSIX
+#include <unistd.h>
+#endif
+
+#include "error.h"
+
+u_bool_t u_files_same(const char* a, const char* b) {
+    struct stat sa, sb;
+    if (stat(a, &sa) || stat(b, &sb))
+        return U_FALSE; /* (at least one of them doesn't exist yet) */
+    if (sa.st_ino == 0 && sb.st_ino == 0)
+        return !strcmp(a, b); /* (no inode numbers, e.g. on Windows) */
+    return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+char* u_files_temp_name(const char* filename) {
+    const char* base = strrchr(filename, '/');
+    size_t dir_len = base ? (size_t)(base + 1 - filename) : 0;
+    unsigned long id = 0;
+    char* temp = malloc(strlen(filename) + 64);
+    if (!temp) {
+        u_error_nomem();
+        return NULL;
+    }
+    #ifdef FILES_POSIX
+    id = (unsigned long)getpid(); /* (so processes writing to the same file don't collide) */
+    #endif
+    memcpy(temp, filename, dir_len);
+    sprintf(temp + dir_len, ".tmp%lu-%s", id, filename + dir_len);
+    return temp;
+}
+
+int u_files_replace(const char* from, const char* to) {
+    #ifndef FILES_POSIX
+    remove(to); /* (rename doesn't replace files everywhere) */
+    #endif
+    if (rename(from, to))
+        return u_error_set(U_ERROR_ACCESS, "Failed to replace the output file.");
+    return U_ERROR_SUCCESS;
+}
@@ -0,0 +1,41 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file files.h
+\brief Telling whether two names are the same file
+
+Reading a file while writing to it (e.g. `ColorReducer x.png x.png`) would truncate
+it before it has been read, so the reducers check for this first, and ColorReducer's
+command line writes to a temporary file next to the output and renames it over the
+output at the end instead.
+*/
+#ifndef CUTILS_MISC_FILES_H
+#define CUTILS_MISC_FILES_H
+
+#include "types.h"
+
+/** \returns Whether \p a and \p b are names of the same existing file (even if the names
+    are different, e.g. `x.png` and `./x.png`, or through a link). */
+u_bool_t u_files_same(const char* a, const char* b);
+/** \returns A new name (to be freed with `free`) for a temporary file in the same directory
+    as \p filename, which ends with the same name (so it has the same extension), or `NULL`
+    if there's no memory left. */
+char*    u_files_temp_name(const char* filename);
+/** Renames \p from to \p to, replacing \p to if it exists. \returns An error code. */
+int      u_files_replace(const char* from, const char* to);
+
+#endif /* CUTILS_MISC_FILES_H */
@@ -0,0 +1,114 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _POSIX_C_SOURCE 200112L
+#include "threads.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "error.h"
+
+static size_t threads_count = 0;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t next, n, block;
+    u_threads_fn_t fn;
+    void* arg;
+    int err;
+} threads_job_t;
+
+void u_threads_count_set(size_t nthreads) {
+    threads_count = nthreads;
+}
+
+size_t u_threads_count_get(void) {
+    if (threads_count) return threads_count;
+    #ifdef _SC_NPROCESSORS_ONLN
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nprocs > 0) return nprocs;
+    #endif
+    return 1;
+}
+
+static void* threads_worker(void* arg) {
+    threads_job_t* job = arg;
+    while (1) {
+        pthread_mutex_lock(&job->mutex);
+        if (job->err || job->next >= job->n) {
+            pthread_mutex_unlock(&job->mutex);
+            return NULL;
+        }
+        size_t from = job->next;
+        size_t to = job->n - from < job->block ? job->n : from + job->block;
+        job->next = to;
+        pthread_mutex_unlock(&job->mutex);
+
+        int err = job->fn(job->arg, from, to);
+        if (err) {
+            pthread_mutex_lock(&job->mutex);
+            if (!job->err) job->err = err;
+            pthread_mutex_unlock(&job->mutex);
+            return NULL;
+        }
+    }
+}
+
+int u_threads_for(size_t n, size_t block, u_threads_fn_t fn, void* arg) {
+    if (n == 0) return U_ERROR_SUCCESS;
+    if (block == 0) block = 1;
+    size_t nblocks = (n + block - 1) / block;
+    size_t nthreads = u_threads_count_get();
+    if (nthreads > nblocks) nthreads = nblocks;
+    if (nthreads <= 1) {
+        size_t from;
+        for (from = 0; from < n; from += block) {
+            int err = fn(arg, from, n - from < block ? n : from + block);
+            if (err) return err;
+        }
+        return U_ERROR_SUCCESS;
+    }
+
+    pthread_t* threads = malloc((nthreads - 1) * sizeof(*threads));
+    if (!threads)
+        return u_error_nomem();
+
+    threads_job_t job;
+    pthread_mutex_init(&job.mutex, NULL);
+    job.next = 0;
+    job.n = n;
+    job.block = block;
+    job.fn = fn;
+    job.arg = arg;
+    job.err = U_ERROR_SUCCESS;
+
+    size_t i, nstarted = 0;
+    for (i = 0; i < nthreads - 1; i++) {
+        if (pthread_create(&threads[i], NULL, threads_worker, &job))
+            break; /* Just use the threads we managed to start */
+        nstarted++;
+    }
+    threads_worker(&job);
+    for (i = 0; i < nstarted; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&job.mutex);
+    free(threads);
+    return job.err;
+}
@@ -0,0 +1,49 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of cutils.
+
+    cutils is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    cutils is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with cutils.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file threads.h
+\brief Running loops on multiple threads
+
+A very small wrapper around pthreads. \ref u_threads_for splits the range
+`[0, n)` into blocks which are handed out to a fixed number of worker threads
+as they finish their previous block, so blocks which take different amounts of
+time still keep every thread busy.
+*/
+#ifndef CUTILS_MISC_THREADS_H
+#define CUTILS_MISC_THREADS_H
+
+#include <stddef.h>
+
+/** A function which processes the indices `from` to `to` (not including `to`).
+    \returns An error code. */
+typedef int (*u_threads_fn_t)(void* arg, size_t from, size_t to);
+
+/** Sets the number of threads used by \ref u_threads_for. 0 means use one
+    thread per online processor (the default). */
+void   u_threads_count_set(size_t nthreads);
+/** \returns The number of threads which \ref u_threads_for will use. */
+size_t u_threads_count_get(void);
+/**
+Calls \p fn on every block of \p block indices in `[0, n)` (the last block may
+be smaller), using up to \ref u_threads_count_get threads. The calling thread
+is one of the workers. Blocks are not processed in any particular order.
+\returns An error code. If a call to \p fn fails, no more blocks are started
+and the first error code is returned.
+*/
+int    u_threads_for(size_t n, size_t block, u_threads_fn_t fn, void* arg);
+
+#endif /* CUTILS_MISC_THREADS_H */
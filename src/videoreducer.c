@@ -0,0 +1,564 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of ColorReducer.
+
+    ColorReducer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ColorReducer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _POSIX_C_SOURCE 200112L /* For clock_gettime */
+#include "videoreducer.h"
+
+#include "kmeans.h"
+#include "utils/filetypes/y4m.h"
+#include "utils/misc/error.h"
+#include "utils/math/rand.h"
+#include "utils/misc/threads.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#define VIDEO_HISTOGRAM_BINS 8 /* Scene cuts are found with a histogram of Y, Cb and Cr, with this many bins for each */
+#define VIDEO_HISTOGRAM_SIZE (VIDEO_HISTOGRAM_BINS * VIDEO_HISTOGRAM_BINS * VIDEO_HISTOGRAM_BINS)
+
+typedef struct {
+    const u_y4m_t* y4m;
+    const u_u8_t* in;
+    u_u8_t* out;
+    cr_kmeans_map_t* map;
+    const float* means;
+    size_t data_size; /* 3 (Y, Cb, Cr), or 1 for mono video */
+} video_remap_t;
+
+typedef struct {
+    float* samples; /* A sample of the pixels of the current frame */
+    size_t nsamples;
+    float scene_cut; /* How different the colors of two frames have to be to retrain from scratch */
+    float histogram[VIDEO_HISTOGRAM_SIZE]; /* The number of pixels of the current frame in each bin */
+    float last_histogram[VIDEO_HISTOGRAM_SIZE]; /* The same for the previous frame */
+    u_bool_t has_means; /* Whether there are means from the previous frame to start from */
+    size_t ncuts;
+} video_adapt_t;
+
+typedef enum {
+    VIDEO_SLOT_FREE,
+    VIDEO_SLOT_READING,
+    VIDEO_SLOT_READ, /* Waiting to be mapped */
+    VIDEO_SLOT_MAPPING,
+    VIDEO_SLOT_MAPPED /* Waiting to be written */
+} video_slot_state_t;
+
+typedef struct {
+    video_slot_state_t state;
+    size_t frame; /* The frame number */
+    u_u8_t* in;
+    u_u8_t* out;
+    float* means; /* With --per-frame, the means of this frame (otherwise NULL, and every frame uses the same means) */
+    cr_kmeans_map_t map;
+    u_bool_t has_map;
+} video_slot_t;
+
+typedef struct {
+    /* The pipeline: the reader thread reads frames into free slots (and trains on them, with --per-frame),
+       the mapper threads map them (several frames at once, in any order), and the calling thread writes
+       them out in order. */
+    pthread_mutex_t mutex;
+    pthread_cond_t changed; /* Broadcast whenever a slot changes state */
+    video_slot_t* slots;
+    size_t nslots;
+    size_t queue_depth; /* The most frames waiting to be mapped, and (before another is started) to be written */
+    size_t nread; /* The number of frames read so far */
+    size_t nwritten; /* The number of frames written so far (so the next one to write) */
+    u_bool_t done_reading;
+    u_bool_t stop; /* Set if something went wrong, to stop every thread */
+    int err; /* The error from the reader thread */
+
+    /* For the reader thread */
+    u_y4m_t* reader;
+    const u_u8_t* buffered; /* The frames which were held in memory for training */
+    size_t nbuffered;
+    video_adapt_t* adapt; /* NULL unless training each frame */
+    float* means; /* The means being trained (or used by every frame) */
+    cr_kmeans_map_t* map; /* The map used by every frame (NULL if training each frame) */
+    size_t data_size, ncolors, iterations;
+    float epsilon;
+
+    /* Statistics (see cr_reduce_video_stream's timing parameter) */
+    double read_seconds, map_seconds, write_seconds;
+    size_t read_queued, write_queued; /* Total queue lengths seen by each frame as it's written */
+} video_pipeline_t;
+
+static double video_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void video_pixel_get(const u_y4m_t* y4m, const u_u8_t* frame, size_t x, size_t y, float* point) {
+    /* The (Y, Cb, Cr) of pixel (x, y), from 0 to 1 */
+    size_t luma_size = (size_t)y4m->width * y4m->height;
+    point[0] = frame[y * y4m->width + x] / 256.0f;
+    if (!y4m->mono) {
+        size_t c = (y >> y4m->chroma_shift_y) * y4m->chroma_width + (x >> y4m->chroma_shift_x);
+        point[1] = frame[luma_size + c] / 256.0f;
+        point[2] = frame[luma_size + y4m->chroma_width * y4m->chroma_height + c] / 256.0f;
+    }
+}
+
+static u_u8_t video_byte(float value) {
+    value = 256 * value + 0.5f;
+    if (value <= 0) return 0;
+    if (value >= 255) return 255;
+    return (u_u8_t)value;
+}
+
+static void video_histogram_add(float* histogram, const float* point) {
+    /* Counts point in histogram, split between the 8 bins around it by how close it is to the middle
+       of each one, so that a color which changes a little (e.g. in a fade) only moves a little of its
+       count to other bins, rather than all of it when it crosses the edge of a bin */
+    size_t bins[3][2], i, a, b, c;
+    float weights[3][2];
+    for (i = 0; i < 3; i++) {
+        float p = point[i] * VIDEO_HISTOGRAM_BINS - 0.5f, lower = (float)floor(p);
+        long bin = (long)lower;
+        weights[i][1] = p - lower;
+        weights[i][0] = 1 - weights[i][1];
+        bins[i][0] = bin < 0 ? 0 : (size_t)bin;
+        bins[i][1] = bin + 1 >= VIDEO_HISTOGRAM_BINS ? VIDEO_HISTOGRAM_BINS - 1 : (size_t)(bin + 1);
+    }
+    for (a = 0; a < 2; a++)
+        for (b = 0; b < 2; b++)
+            for (c = 0; c < 2; c++)
+                histogram[(bins[0][a] * VIDEO_HISTOGRAM_BINS + bins[1][b]) * VIDEO_HISTOGRAM_BINS + bins[2][c]]
+                    += weights[0][a] * weights[1][b] * weights[2][c];
+}
+
+static void video_frame_sample(const u_y4m_t* y4m, const u_u8_t* frame, u_rand_reservoir_t* reservoir, float* samples, size_t data_size, float* histogram) {
+    /* Adds the pixels of frame to the reservoir sample (and counts them in histogram, if it isn't NULL) */
+    size_t x, y;
+    for (y = 0; y < (size_t)y4m->height; y++) {
+        for (x = 0; x < (size_t)y4m->width; x++) {
+            size_t slot = u_rand_reservoir_next(reservoir);
+            if (slot != (size_t)-1)
+                video_pixel_get(y4m, frame, x, y, &samples[data_size * slot]);
+            if (histogram) {
+                float point[3] = {0, 0, 0};
+                video_pixel_get(y4m, frame, x, y, point);
+                video_histogram_add(histogram, point);
+            }
+        }
+    }
+}
+
+static int video_remap(void* arg, size_t from, size_t to) {
+    /* Maps the pixels covered by rows from..to of chroma samples (or rows of pixels, for mono video) */
+    video_remap_t* remap = arg;
+    const u_y4m_t* y4m = remap->y4m;
+    const u_u8_t* in = remap->in;
+    u_u8_t* out = remap->out;
+    int sx = y4m->chroma_shift_x, sy = y4m->chroma_shift_y;
+    size_t w = y4m->width, h = y4m->height;
+    size_t ncolumns = (w + ((size_t)1 << sx) - 1) >> sx;
+    size_t luma_size = w * h, chroma_size = y4m->chroma_width * y4m->chroma_height;
+    size_t cx, cy, x, y, index = 0;
+    u_u32_t last = 0xFFFFFFFF; /* Neighboring pixels are often the same color, so remember the last one */
+    float point[3];
+    for (cy = from; cy < to; cy++) {
+        size_t y_end = (cy + 1) << sy;
+        if (y_end > h) y_end = h;
+        for (cx = 0; cx < ncolumns; cx++) {
+            size_t x_end = (cx + 1) << sx, c = cy * y4m->chroma_width + cx, n = 0;
+            u_u32_t chroma = 0;
+            float cb = 0, cr = 0;
+            if (x_end > w) x_end = w;
+            if (!y4m->mono)
+                chroma = (u_u32_t)in[luma_size + c] << 16 | (u_u32_t)in[luma_size + chroma_size + c] << 8;
+            for (y = cy << sy; y < y_end; y++) {
+                for (x = cx << sx; x < x_end; x++) {
+                    const float* mean;
+                    u_u32_t yuv = chroma | in[y * w + x];
+                    if (yuv != last) {
+                        video_pixel_get(y4m, in, x, y, point);
+                        index = cr_kmeans_map_nearest(remap->map, point);
+                        last = yuv;
+                    }
+                    mean = &remap->means[index * remap->data_size];
+                    out[y * w + x] = video_byte(mean[0]);
+                    if (!y4m->mono) {
+                        cb += mean[1];
+                        cr += mean[2];
+                        n++;
+                    }
+                }
+            }
+            if (n) {
+                out[luma_size + c] = video_byte(cb / n);
+                out[luma_size + chroma_size + c] = video_byte(cr / n);
+            }
+        }
+    }
+    return U_ERROR_SUCCESS;
+}
+
+static int video_frame_train(video_adapt_t* adapt, const u_y4m_t* y4m, const u_u8_t* frame, size_t data_size, size_t ncolors, float epsilon, size_t iterations, float* means) {
+    /* Trains the means on a sample of frame, starting from the last frame's means unless there's been a scene cut */
+    u_rand_reservoir_t reservoir;
+    float distance = 0;
+    size_t i;
+    memcpy(adapt->last_histogram, adapt->histogram, sizeof(adapt->histogram));
+    memset(adapt->histogram, 0, sizeof(adapt->histogram));
+    u_rand_reservoir_init(&reservoir, adapt->nsamples);
+    video_frame_sample(y4m, frame, &reservoir, adapt->samples, data_size, adapt->histogram);
+    for (i = 0; i < VIDEO_HISTOGRAM_SIZE; i++)
+        distance += fabs(adapt->histogram[i] - adapt->last_histogram[i]);
+    distance /= 2 * (float)y4m->width * y4m->height; /* (from 0, for the same colors, to 1, for completely different ones) */
+    if (adapt->has_means && distance <= adapt->scene_cut)
+        return cr_kmeans_train_from(adapt->samples, adapt->nsamples, data_size, ncolors, 0, epsilon, iterations, means);
+    /* The first frame, or a new scene, so start again */
+    adapt->has_means = U_TRUE;
+    adapt->ncuts++;
+    return cr_kmeans_train(adapt->samples, adapt->nsamples, data_size, ncolors, 0, epsilon, iterations, means);
+}
+
+static int video_slot_read(video_pipeline_t* pipeline, video_slot_t* slot, size_t frame, u_bool_t* end) {
+    /* Reads frame number `frame` into slot, and trains on it with --per-frame */
+    size_t frame_size = pipeline->reader->frame_size;
+    int err = U_ERROR_SUCCESS;
+    *end = U_FALSE;
+    if (frame < pipeline->nbuffered)
+        memcpy(slot->in, &pipeline->buffered[frame * frame_size], frame_size);
+    else
+        err = u_y4m_frame_read(pipeline->reader, slot->in, end);
+    if (err || *end || !pipeline->adapt) return err;
+    if (slot->has_map) {
+        cr_kmeans_map_destroy(&slot->map);
+        slot->has_map = U_FALSE;
+    }
+    err = video_frame_train(pipeline->adapt, pipeline->reader, slot->in, pipeline->data_size, pipeline->ncolors,
+                            pipeline->epsilon, pipeline->iterations, pipeline->means);
+    if (err) return err;
+    memcpy(slot->means, pipeline->means, pipeline->ncolors * pipeline->data_size * sizeof(*slot->means));
+    err = cr_kmeans_map_init(&slot->map, slot->means, pipeline->ncolors, pipeline->data_size);
+    slot->has_map = !err;
+    return err;
+}
+
+static size_t video_slots_count(const video_pipeline_t* pipeline, video_slot_state_t state) {
+    size_t i, n = 0;
+    for (i = 0; i < pipeline->nslots; i++)
+        if (pipeline->slots[i].state == state)
+            n++;
+    return n;
+}
+
+static void* video_reader_thread(void* arg) {
+    video_pipeline_t* pipeline = arg;
+    size_t frame, i;
+    for (frame = 0; ; frame++) {
+        video_slot_t* slot = NULL;
+        u_bool_t end;
+        int err;
+        pthread_mutex_lock(&pipeline->mutex);
+        while (!pipeline->stop) {
+            if (video_slots_count(pipeline, VIDEO_SLOT_READ) < pipeline->queue_depth)
+                for (i = 0; i < pipeline->nslots && !slot; i++)
+                    if (pipeline->slots[i].state == VIDEO_SLOT_FREE)
+                        slot = &pipeline->slots[i];
+            if (slot) break;
+            pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+        }
+        if (!slot) {
+            pthread_mutex_unlock(&pipeline->mutex);
+            break;
+        }
+        slot->state = VIDEO_SLOT_READING;
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        double start = video_seconds();
+        err = video_slot_read(pipeline, slot, frame, &end);
+
+        pthread_mutex_lock(&pipeline->mutex);
+        pipeline->read_seconds += video_seconds() - start;
+        if (err || end) {
+            slot->state = VIDEO_SLOT_FREE;
+            pipeline->done_reading = U_TRUE;
+            if (err) {
+                pipeline->err = err;
+                pipeline->stop = U_TRUE;
+            }
+        } else {
+            slot->frame = frame;
+            slot->state = VIDEO_SLOT_READ;
+            pipeline->nread = frame + 1;
+        }
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (err || end) break;
+    }
+    return NULL;
+}
+
+static void* video_mapper_thread(void* arg) {
+    video_pipeline_t* pipeline = arg;
+    const u_y4m_t* y4m = pipeline->reader;
+    size_t i;
+    pthread_mutex_lock(&pipeline->mutex);
+    while (!pipeline->stop) {
+        /* Take the oldest frame waiting, which the writer will want first, unless queue_depth mapped
+           frames are already waiting to be written (but never hold up the one the writer is waiting for) */
+        video_slot_t* slot = NULL;
+        for (i = 0; i < pipeline->nslots; i++)
+            if (pipeline->slots[i].state == VIDEO_SLOT_READ && (!slot || pipeline->slots[i].frame < slot->frame))
+                slot = &pipeline->slots[i];
+        if (!slot && pipeline->done_reading) break;
+        if (slot && slot->frame != pipeline->nwritten
+            && video_slots_count(pipeline, VIDEO_SLOT_MAPPED) >= pipeline->queue_depth)
+            slot = NULL;
+        if (!slot) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+            continue;
+        }
+        slot->state = VIDEO_SLOT_MAPPING;
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        double start = video_seconds();
+        video_remap_t remap;
+        remap.y4m = y4m;
+        remap.in = slot->in;
+        remap.out = slot->out;
+        remap.map = slot->has_map ? &slot->map : pipeline->map;
+        remap.means = slot->means ? slot->means : pipeline->means;
+        remap.data_size = pipeline->data_size;
+        video_remap(&remap, 0, y4m->mono ? (size_t)y4m->height : y4m->chroma_height);
+
+        pthread_mutex_lock(&pipeline->mutex);
+        pipeline->map_seconds += video_seconds() - start;
+        slot->state = VIDEO_SLOT_MAPPED;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    return NULL;
+}
+
+static int video_pipeline_run(video_pipeline_t* pipeline, u_y4m_t* writer) {
+    /* Runs the pipeline, writing the frames on this thread. Returns an error code. */
+    size_t frame_size = pipeline->reader->frame_size, nmappers = u_threads_count_get();
+    size_t i, next = 0, nthreads = 0;
+    int err = U_ERROR_SUCCESS;
+    pipeline->nslots = 2 * pipeline->queue_depth + nmappers; /* (enough for full queues, with every mapper busy) */
+    pipeline->slots = calloc(pipeline->nslots, sizeof(*pipeline->slots));
+    pipeline->nread = pipeline->nwritten = 0;
+    pipeline->done_reading = pipeline->stop = U_FALSE;
+    pipeline->err = U_ERROR_SUCCESS;
+    pipeline->read_seconds = pipeline->map_seconds = pipeline->write_seconds = 0;
+    pipeline->read_queued = pipeline->write_queued = 0;
+    pthread_t* threads = malloc((nmappers + 1) * sizeof(*threads));
+    if (!pipeline->slots || !threads) {
+        free(pipeline->slots);
+        free(threads);
+        return u_error_nomem();
+    }
+    for (i = 0; i < pipeline->nslots; i++) {
+        video_slot_t* slot = &pipeline->slots[i];
+        slot->state = VIDEO_SLOT_FREE;
+        slot->in = malloc(frame_size);
+        slot->out = malloc(frame_size);
+        if (pipeline->adapt)
+            slot->means = malloc(pipeline->ncolors * pipeline->data_size * sizeof(*slot->means));
+        if (!slot->in || !slot->out || (pipeline->adapt && !slot->means))
+            err = u_error_nomem();
+    }
+
+    if (!err) {
+        pthread_mutex_init(&pipeline->mutex, NULL);
+        pthread_cond_init(&pipeline->changed, NULL);
+        if (pthread_create(&threads[nthreads], NULL, video_reader_thread, pipeline) == 0)
+            nthreads++;
+        while (nthreads && nthreads <= nmappers
+               && pthread_create(&threads[nthreads], NULL, video_mapper_thread, pipeline) == 0)
+            nthreads++;
+        if (nthreads <= nmappers)
+            err = u_error_set(U_ERROR_SYSTEM, "Failed to start video threads.");
+
+        pthread_mutex_lock(&pipeline->mutex);
+        while (!err && !pipeline->stop) {
+            video_slot_t* slot = NULL;
+            for (i = 0; i < pipeline->nslots && !slot; i++)
+                if (pipeline->slots[i].state == VIDEO_SLOT_MAPPED && pipeline->slots[i].frame == next)
+                    slot = &pipeline->slots[i];
+            if (!slot) {
+                if (pipeline->done_reading && next == pipeline->nread) break;
+                pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+                continue;
+            }
+            pipeline->read_queued += video_slots_count(pipeline, VIDEO_SLOT_READ);
+            pipeline->write_queued += video_slots_count(pipeline, VIDEO_SLOT_MAPPED);
+            pthread_mutex_unlock(&pipeline->mutex);
+
+            double start = video_seconds();
+            err = u_y4m_frame_write(writer, slot->out);
+
+            pthread_mutex_lock(&pipeline->mutex);
+            pipeline->write_seconds += video_seconds() - start;
+            slot->state = VIDEO_SLOT_FREE;
+            pipeline->nwritten = ++next;
+            pthread_cond_broadcast(&pipeline->changed);
+        }
+        if (err) pipeline->stop = U_TRUE;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        for (i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+        pthread_cond_destroy(&pipeline->changed);
+        pthread_mutex_destroy(&pipeline->mutex);
+        if (!err) err = pipeline->err;
+    }
+
+    for (i = 0; i < pipeline->nslots; i++) {
+        video_slot_t* slot = &pipeline->slots[i];
+        if (slot->has_map) cr_kmeans_map_destroy(&slot->map);
+        free(slot->in);
+        free(slot->out);
+        free(slot->means);
+    }
+    free(pipeline->slots);
+    free(threads);
+    return err;
+}
+
+int cr_reduce_video_stream(FILE* in, FILE* out, size_t ncolors, size_t train_frames, float scene_cut, size_t queue_depth, float take, float epsilon, size_t iterations, FILE* timing) {
+    u_y4m_t reader, writer;
+    int err = u_y4m_read_start(&reader, in);
+    if (err) return err;
+    size_t frame_size = reader.frame_size, data_size = reader.mono ? 1 : 3;
+    size_t npixels = (size_t)reader.width * reader.height;
+    u_bool_t per_frame = scene_cut >= 0;
+    if (train_frames == 0) train_frames = 1;
+    if (take <= 0 || take >= 1) take = 1;
+
+    /* If the input is a file, the training frames can be spread through it, and then it can be read again */
+    long start = per_frame ? -1 : ftell(in);
+    u_bool_t seekable = start >= 0 && !fseek(in, start, SEEK_SET);
+    u_bool_t end = U_FALSE;
+    size_t nframes = 0, f, t;
+    if (seekable) {
+        while (!err) {
+            err = u_y4m_frame_skip(&reader, &end);
+            if (err || end) break;
+            nframes++;
+        }
+        if (!err && fseek(in, start, SEEK_SET))
+            err = u_error_set(U_ERROR_ACCESS, "Failed to seek in Y4M file.");
+        if (err) return err;
+        if (train_frames > nframes) train_frames = nframes;
+    }
+    if (per_frame) train_frames = 1; /* (each frame is trained on as it's mapped) */
+
+    size_t nsamples = train_frames * npixels * take;
+    if (nsamples > CR_VIDEO_MAX_SAMPLES) nsamples = CR_VIDEO_MAX_SAMPLES;
+    if (nsamples < ncolors) nsamples = ncolors;
+    if (per_frame && nsamples > npixels) nsamples = npixels;
+    /* With a pipe, the training frames are kept, so they can be mapped afterwards */
+    u_u8_t* frames = malloc((seekable || per_frame ? 1 : train_frames) * frame_size);
+    float* samples = malloc(nsamples * data_size * sizeof(*samples));
+    float* means = malloc(ncolors * data_size * sizeof(*means));
+    if (!frames || !samples || !means) {
+        free(frames);
+        free(samples);
+        free(means);
+        return u_error_nomem();
+    }
+
+    /* Pass 1: Pick the pixels to train on */
+    u_rand_reservoir_t reservoir;
+    u_rand_reservoir_init(&reservoir, nsamples);
+    size_t nbuffered = 0;
+    if (per_frame) {
+        /* Nothing to do yet */
+    } else if (seekable) {
+        for (t = 0, f = 0; t < train_frames && !err; t++, f++) {
+            /* Training frame t is frame t*nframes/train_frames */
+            for (; f < t * nframes / train_frames && !err; f++)
+                err = u_y4m_frame_skip(&reader, &end);
+            if (!err) err = u_y4m_frame_read(&reader, frames, &end);
+            if (!err) video_frame_sample(&reader, frames, &reservoir, samples, data_size, NULL);
+        }
+        if (!err && fseek(in, start, SEEK_SET))
+            err = u_error_set(U_ERROR_ACCESS, "Failed to seek in Y4M file.");
+    } else {
+        while (nbuffered < train_frames && !err) {
+            u_u8_t* frame = &frames[nbuffered * frame_size];
+            err = u_y4m_frame_read(&reader, frame, &end);
+            if (err || end) break;
+            video_frame_sample(&reader, frame, &reservoir, samples, data_size, NULL);
+            nbuffered++;
+        }
+    }
+    if (reservoir.seen < nsamples && !per_frame) nsamples = reservoir.seen;
+
+    u_bool_t has_map = U_FALSE;
+    cr_kmeans_map_t map;
+    if (!err && nsamples && !per_frame) {
+        err = cr_kmeans_train(samples, nsamples, data_size, ncolors, 0, epsilon, iterations, means);
+        if (!err) err = cr_kmeans_map_init(&map, means, ncolors, data_size);
+        has_map = !err;
+    }
+
+    /* Pass 2: Map the frames in a pipeline, and write them straight away */
+    video_adapt_t adapt;
+    adapt.samples = samples;
+    adapt.nsamples = nsamples;
+    adapt.scene_cut = scene_cut;
+    adapt.has_means = U_FALSE;
+    adapt.ncuts = 0;
+    memset(adapt.histogram, 0, sizeof(adapt.histogram));
+    if (!err) err = u_y4m_write_start(&writer, out, &reader);
+    if (!err && (has_map || per_frame)) {
+        video_pipeline_t pipeline;
+        pipeline.reader = &reader;
+        pipeline.buffered = frames;
+        pipeline.nbuffered = nbuffered;
+        pipeline.adapt = per_frame ? &adapt : NULL;
+        pipeline.means = means;
+        pipeline.map = per_frame ? NULL : &map;
+        pipeline.data_size = data_size;
+        pipeline.ncolors = ncolors;
+        pipeline.epsilon = epsilon;
+        pipeline.iterations = iterations;
+        pipeline.queue_depth = queue_depth ? queue_depth : 1;
+        double start_time = video_seconds();
+        err = video_pipeline_run(&pipeline, &writer);
+        double seconds = video_seconds() - start_time;
+        if (!err && timing && pipeline.nread) {
+            size_t nmappers = pipeline.nslots - 2 * pipeline.queue_depth;
+            fprintf(timing, "%lu frames in %.3f s (%.2f frames per second). Time busy: reader %.0f%%, mappers %.0f%% (of %lu threads), writer %.0f%%.\n"
+                    "Average frames waiting: %.2f to be mapped (of at most %lu), %.2f to be written (mapping pauses at %lu).\n",
+                    (unsigned long)pipeline.nread, seconds, pipeline.nread / seconds,
+                    100 * pipeline.read_seconds / seconds, 100 * pipeline.map_seconds / (seconds * nmappers), (unsigned long)nmappers,
+                    100 * pipeline.write_seconds / seconds,
+                    (double)pipeline.read_queued / pipeline.nread, (unsigned long)pipeline.queue_depth,
+                    (double)pipeline.write_queued / pipeline.nread, (unsigned long)pipeline.queue_depth);
+        }
+        if (per_frame && !err)
+            fprintf(stderr, "Trained from scratch on %lu of %lu frames (the first, and scene cuts).\n", (unsigned long)adapt.ncuts, (unsigned long)pipeline.nread);
+    }
+
+    if (has_map) cr_kmeans_map_destroy(&map);
+    free(frames);
+    free(samples);
+    free(means);
+    return err;
+}
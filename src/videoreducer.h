@@ -0,0 +1,77 @@
+/*
+    Copyright (C) 2019 Leo Tenenbaum
+    This file is part of ColorReducer.
+
+    ColorReducer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ColorReducer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ColorReducer.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/** \file videoreducer.h
+\brief Reduces the number of colors in a video.
+
+Videos are read and written as YUV4MPEG2 (see utils/filetypes/y4m.h), so they can
+be piped straight from and to ffmpeg, one frame at a time:
+
+    ffmpeg -i in.mp4 -f yuv4mpegpipe - | ColorReducer --video - - -k 8 | ffmpeg -i - out.mp4
+
+Each pixel is treated as a (Y, Cb, Cr) point, using the chroma sample it's covered by.
+k-means is run on pixels sampled from a few frames, then every frame is mapped to the
+means: the Y of each pixel comes from its mean, and each chroma sample is the average of
+the chroma of the means of the pixels it covers (so with 4:4:4 video, the output has
+exactly k colors; with subsampled chroma, it can have a few more at the edges between them).
+*/
+#ifndef COLORREDUCER_VIDEOREDUCER_H
+#define COLORREDUCER_VIDEOREDUCER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/** The most pixels \ref cr_reduce_video_stream will train k-means on. */
+#define CR_VIDEO_MAX_SAMPLES ((size_t)1 << 20)
+/** The default number of frames to train on. */
+#define CR_VIDEO_TRAIN_FRAMES 8
+/** The default number of frames waiting between each stage of the video pipeline. */
+#define CR_VIDEO_QUEUE_DEPTH 4
+/** The default histogram difference between frames which counts as a scene cut. */
+#define CR_VIDEO_SCENE_CUT 0.3f
+
+/**
+Reduces the number of colors in the Y4M video read from \p in to \p ncolors, writing it to \p out.
+If \p in can be seeked (a file), k-means is trained on \p train_frames frames spread evenly
+through the video, and then the video is read again from the start and mapped a frame at a
+time. Otherwise (a pipe), the first \p train_frames frames are held in memory and trained on.
+Either way, the video is never all in memory, and nothing is written to disk apart from \p out.
+
+The frames are then mapped in a pipeline: one thread reads them, one thread per processor (see
+utils/misc/threads.h) maps them, several frames at once, and the calling thread writes them
+back in order. So the frame rate is close to that of the slowest stage, rather than that
+of all of them added up.
+
+If \p scene_cut isn't negative, the means are trained again for every frame instead (on a
+sample of its pixels), starting from the previous frame's means, which usually only takes an
+iteration or two, and keeps the colors from flickering. If a frame's colors are very different
+from the previous frame's (a histogram of them differs by more than \p scene_cut, from 0 to 1),
+it's taken to be a new scene, and the means are trained from scratch. Then nothing is held back,
+so each frame is written as soon as it has been read.
+\param queue_depth The most frames which can be waiting to be mapped. Also, while this many mapped
+    frames are waiting to be written, no more are started (apart from the one the writer is waiting
+    for), so there can only be more than this if they were already being mapped. So at most
+    `2*queue_depth` frames, plus one per mapping thread, are in memory.
+\param timing If this is not `NULL`, statistics about the pipeline are written to it at the end:
+    how much of the time each stage was busy, and how full the queues were on average.
+\param take The fraction of the pixels of the training frames to train on. If this is not
+    between 0 and 1, every pixel is (up to \ref CR_VIDEO_MAX_SAMPLES).
+\returns An error code.
+*/
+int cr_reduce_video_stream(FILE* in, FILE* out, size_t ncolors, size_t train_frames, float scene_cut, size_t queue_depth, float take, float epsilon, size_t iterations, FILE* timing);
+
+#endif /* COLORREDUCER_VIDEOREDUCER_H */
@@ -21,24 +21,333 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 
 #include "utils/filetypes/image.h"
 #include "utils/containers/kdtree.h"
 #include "utils/math/rand.h"
 #include "utils/misc/error.h"
+#include "utils/misc/threads.h"
+#include "utils/misc/types_exact.h"
+
+#define VORONOI_NO_SEED ((u_u32_t)-1)
+#define VORONOI_BLOCK 64 /* Number of rows/columns given to a thread at a time */
+#define VORONOI_TILE_SIZE 32 /* Width/height of the tiles used by CR_VORONOI_KDTREE */
+#define VORONOI_MAX_CANDIDATES 16 /* Tiles with more candidate seeds than this get split up */
+#define VORONOI_BAND_HEIGHT 256 /* Number of rows cr_voronoi_random keeps in memory */
+#define VORONOI_ANIMATION_TILE_SIZE 16 /* Width/height of the tiles used by cr_voronoi_animate */
+#define VORONOI_ANIMATION_SLACK 4.0f /* How far seeds can move before cr_voronoi_animate remakes its candidate lists */
 
 typedef struct {
     float point[2];
     u_color_t color;
 } point_t;
 
-static int voronoify_image(u_image_t* image) {
+typedef struct {
+    int w, h;
+    const point_t* seeds;
+    u_u32_t* labels; /* labels[y*w+x] is the index of the closest seed found so far, or VORONOI_NO_SEED */
+    u_u32_t* dist; /* dist[y*w+x] is the vertical distance to that seed */
+    u_color_t** pixels;
+} edt_state_t;
+
+static int edt_columns(void* arg, size_t from, size_t to) {
+    /* Finds the closest seed in the same column for columns [from, to).
+    This goes row by row (rather than column by column) so that it reads memory in order. */
+    edt_state_t* state = arg;
+    size_t w = state->w, h = state->h, x, y;
+    u_u32_t* labels = state->labels;
+    u_u32_t* dist = state->dist;
+    /* Closest seed above */
+    for (y = 0; y < h; y++) {
+        for (x = from; x < to; x++) {
+            size_t i = y*w+x;
+            if (labels[i] != VORONOI_NO_SEED) {
+                dist[i] = 0;
+            } else if (y > 0 && labels[i-w] != VORONOI_NO_SEED) {
+                labels[i] = labels[i-w];
+                dist[i] = dist[i-w] + 1;
+            }
+        }
+    }
+    /* Closest seed below */
+    for (y = h-1; y-- > 0;) {
+        for (x = from; x < to; x++) {
+            size_t i = y*w+x;
+            if (labels[i+w] != VORONOI_NO_SEED
+             && (labels[i] == VORONOI_NO_SEED || dist[i+w] + 1 < dist[i])) {
+                labels[i] = labels[i+w];
+                dist[i] = dist[i+w] + 1;
+            }
+        }
+    }
+    return U_ERROR_SUCCESS;
+}
+
+static int edt_rows(void* arg, size_t from, size_t to) {
+    /* Finds the closest seed for each pixel in rows [from, to), by taking the
+    lower envelope of the parabolas (x-q)^2 + dist[q]^2 for each column q
+    (Felzenszwalb & Huttenlocher, "Distance Transforms of Sampled Functions"). */
+    edt_state_t* state = arg;
+    int w = state->w;
+    int* v = malloc(w * sizeof(*v)); /* Columns whose parabolas are in the envelope */
+    double* z = malloc((w+1) * sizeof(*z)); /* z[k]..z[k+1] is where parabola v[k] is lowest */
+    double* f = malloc(w * sizeof(*f)); /* f[q] = dist[q]^2 + q^2 */
+    if (!v || !z || !f) {
+        free(v);
+        free(z);
+        free(f);
+        return u_error_nomem();
+    }
+
+    size_t y;
+    for (y = from; y < to; y++) {
+        const u_u32_t* labels = &state->labels[y*w];
+        const u_u32_t* dist = &state->dist[y*w];
+        u_color_t* row = state->pixels[y];
+        int q, x, k = -1;
+        for (q = 0; q < w; q++) {
+            if (labels[q] == VORONOI_NO_SEED) continue; /* No seeds in this column */
+            f[q] = (double)dist[q] * dist[q] + (double)q * q;
+            double s = -1;
+            while (k >= 0) {
+                s = (f[q] - f[v[k]]) / (2.0 * (q - v[k]));
+                if (s > z[k]) break;
+                k--;
+            }
+            k++;
+            v[k] = q;
+            z[k] = k == 0 ? -1 : s;
+            z[k+1] = w;
+        }
+        if (k < 0) continue; /* Only happens if there are no seeds at all */
+        k = 0;
+        for (x = 0; x < w; x++) {
+            while (z[k+1] < x) k++;
+            row[x] = state->seeds[labels[v[k]]].color;
+        }
+    }
+    free(v);
+    free(z);
+    free(f);
+    return U_ERROR_SUCCESS;
+}
+
+static int voronoify_seeds_exact(u_image_t* image, const point_t* seeds, size_t nseeds) {
+    edt_state_t state;
+    state.w = u_image_width_get(image);
+    state.h = u_image_height_get(image);
+    state.seeds = seeds;
+    state.pixels = u_image_pixels_get(image);
+    size_t npixels = (size_t)state.w * state.h, i;
+    state.labels = malloc(npixels * sizeof(*state.labels));
+    state.dist = malloc(npixels * sizeof(*state.dist));
+    if (!state.labels || !state.dist) {
+        free(state.labels);
+        free(state.dist);
+        return u_error_nomem();
+    }
+    for (i = 0; i < npixels; i++)
+        state.labels[i] = VORONOI_NO_SEED;
+    for (i = 0; i < nseeds; i++)
+        state.labels[(size_t)seeds[i].point[1] * state.w + (size_t)seeds[i].point[0]] = i;
+
+    int err = u_threads_for(state.w, VORONOI_BLOCK, edt_columns, &state);
+    if (!err)
+        err = u_threads_for(state.h, VORONOI_BLOCK, edt_rows, &state);
+    free(state.labels);
+    free(state.dist);
+    return err;
+}
+
+typedef struct {
+    int w;
+    int y_start, y_end; /* The band of rows being drawn */
+    const point_t* seeds;
+    u_kdtree_t kdtree; /* The values are indices into seeds */
+    u_color_t** pixels; /* pixels[y - y_start] is row y */
+} tile_state_t;
+
+typedef struct {
+    u_u32_t* idxs; /* Indices of seeds which could be closest to some pixel in a tile */
+    size_t n, capacity;
+    int err;
+} candidates_t;
+
+static void candidates_add(const float* key, const void* value, void* arg) {
+    candidates_t* candidates = arg;
+    if (candidates->err) return;
+    if (candidates->n >= candidates->capacity) {
+        size_t capacity = candidates->capacity ? 2 * candidates->capacity : 64;
+        u_u32_t* idxs = realloc(candidates->idxs, capacity * sizeof(*idxs));
+        if (!idxs) {
+            candidates->err = u_error_nomem();
+            return;
+        }
+        candidates->idxs = idxs;
+        candidates->capacity = capacity;
+    }
+    candidates->idxs[candidates->n++] = *(const u_u32_t*)value;
+}
+
+static u_u32_t nearest_candidate(const point_t* seeds, const u_u32_t* idxs, size_t n, int x, int y) {
+    double best_distance = -1;
+    u_u32_t best = 0;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        const float* point = seeds[idxs[i]].point;
+        double dx = point[0] - x, dy = point[1] - y;
+        double distance = dx * dx + dy * dy;
+        if (best_distance < 0 || distance < best_distance) {
+            best_distance = distance;
+            best = idxs[i];
+        }
+    }
+    return best;
+}
+
+static void fill_tile(u_color_t** rows, const point_t* seeds, const u_u32_t* idxs, size_t n, int x0, int y0, int x1, int y1) {
+    /* Fills in the pixels with x0 <= x < x1, y0 <= y < y1, given that the closest seed
+    to each of them is one of idxs[0..n]. rows[0] is row y0. */
+    int x, y;
+    for (y = y0; y < y1; y++)
+        for (x = x0; x < x1; x++)
+            rows[y-y0][x] = seeds[nearest_candidate(seeds, idxs, n, x, y)].color;
+}
+
+static int tile_candidates(u_kdtree_t* kdtree, int x0, int y0, int x1, int y1, float slack, candidates_t* candidates) {
+    /* Puts every seed which could be the closest seed to some pixel in the tile into
+    candidates, even if every seed moves by up to slack. */
+
+    /* Every pixel is within half_diagonal of the center, so it is within
+    r + half_diagonal of the seed closest to the center, so its closest seed
+    is within r + 2 * half_diagonal of the center. If the seeds move by up to slack,
+    that becomes r + 2 * half_diagonal + slack, and a seed which was further than
+    r + 2 * half_diagonal + 2 * slack away can still only get within r + 2 * half_diagonal + slack. */
+    float center[2];
+    center[0] = (x0 + x1 - 1) * 0.5f;
+    center[1] = (y0 + y1 - 1) * 0.5f;
+    const float* nearest_key;
+    u_kdtree_nearest(kdtree, center, &nearest_key);
+    double dx = nearest_key[0] - center[0], dy = nearest_key[1] - center[1];
+    double r = sqrt(dx * dx + dy * dy);
+    double half_diagonal = 0.5 * sqrt((double)(x1-1-x0) * (x1-1-x0) + (double)(y1-1-y0) * (y1-1-y0));
+    candidates->n = 0;
+    u_kdtree_within(kdtree, center, r + 2 * half_diagonal + 2 * slack + 0.5, candidates_add, candidates);
+    return candidates->err;
+}
+
+static u_u32_t tile_nearest(tile_state_t* state, float x, float y) {
+    float p[2];
+    p[0] = x;
+    p[1] = y;
+    return *(const u_u32_t*)u_kdtree_nearest(&state->kdtree, p, NULL);
+}
+
+static int voronoify_tile(tile_state_t* state, candidates_t* candidates, int x0, int y0, int x1, int y1) {
+    /* Fills in the pixels with x0 <= x < x1, y0 <= y < y1. */
+    int x, y;
+    u_u32_t corner = tile_nearest(state, x0, y0);
+    if (tile_nearest(state, x1-1, y0) == corner
+     && tile_nearest(state, x0, y1-1) == corner
+     && tile_nearest(state, x1-1, y1-1) == corner) {
+        /* Voronoi cells are convex, so if all the corners are in one cell, so is the whole tile. */
+        u_color_t color = state->seeds[corner].color;
+        for (y = y0; y < y1; y++)
+            for (x = x0; x < x1; x++)
+                state->pixels[y - state->y_start][x] = color;
+        return U_ERROR_SUCCESS;
+    }
+
+    int err = tile_candidates(&state->kdtree, x0, y0, x1, y1, 0, candidates);
+    if (err) return err;
+
+    if (candidates->n > VORONOI_MAX_CANDIDATES && x1 - x0 > 1 && y1 - y0 > 1) {
+        /* Too many candidates to check for every pixel; split the tile into quarters. */
+        int xm = (x0 + x1) / 2, ym = (y0 + y1) / 2;
+        if ((err = voronoify_tile(state, candidates, x0, y0, xm, ym))) return err;
+        if ((err = voronoify_tile(state, candidates, xm, y0, x1, ym))) return err;
+        if ((err = voronoify_tile(state, candidates, x0, ym, xm, y1))) return err;
+        return voronoify_tile(state, candidates, xm, ym, x1, y1);
+    }
+
+    fill_tile(&state->pixels[y0 - state->y_start], state->seeds, candidates->idxs, candidates->n, x0, y0, x1, y1);
+    return U_ERROR_SUCCESS;
+}
+
+static int voronoify_tiles(void* arg, size_t from, size_t to) {
+    tile_state_t* state = arg;
+    size_t tiles_per_row = (state->w + VORONOI_TILE_SIZE - 1) / VORONOI_TILE_SIZE;
+    candidates_t candidates;
+    candidates.idxs = NULL;
+    candidates.n = candidates.capacity = 0;
+    candidates.err = U_ERROR_SUCCESS;
+    size_t tile;
+    int err = U_ERROR_SUCCESS;
+    for (tile = from; tile < to && !err; tile++) {
+        int x0 = (tile % tiles_per_row) * VORONOI_TILE_SIZE;
+        int y0 = state->y_start + (tile / tiles_per_row) * VORONOI_TILE_SIZE;
+        int x1 = x0 + VORONOI_TILE_SIZE, y1 = y0 + VORONOI_TILE_SIZE;
+        if (x1 > state->w) x1 = state->w;
+        if (y1 > state->y_end) y1 = state->y_end;
+        err = voronoify_tile(state, &candidates, x0, y0, x1, y1);
+    }
+    free(candidates.idxs);
+    return err;
+}
+
+static int tile_state_init(tile_state_t* state, int w, const point_t* seeds, size_t nseeds) {
+    /* Builds the k-d tree. */
+    state->w = w;
+    state->seeds = seeds;
+    u_kdtree_construct(&state->kdtree, 2, sizeof(u_u32_t));
+    float* keys = malloc(2 * nseeds * sizeof(*keys));
+    u_u32_t* idxs = malloc(nseeds * sizeof(*idxs));
+    if (!keys || !idxs) {
+        free(keys);
+        free(idxs);
+        return u_error_nomem();
+    }
+    size_t i;
+    for (i = 0; i < nseeds; i++) {
+        keys[2*i+0] = seeds[i].point[0];
+        keys[2*i+1] = seeds[i].point[1];
+        idxs[i] = i;
+    }
+    int err = u_kdtree_build(&state->kdtree, keys, idxs, nseeds);
+    free(keys);
+    free(idxs);
+    if (err) return u_error_code;
+    return U_ERROR_SUCCESS;
+}
+
+static int voronoify_band(tile_state_t* state, u_color_t** rows, int y_start, int y_end) {
+    /* Draws rows y_start to y_end into rows[0..y_end-y_start]. */
+    state->pixels = rows;
+    state->y_start = y_start;
+    state->y_end = y_end;
+    size_t ntiles = ((state->w + VORONOI_TILE_SIZE - 1) / VORONOI_TILE_SIZE)
+                  * ((y_end - y_start + VORONOI_TILE_SIZE - 1) / VORONOI_TILE_SIZE);
+    return u_threads_for(ntiles, 4, voronoify_tiles, state);
+}
+
+static int voronoify_seeds_kdtree(u_image_t* image, const point_t* seeds, size_t nseeds) {
+    tile_state_t state;
+    int err = tile_state_init(&state, u_image_width_get(image), seeds, nseeds);
+    if (err) return err;
+    err = voronoify_band(&state, u_image_pixels_get(image), 0, u_image_height_get(image));
+    u_kdtree_destroy(&state.kdtree);
+    return err;
+}
+
+static int voronoify_image(u_image_t* image, cr_voronoi_method_t method) {
     /* Frees image on failure */
 
     int w = u_image_width_get(image), h = u_image_height_get(image);
 
     u_color_t** pixels = u_image_pixels_get(image);
-    int x, y, nseeds = 0;
+    int x, y;
+    size_t nseeds = 0;
     for (y = 0; y < h; y++) {
         for (x = 0; x < w; x++) {
             if (u_color_to_u32(pixels[y][x]) != 0xFFFFFFFF) {
@@ -46,6 +355,10 @@ static int voronoify_image(u_image_t* image) {
             }
         }
     }
+    if (nseeds == 0) {
+        u_image_free(image);
+        return u_error_set(U_ERROR_ARGUMENT, "Voronoi diagram has no seeds (the image is entirely white).");
+    }
     point_t* seeds = malloc(nseeds * sizeof(*seeds));
     if (!seeds) {
         u_image_free(image);
@@ -62,41 +375,30 @@ static int voronoify_image(u_image_t* image) {
             }
         }
     }
-    int err = u_rand_shuffle(seeds, nseeds, sizeof(*seeds));
-    if (err) return err;
 
-    u_kdtree_t kdtree;
-    u_kdtree_construct(&kdtree, 2, sizeof(u_color_t));
-    int i;
-    for (i = 0; i < nseeds; i++) {
-        int err = u_kdtree_insert(&kdtree, seeds[i].point, &seeds[i].color);
-        if (err) {
-            free(seeds);
-            u_image_free(image);
-            u_kdtree_destroy(&kdtree);
-            return err;
-        }
-    }
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            float p[2] = {x, y};
-            u_color_t closest_color =
-                *(const u_color_t*)u_kdtree_nearest(&kdtree, p, NULL);
-            pixels[y][x] = closest_color;
-        }
+    int err;
+    switch (method) {
+    case CR_VORONOI_EXACT:
+        err = voronoify_seeds_exact(image, seeds, nseeds);
+        break;
+    default:
+        err = voronoify_seeds_kdtree(image, seeds, nseeds);
+        break;
     }
-
     free(seeds);
-    u_kdtree_destroy(&kdtree);
+    if (err) {
+        u_image_free(image);
+        return err;
+    }
     return U_ERROR_SUCCESS;
 }
 
-int cr_voronoify(const char* filename_in, const char* filename_out) {
+int cr_voronoify(const char* filename_in, const char* filename_out, cr_voronoi_method_t method) {
     u_image_t* image = u_image_read(filename_in);
     if (!image)
         return U_ERROR_OTHER;
 
-    int err = voronoify_image(image);
+    int err = voronoify_image(image, method);
     if (err) {
         return err;
     }
@@ -110,22 +412,347 @@ int cr_voronoify(const char* filename_in, const char* filename_out) {
     return U_ERROR_SUCCESS;
 }
 
+static int voronoi_seeds_stream(const point_t* seeds, size_t nseeds, int width, int height, const char* filename_out) {
+    /* Draws the diagram with CR_VORONOI_KDTREE a band at a time, writing each band as soon as it's done. */
+    int band_height = height < VORONOI_BAND_HEIGHT ? height : VORONOI_BAND_HEIGHT;
+    u_color_t** rows = malloc(band_height * sizeof(*rows));
+    u_color_t* band = malloc((size_t)band_height * width * sizeof(*band));
+    if (!rows || !band) {
+        free(rows);
+        free(band);
+        return u_error_nomem();
+    }
+    int y;
+    for (y = 0; y < band_height; y++)
+        rows[y] = &band[(size_t)y * width];
+
+    tile_state_t state;
+    int err = tile_state_init(&state, width, seeds, nseeds);
+    if (err) {
+        free(rows);
+        free(band);
+        return err;
+    }
+    u_image_writer_t* writer = u_image_writer_open(filename_out, width, height);
+    if (!writer) err = u_error_code;
+
+    for (y = 0; y < height && !err; y += band_height) {
+        int y_end = y + band_height > height ? height : y + band_height;
+        err = voronoify_band(&state, rows, y, y_end);
+        if (!err)
+            err = u_image_writer_rows_write(writer, rows, y_end - y);
+    }
+    if (writer) {
+        int close_err = u_image_writer_close(writer);
+        if (!err) err = close_err;
+    }
+
+    u_kdtree_destroy(&state.kdtree);
+    free(rows);
+    free(band);
+    return err;
+}
+
 int cr_voronoi_random(int width, int height, int nseeds, const char* filename_out) {
-    u_image_t* image = u_image_new(width, height, u_color_from_rgb(255, 255, 255));
-    u_color_t** pixels = u_image_pixels_get(image);
-    int i, x, y;
+    if (width <= 0 || height <= 0 || nseeds <= 0)
+        return u_error_set(U_ERROR_ARGUMENT, "The width, height and number of seeds of a voronoi diagram must be positive.");
+    point_t* seeds = malloc(nseeds * sizeof(*seeds));
+    if (!seeds)
+        return u_error_nomem();
+    int i;
     for (i = 0; i < nseeds; i++) {
-        x = rand() % width;
-        y = rand() % height;
-        pixels[y][x] = u_color_random_rgb();
+        seeds[i].point[0] = u_rand_int(0, width);
+        seeds[i].point[1] = u_rand_int(0, height);
+        seeds[i].color = u_color_random_rgb();
     }
-    int err = voronoify_image(image);
+    int err = voronoi_seeds_stream(seeds, nseeds, width, height, filename_out);
+    free(seeds);
+    return err;
+}
+
+static int voronoi_seeds_read_raw(FILE* in, int* width, int* height, point_t** seeds, size_t* nseeds) {
+    u_u4b_t header[3], rgba;
+    if (fread(header, sizeof(*header), 3, in) != 3)
+        return u_error_set(U_ERROR_FORMAT, "Invalid voronoi seeds file.");
+    *width = header[0];
+    *height = header[1];
+    *nseeds = header[2];
+    *seeds = malloc(*nseeds * sizeof(**seeds));
+    if (!*seeds)
+        return u_error_nomem();
+    size_t i;
+    for (i = 0; i < *nseeds; i++) {
+        point_t* seed = &(*seeds)[i];
+        if (fread(seed->point, sizeof(*seed->point), 2, in) != 2
+         || fread(&rgba, sizeof(rgba), 1, in) != 1) {
+            free(*seeds);
+            *seeds = NULL;
+            return u_error_set(U_ERROR_FORMAT, "Invalid voronoi seeds file.");
+        }
+        seed->color = u_color_from_u32_rgba(rgba);
+    }
+    return U_ERROR_SUCCESS;
+}
+
+static int voronoi_seeds_read_text(FILE* in, int* width, int* height, point_t** seeds, size_t* nseeds) {
+    if (fscanf(in, "%d%d", width, height) != 2)
+        return u_error_set(U_ERROR_FORMAT, "Invalid voronoi seeds file.");
+    size_t capacity = 1024;
+    *nseeds = 0;
+    *seeds = malloc(capacity * sizeof(**seeds));
+    if (!*seeds)
+        return u_error_nomem();
+    float x, y;
+    unsigned long rgba;
+    int nread;
+    while ((nread = fscanf(in, "%f%f%lx", &x, &y, &rgba)) == 3) {
+        if (*nseeds >= capacity) {
+            capacity *= 2;
+            point_t* new_seeds = realloc(*seeds, capacity * sizeof(**seeds));
+            if (!new_seeds) {
+                free(*seeds);
+                *seeds = NULL;
+                return u_error_nomem();
+            }
+            *seeds = new_seeds;
+        }
+        point_t* seed = &(*seeds)[(*nseeds)++];
+        seed->point[0] = x;
+        seed->point[1] = y;
+        seed->color = u_color_from_u32_rgba(rgba);
+    }
+    if (nread != EOF) {
+        free(*seeds);
+        *seeds = NULL;
+        return u_error_set(U_ERROR_FORMAT, "Invalid voronoi seeds file.");
+    }
+    return U_ERROR_SUCCESS;
+}
+
+int cr_voronoi_seeds(const char* filename_in, const char* filename_out, cr_voronoi_method_t method) {
+    const char* extension = strrchr(filename_in, '.');
+    u_bool_t is_raw = extension && !strcmp(extension, ".raw");
+    FILE* in = fopen(filename_in, is_raw ? "rb" : "r");
+    if (!in)
+        return u_error_fopen(filename_in, "reading");
+    int width, height;
+    point_t* seeds = NULL;
+    size_t nseeds = 0, i;
+    int err = is_raw ? voronoi_seeds_read_raw(in, &width, &height, &seeds, &nseeds)
+                     : voronoi_seeds_read_text(in, &width, &height, &seeds, &nseeds);
+    fclose(in);
     if (err) return err;
-    err = u_image_write(filename_out, image);
-    if (err) {
+
+    if (width <= 0 || height <= 0 || nseeds == 0) {
+        free(seeds);
+        return u_error_set(U_ERROR_ARGUMENT, "The width, height and number of seeds of a voronoi diagram must be positive.");
+    }
+    if (method == CR_VORONOI_EXACT) {
+        for (i = 0; i < nseeds; i++) {
+            if (!(seeds[i].point[0] >= 0 && seeds[i].point[0] < width
+               && seeds[i].point[1] >= 0 && seeds[i].point[1] < height)) {
+                free(seeds);
+                return u_error_set(U_ERROR_BOUNDS, "Voronoi seed outside of the image (only allowed with --voronoi-method=kdtree).");
+            }
+        }
+        u_image_t* image = u_image_new(width, height, u_color_from_rgb(255, 255, 255));
+        if (!image) {
+            free(seeds);
+            return u_error_code;
+        }
+        err = voronoify_seeds_exact(image, seeds, nseeds);
+        if (!err)
+            err = u_image_write(filename_out, image);
         u_image_free(image);
+    } else {
+        err = voronoi_seeds_stream(seeds, nseeds, width, height, filename_out);
+    }
+    free(seeds);
+    return err;
+}
+
+typedef struct {
+    int w, h;
+    size_t nseeds, tiles_per_row;
+    point_t* seeds;
+    float* anchors; /* Where each seed was when the candidate lists were made */
+    u_bool_t* moved; /* Whether each seed moved since the last frame */
+    u_u32_t* idxs; /* idxs[i] = i, the values for the k-d tree */
+    u_kdtree_t kdtree;
+    candidates_t* tiles; /* The seeds which could be closest to some pixel in each tile */
+    u_bool_t rebuild; /* Do the candidate lists need to be remade? */
+    u_color_t** pixels;
+} animation_state_t;
+
+static int animate_tiles(void* arg, size_t from, size_t to) {
+    animation_state_t* state = arg;
+    size_t tile, i;
+    for (tile = from; tile < to; tile++) {
+        candidates_t* candidates = &state->tiles[tile];
+        int x0 = (tile % state->tiles_per_row) * VORONOI_ANIMATION_TILE_SIZE;
+        int y0 = (tile / state->tiles_per_row) * VORONOI_ANIMATION_TILE_SIZE;
+        int x1 = x0 + VORONOI_ANIMATION_TILE_SIZE, y1 = y0 + VORONOI_ANIMATION_TILE_SIZE;
+        if (x1 > state->w) x1 = state->w;
+        if (y1 > state->h) y1 = state->h;
+        if (state->rebuild) {
+            int err = tile_candidates(&state->kdtree, x0, y0, x1, y1, VORONOI_ANIMATION_SLACK, candidates);
+            if (err) return err;
+        } else {
+            /* The closest seed to each pixel is always one of the candidates, so if
+            none of them moved, nothing in this tile changed. */
+            for (i = 0; i < candidates->n; i++)
+                if (state->moved[candidates->idxs[i]])
+                    break;
+            if (i == candidates->n) continue;
+        }
+        u_u32_t corner = nearest_candidate(state->seeds, candidates->idxs, candidates->n, x0, y0);
+        if (nearest_candidate(state->seeds, candidates->idxs, candidates->n, x1-1, y0) == corner
+         && nearest_candidate(state->seeds, candidates->idxs, candidates->n, x0, y1-1) == corner
+         && nearest_candidate(state->seeds, candidates->idxs, candidates->n, x1-1, y1-1) == corner) {
+            fill_tile(&state->pixels[y0], state->seeds, &corner, 1, x0, y0, x1, y1);
+        } else {
+            fill_tile(&state->pixels[y0], state->seeds, candidates->idxs, candidates->n, x0, y0, x1, y1);
+        }
+    }
+    return U_ERROR_SUCCESS;
+}
+
+static int animation_rebuild(animation_state_t* state) {
+    /* Remakes the k-d tree from the current positions of the seeds. The candidate
+    lists are remade by the next call to animate_tiles. */
+    size_t i;
+    for (i = 0; i < state->nseeds; i++) {
+        state->anchors[2*i+0] = state->seeds[i].point[0];
+        state->anchors[2*i+1] = state->seeds[i].point[1];
+    }
+    if (u_kdtree_build(&state->kdtree, state->anchors, state->idxs, state->nseeds))
+        return u_error_code;
+    state->rebuild = U_TRUE;
+    return U_ERROR_SUCCESS;
+}
+
+static int animation_frame_filename(const char* pattern, unsigned long frame, char* filename) {
+    /* Puts the name of the file for this frame into filename, which should be at
+    least strlen(pattern) + 32 bytes long. pattern must have exactly one %d (e.g. %04d). */
+    const char* percent = strchr(pattern, '%');
+    const char* d = percent ? percent + 1 : NULL;
+    if (d) while (*d >= '0' && *d <= '9' && d - percent < 4) d++;
+    if (!d || *d != 'd' || strchr(d, '%'))
+        return u_error_set(U_ERROR_ARGUMENT, "The output filename for an animation must contain a number format like %04d (and no other % signs).");
+    char format[8];
+    memcpy(format, percent, d - percent);
+    strcpy(&format[d - percent], "lu");
+    memcpy(filename, pattern, percent - pattern);
+    sprintf(&filename[percent - pattern], format, frame);
+    strcat(filename, d + 1);
+    return U_ERROR_SUCCESS;
+}
+
+static void animation_state_free(animation_state_t* state) {
+    size_t i;
+    if (state->tiles) {
+        for (i = 0; i < state->tiles_per_row * ((state->h + VORONOI_ANIMATION_TILE_SIZE - 1) / VORONOI_ANIMATION_TILE_SIZE); i++)
+            free(state->tiles[i].idxs);
+    }
+    free(state->tiles);
+    free(state->seeds);
+    free(state->anchors);
+    free(state->moved);
+    free(state->idxs);
+    u_kdtree_destroy(&state->kdtree);
+}
+
+int cr_voronoi_animate(const char* trajectory_filename, const char* filename_pattern) {
+    char* filename = malloc(strlen(filename_pattern) + 32);
+    if (!filename)
+        return u_error_nomem();
+    int err = animation_frame_filename(filename_pattern, 0, filename);
+    if (err) {
+        free(filename);
         return err;
     }
+
+    FILE* in = fopen(trajectory_filename, "r");
+    if (!in) {
+        free(filename);
+        return u_error_fopen(trajectory_filename, "reading");
+    }
+    int w, h;
+    unsigned long nseeds, nframes;
+    if (fscanf(in, "%d%d%lu%lu", &w, &h, &nseeds, &nframes) != 4 || w <= 0 || h <= 0 || nseeds == 0) {
+        fclose(in);
+        free(filename);
+        return u_error_set(U_ERROR_FORMAT, "Invalid voronoi animation file.");
+    }
+
+    animation_state_t state;
+    memset(&state, 0, sizeof(state));
+    u_kdtree_construct(&state.kdtree, 2, sizeof(u_u32_t));
+    state.w = w;
+    state.h = h;
+    state.nseeds = nseeds;
+    state.tiles_per_row = (w + VORONOI_ANIMATION_TILE_SIZE - 1) / VORONOI_ANIMATION_TILE_SIZE;
+    size_t ntiles = state.tiles_per_row * ((h + VORONOI_ANIMATION_TILE_SIZE - 1) / VORONOI_ANIMATION_TILE_SIZE);
+    state.seeds = malloc(nseeds * sizeof(*state.seeds));
+    state.anchors = malloc(2 * nseeds * sizeof(*state.anchors));
+    state.moved = malloc(nseeds * sizeof(*state.moved));
+    state.idxs = malloc(nseeds * sizeof(*state.idxs));
+    state.tiles = calloc(ntiles, sizeof(*state.tiles));
+    u_image_t* image = u_image_new(w, h, u_color_from_rgb(255, 255, 255));
+    if (!state.seeds || !state.anchors || !state.moved || !state.idxs || !state.tiles || !image) {
+        if (image) u_image_free(image);
+        animation_state_free(&state);
+        fclose(in);
+        free(filename);
+        return u_error_nomem();
+    }
+    state.pixels = u_image_pixels_get(image);
+
+    size_t i;
+    for (i = 0; i < nseeds; i++) {
+        unsigned long rgba;
+        if (fscanf(in, "%lx", &rgba) != 1) {
+            err = u_error_set(U_ERROR_FORMAT, "Invalid voronoi animation file (expected a color).");
+            break;
+        }
+        state.seeds[i].color = u_color_from_u32_rgba(rgba);
+        state.idxs[i] = i;
+    }
+
+    unsigned long frame;
+    for (frame = 0; frame < nframes && !err; frame++) {
+        float max_displacement = 0;
+        for (i = 0; i < nseeds; i++) {
+            float p[2];
+            if (fscanf(in, "%f%f", &p[0], &p[1]) != 2) {
+                err = u_error_set(U_ERROR_FORMAT, "Invalid voronoi animation file (expected a seed position).");
+                break;
+            }
+            state.moved[i] = frame == 0 || p[0] != state.seeds[i].point[0] || p[1] != state.seeds[i].point[1];
+            state.seeds[i].point[0] = p[0];
+            state.seeds[i].point[1] = p[1];
+            if (frame > 0) {
+                float dx = p[0] - state.anchors[2*i+0], dy = p[1] - state.anchors[2*i+1];
+                float displacement = sqrt(dx * dx + dy * dy);
+                if (displacement > max_displacement) max_displacement = displacement;
+            }
+        }
+        if (err) break;
+        if (frame == 0 || max_displacement > VORONOI_ANIMATION_SLACK) {
+            /* The seeds have moved too far for the candidate lists to be right */
+            err = animation_rebuild(&state);
+            if (err) break;
+        }
+        err = u_threads_for(ntiles, 4, animate_tiles, &state);
+        if (err) break;
+        state.rebuild = U_FALSE;
+        animation_frame_filename(filename_pattern, frame, filename);
+        err = u_image_write(filename, image);
+    }
+
     u_image_free(image);
-    return U_ERROR_SUCCESS;
+    animation_state_free(&state);
+    fclose(in);
+    free(filename);
+    return err;
 }
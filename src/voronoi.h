@@ -21,12 +21,66 @@
 
 Just something I made on the side to test out the k-d tree implementation I made.
 
-Takes `O(width*height*log(nseeds))` time (in theory)
+There are two ways of making the diagram (see \ref cr_voronoi_method_t).
+\ref CR_VORONOI_KDTREE takes `O(width*height*log(nseeds))` time (in theory),
+but it splits the image into tiles, and only checks the few seeds which could
+be closest to some pixel in each tile. If all four corners of a tile are closest
+to the same seed, the whole tile is (because voronoi cells are convex).
+\ref CR_VORONOI_EXACT uses a separable distance transform: it finds the
+closest seed in each column, then the closest seed in each row out of those,
+so it takes `O(width*height)` time no matter how many seeds there are, and
+both passes are split across threads (see utils/misc/threads.h).
 */
 
 #ifndef COLORREDUCER_VORONOI_H
 #define COLORREDUCER_VORONOI_H
 
-int cr_voronoify(const char* filename_in, const char* filename_out); /**< Turns a PNG file from a set of seeds (colored pixels) into a voronoi diagram. The image should be entirely white (#FFFFFFFF), except for the seeds of the voronoi diagram. \returns An error code, or zero on success. Check \ref u_error_message for the error message. */
-int cr_voronoi_random(int width, int height, int nseeds, const char* filename_out); /**< Produces a voronoi diagram with a random set of \p nseeds different points and colors. \returns An error code. */
+typedef enum {
+    CR_VORONOI_KDTREE, /**< Look up the closest seed to every pixel in a k-d tree. */
+    CR_VORONOI_EXACT /**< Exact euclidean voronoi diagram, using a distance transform. */
+} cr_voronoi_method_t;
+
+int cr_voronoify(const char* filename_in, const char* filename_out, cr_voronoi_method_t method); /**< Turns a PNG file from a set of seeds (colored pixels) into a voronoi diagram. The image should be entirely white (#FFFFFFFF), except for the seeds of the voronoi diagram. \returns An error code, or zero on success. Check \ref u_error_message for the error message. */
+/** Produces a voronoi diagram with a random set of \p nseeds different points and colors.
+    This always uses \ref CR_VORONOI_KDTREE, and draws the diagram a band of rows
+    at a time, writing each band to the file as soon as it is done, so only a few
+    hundred rows of the image are ever in memory. \returns An error code. */
+int cr_voronoi_random(int width, int height, int nseeds, const char* filename_out);
+/**
+Makes a voronoi diagram from a file listing the seeds, rather than an image.
+If \p filename_in ends in `.raw`, it should be in this format:
+```
+<width, 4 bytes unsigned integer><height, 4 bytes unsigned integer><number of seeds, 4 bytes unsigned integer>
+<x of first seed, float><y of first seed, float><color of first seed, 4 bytes unsigned integer 0xRRGGBBAA>
+<x of second seed> ...
+```
+Otherwise, it should be a text file in this format:
+```
+<width> <height>
+<x of first seed> <y of first seed> <color of first seed, as hexadecimal RRGGBBAA>
+<x of second seed> ...
+```
+With \ref CR_VORONOI_KDTREE, the diagram is written a band of rows at a time,
+like \ref cr_voronoi_random. \returns An error code.
+*/
+int cr_voronoi_seeds(const char* filename_in, const char* filename_out, cr_voronoi_method_t method);
+/**
+Makes a numbered sequence of voronoi diagrams from a file describing how the seeds move.
+The file should be a text file in this format:
+```
+<width> <height> <number of seeds> <number of frames>
+<color of first seed, as hexadecimal RRGGBBAA> <color of second seed> ...
+<x of first seed in first frame> <y of first seed in first frame> <x of second seed in first frame> ...
+<x of first seed in second frame> ...
+...
+```
+The image is split into tiles, each with a list of the seeds which could be
+closest to some pixel in it, which is only remade when some seed has moved more
+than a few pixels. Tiles none of whose candidate seeds moved since the last frame
+are kept as they are.
+\param trajectory_filename The name of the file in the format above.
+\param filename_pattern The name of the output files, with a number format such as `%04d` in it, which will be replaced by the frame number (starting from 0).
+\returns An error code.
+*/
+int cr_voronoi_animate(const char* trajectory_filename, const char* filename_pattern);
 #endif /* COLORREDUCER_VORON_H */
@@ -1,9 +1,9 @@
 #!/usr/bin/python
-# Converts a video file to a raw file
+# Converts a video file to a raw file (version 2, with 8-bit values; see src/rawreducer.h)
 # The size of the raw file is approximately
-# 12 * video frame rate * video length * video width (pixels) * video height bytes
+# 3 * video frame rate * video length * video width (pixels) * video height bytes
 # This is VERY BIG for long/high-resolution videos.
-# 10 seconds of 1920x1080 30fps video will be about 7.5 GB.
+# 10 seconds of 1920x1080 30fps video will be about 1.9 GB.
 # A warning will be shown if the size of the output file will exceed 1GB.
 # It will also take a long time for long videos, so it is recommended that
 # you reduce the resolution and/or framerate and/or length of the video
@@ -14,9 +14,13 @@
 # it, which you can use ffmpeg to do
 
 import cv2
+import struct
 import sys
 import numpy as np
 
+RAW_MAGIC = '\x89RAW\r\n\x1a\n'
+RAW_U8 = 3
+
 if len(sys.argv) < 3:
     print 'Error: Usage: {} <input file> <output file>'.format(sys.argv[0])
 
@@ -27,10 +31,8 @@ height = int(cap.get(cv2.cv.CV_CAP_PROP_FRAME_HEIGHT))
 framerate = int(cap.get(cv2.cv.CV_CAP_PROP_FPS))
 output_file = open(sys.argv[2], "wb")
 ndata = nframes * width * height
-if ndata > (2 ** 32 - 1):
-    raise ValueError('Video file or pixels_to_use_per_frame is too big. It must be that the number of frames in the video multiplied by pixels_to_use_per_frame is less than 2^32.')
 
-filesize = 12 * nframes * width * height
+filesize = 3 * nframes * width * height
 if filesize >= 1e9:
     sys.stderr.write('Warning: This program is about to create a large file ({} GB).\nWould you like to create the file (yes/no)? '.format(filesize/1e9))
     sys.stderr.flush()
@@ -40,8 +42,8 @@ if filesize >= 1e9:
         sys.exit(0)
 
 data_size = 3
-size = np.array([ndata, data_size], dtype='uint32')
-size.tofile(output_file)
+# Version 2 header: 8-bit little-endian values, no codebook
+output_file.write(RAW_MAGIC + struct.pack('<BBBBIQIB3x', 2, RAW_U8, 0, 0, data_size, ndata, 0, 0))
 
 frameno = 0
 while True:
@@ -54,7 +56,7 @@ while True:
     if colors < 3:
         raise AttributeError('Video must have at least 3 color channels')
 
-    (frame.flatten()/256.).astype(np.float32).tofile(output_file)
+    frame.astype(np.uint8).tofile(output_file)
 
 cap.release()
 output_file.close()